@@ -5,4 +5,40 @@ const int OP_INTER = 2;
 const int SHADING_MODE_SHADED = 0;
 const int SHADING_MODE_HEATMAP = 1;
 const int SHADING_MODE_NORMALS = 2;
-const int SHADING_MODE_BEAUTY = 3;
\ No newline at end of file
+const int SHADING_MODE_BEAUTY = 3;
+const int SHADING_MODE_COST = 4; // heatmap of the evaluation cost, also writes per-pixel counters
+const int NUM_SHADING_MODES = 5;
+
+// per-pixel counters of SHADING_MODE_COST, stored as consecutive planes: tracing steps,
+// node evaluations while tracing, node evaluations in the shadow rays and AO samples
+const int PIXEL_COST_NUM_COUNTERS = 3;
+
+// num_active of the cells that frustum pruning left unpruned because they are outside of the view frustum,
+// they are evaluated with the full tree
+const int CELL_NOT_PRUNED = -1;
+
+// num_active of the cells whose descendants reuse their active list (see LodParams), encoded as CELL_LOD_TERMINAL - num_active.
+// Only the intermediate levels hold it, the final level stores the decoded count
+const int CELL_LOD_TERMINAL = -2;
+
+// default value of the STACK_DEPTH specialization constant
+const int DEFAULT_STACK_DEPTH = 128;
+// default value of the PRIM_TYPES specialization constant: bit t is set when the tree can hold primitives of type t
+const int ALL_PRIM_TYPES = 15;
+
+// bins of the per-level histogram of active nodes per cell, see pruning_stats.comp.glsl
+const int PRUNING_STATS_NUM_BINS = 16;
+
+// passes of tree_convert.comp.glsl, which converts a CSGNode array to the GPU tree (see convert_tree_gpu)
+const int TREE_CONVERT_PASS_LINKS = 0;
+const int TREE_CONVERT_PASS_TOUR = 1;
+const int TREE_CONVERT_PASS_RANK = 2;
+const int TREE_CONVERT_PASS_SCATTER = 3;
+
+// packed node records (see PackedTree in scene_converter.h): the type is in the top bits, PRIMITIVE_* for the
+// primitives and PACKED_NODE_BINARY for the binary nodes, then the half-precision transform flag and the offset of
+// the primitive record in 16 byte units
+const int PACKED_NODE_BINARY = 7;
+const int PACKED_TYPE_SHIFT = 29;
+const int PACKED_HALF_BIT = 28;
+const int PACKED_OFFSET_MASK = (1 << 28) - 1;
@@ -1,6 +1,7 @@
 #ifndef SDFCULLING_CONTEXT_H
 #define SDFCULLING_CONTEXT_H
 #include "utils.h"
+#include "scene_converter.h"
 
 const int WIDTH = 1920;
 const int HEIGHT = 1080;
@@ -10,8 +11,11 @@ struct Timings {
     float tracing_elapsed_ms;
     float render_elapsed_ms;
     float eval_grid_elapsed_ms;
+    float frame_elapsed_ms;
     float pruning_mem_usage_gb;
     float tracing_mem_usage_gb;
+    PruningStats pruning_stats;
+    PixelCostStats pixel_cost;
 };
 
 struct GPUNode {
@@ -21,21 +25,39 @@ struct GPUNode {
 
 class Context {
 public:
-    void initialize(bool gui, int final_grid_lvl);
+    // async_compute allocates a dedicated compute queue and a third pruning buffer set, compressed_lists selects the
+    // layout of the active lists for the lifetime of the context (see ListCursor in common.glsl)
+    void initialize(bool gui, int final_grid_lvl, bool async_compute = false, bool compressed_lists = false);
     Timings render(glm::vec3 cam_position, glm::vec3 cam_target=glm::vec3(0));
-    void upload(const std::vector<CSGNode>& nodes, int root_idx);
+    // rebuilds the pruning and tracing pipelines with the primitives evaluated in half precision away from the surface,
+    // the error bounds of the half precision distances keep the pruning conservative (see eval_prim_bounded in common.glsl)
+    void set_half_eval(bool enabled);
+    // jit compiles scene-specific shaders when RenderData::jit_cache_dir is set (see shader_jit.h), trees that change
+    // every frame should opt out
+    void upload(const std::vector<CSGNode>& nodes, int root_idx, bool jit = true);
+    // same as upload, but the tree is converted on the GPU: for trees that change every frame
+    void upload_gpu(const std::vector<CSGNode>& nodes, int root_idx);
     void alloc_input_buffers(int num_nodes);
+    // uploads all the frames of an animation at once, set_anim_frame() then selects the frame to render without any transfer
+    void upload_anim(const std::vector<std::vector<CSGNode>>& frames, const std::vector<int>& root_indices);
+    void set_anim_frame(int frame);
+    // evaluates the field (and optionally its normalized gradient) at a batch of points, using the pruning result of the last rendered frame
+    void query_distances(const glm::vec3* pts, size_t n, float* out, glm::vec3* gradients = nullptr);
+    // sphere traces a batch of rays against the same field, directions don't need to be normalized
+    void query_rays(const glm::vec3* origins, const glm::vec3* directions, size_t n, RayHit* hits);
 
     Init init;
     RenderData render_data;
+    SceneConverter scene_converter; // reused by every upload
     bool gui;
     bool culling = true;
 };
 
 void create_culling_pipelines(Init& init, RenderData& render_data);
 int create_graphics_pipeline(Init& init, RenderData& data);
-int ConvertToGPUTree(int root_idx, const std::vector<CSGNode>& csg_nodes, std::vector<GPUNode>& gpu_nodes, std::vector<Primitive>& primitives, std::vector<BinaryOp>& binary_ops, std::vector<uint16_t>& parent, std::vector<uint16_t>& active_nodes);
-void UploadGPUTree(const std::vector<BinaryOp>& binary_ops, const std::vector<GPUNode>& gpu_nodes, const std::vector<Primitive>& primitives, const std::vector<uint16_t>& parent, const std::vector<uint16_t>& active_nodes, RenderData& render_data, Init& init);
+void destroy_graphics_pipeline(Init& init, RenderData& data);
+int ConvertToGPUTree(int root_idx, const std::vector<CSGNode>& csg_nodes, std::vector<GPUNode>& gpu_nodes, std::vector<Primitive>& primitives, std::vector<BinaryOp>& binary_ops, std::vector<uint16_t>& parent, std::vector<uint16_t>& active_nodes, std::vector<int>* prim_nodes = nullptr);
+void pipeline_barrier(VkCommandBuffer cmd_buf, VkPipelineStageFlagBits2 src_stage_mask, VkAccessFlagBits2 src_access_mask, VkPipelineStageFlagBits2 dst_stage_mask, VkAccessFlagBits2 dst_access_mask);
 void get_pipeline_stats(Init& init, VkPipeline pipeline, uint32_t executable_idx, char* buf, uint32_t buf_size);
 
 
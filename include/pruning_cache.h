@@ -0,0 +1,14 @@
+#ifndef SDFCULLING_PRUNING_CACHE_H
+#define SDFCULLING_PRUNING_CACHE_H
+#include "utils.h"
+
+// On-disk cache of the final-level pruning result, for static scenes. Files live in RenderData::pruning_cache_dir and
+// are keyed by the uploaded GPU tree, the AABB, the grid level and the evaluation precision. Frustum pruning and LOD depend on the camera and
+// bypass the cache.
+
+// loads the result for the current key into the output set, the pruning is then skipped until the key changes
+void load_cached_pruning(Init& init, RenderData& data);
+// writes the result of this frame's pruning when there is no file for the current key yet
+void save_cached_pruning(Init& init, RenderData& data);
+
+#endif //SDFCULLING_PRUNING_CACHE_H
@@ -0,0 +1,13 @@
+#ifndef SDFCULLING_QUERY_H
+#define SDFCULLING_QUERY_H
+#include "utils.h"
+
+// number of points (or rays) processed by one dispatch, each of the two batch slots holds that many
+const int QUERY_BATCH_SIZE = 1 << 20;
+
+void create_query_pipelines(Init& init, RenderData& render_data);
+void create_query_resources(Init& init, RenderData& render_data);
+void query_points(Init& init, RenderData& render_data, const glm::vec3* points, size_t num_points, float* distances, glm::vec3* gradients);
+void query_rays(Init& init, RenderData& render_data, const glm::vec3* origins, const glm::vec3* directions, size_t num_rays, RayHit* hits);
+
+#endif //SDFCULLING_QUERY_H
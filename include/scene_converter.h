@@ -0,0 +1,58 @@
+#ifndef SDFCULLING_SCENE_CONVERTER_H
+#define SDFCULLING_SCENE_CONVERTER_H
+#include "utils.h"
+#include "tree.h"
+
+// Byte offsets of the arrays of a converted tree in one block of memory, one array per GPU buffer.
+// Every array starts on a 64 byte boundary, which covers the alignment of all the buffer references.
+struct GPUTreeLayout {
+    size_t nodes;
+    size_t binary_ops;
+    size_t prims;
+    size_t parents;
+    size_t active_nodes;
+    size_t skip_records;
+    size_t packed; // see PackedTree
+    size_t packed_size; // with every transform in full precision, the actual tree can be smaller
+    size_t size;
+    int num_nodes;
+    int num_prims;
+    int num_binary_ops;
+};
+
+// PackedTree: alternative layout of the tree for the active list loops, one block of memory that starts with one uvec2
+// record per node (in GPU order) followed by the primitive records.
+//  - x: type << PACKED_TYPE_SHIFT | half << PACKED_HALF_BIT | offset of the primitive record in 16 byte units
+//  - y: blend_factor_and_sign of a binary node, color of a primitive
+// A node is then one 8 byte load, and a binary node needs no other. The primitive records are grouped by type and
+// only hold what eval_prim reads: the 3x4 transform, then radius (sphere), height and radius (cylinder), radius and
+// height (cone), or sizes.xyz, extrude_rounding and the decoded corner radii (box), each record padded to 16 bytes. The transform is stored as
+// 6 packHalf2x16 words instead of 12 floats when rounding it moves no point of the scene bounds by more than
+// PACKED_HALF_MAX_ERROR in primitive space: a sphere record is then 32 bytes instead of 96.
+const float PACKED_HALF_MAX_ERROR = 1e-4f;
+
+// Same conversion as ConvertToGPUTree followed by build_skip_records, written straight to the destination memory
+// (usually the mapped staging buffer). The traversal state is kept between calls, so that converting trees of a size
+// that was already seen allocates nothing.
+class SceneConverter {
+public:
+    static GPUTreeLayout layout(const std::vector<CSGNode>& csg_nodes);
+    // dst must hold layout.size bytes. prim_nodes, if given, receives the CSG node index of each primitive, and tree_hash
+    // a hash of the nodes, primitives and binary ops (hashed as they are written, dst may be write-combined memory).
+    // Returns the GPU index of the root.
+    int convert(int root_idx, const std::vector<CSGNode>& csg_nodes, const GPUTreeLayout& layout, void* dst, std::vector<int>* prim_nodes = nullptr, uint64_t* tree_hash = nullptr);
+    // bounds of the points the tree is evaluated at, which decide whether a transform is stored in half precision
+    void set_bounds(glm::vec3 aabb_min, glm::vec3 aabb_max);
+
+private:
+    void pack(const std::vector<CSGNode>& csg_nodes, int num_nodes, char* dst);
+
+    glm::vec3 extent = glm::vec3(1); // largest absolute coordinate in the bounds, per axis
+    std::vector<int> cpu_to_gpu;
+    std::vector<uint32_t> packed_units; // per GPU node: size of the primitive record, with the half precision flag
+    std::vector<int> stack;
+    std::vector<int> postfix;
+    SkipRecordScratch skip_scratch;
+};
+
+#endif //SDFCULLING_SCENE_CONVERTER_H
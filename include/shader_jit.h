@@ -0,0 +1,19 @@
+#ifndef SDFCULLING_SHADER_JIT_H
+#define SDFCULLING_SHADER_JIT_H
+#include "utils.h"
+
+// Scene-specific shaders: the tree is emitted as straight-line GLSL (jit_sdf.glsl), one statement per node in postfix
+// order with the primitives and operators inlined as constants, and simple.frag.glsl and culling.comp.glsl are compiled
+// against it with JIT_SDF defined. The tracer then calls sdf_jit() for the cells that are not pruned, and the first
+// pruning level calls jit_first_level() instead of walking the tree. Compilation runs the glslc that built the other
+// shaders, the SPIR-V goes to a directory of RenderData::jit_cache_dir keyed by the tree, so a scene is only compiled once.
+
+// larger trees keep the interpreted shaders: the generated code and the compile time grow with the tree
+const int JIT_MAX_NODES = 1024;
+
+std::string generate_jit_sdf(const std::vector<CSGNode>& csg_nodes, int root_idx);
+// returns the directory that holds frag.spv and culling.comp.spv for the tree, compiling them if needed. Empty when
+// the tree is too large or the compilation failed, the interpreted shaders are then used.
+std::string compile_jit_shaders(const RenderData& data, const std::vector<CSGNode>& csg_nodes, int root_idx);
+
+#endif //SDFCULLING_SHADER_JIT_H
@@ -0,0 +1,37 @@
+#ifndef SDFCULLING_TREE_H
+#define SDFCULLING_TREE_H
+#include "utils.h"
+
+// Removes subtrees that cannot affect the surface inside [aabb_min, aabb_max] and folds the operators they leave as identities.
+// The tree is rebuilt in place with the root at index 0, which is returned.
+int simplify_tree(std::vector<CSGNode>& nodes, int root_idx, glm::vec3 aabb_min, glm::vec3 aabb_max);
+
+// Swaps the children of unions and intersections so that the postfix evaluation needs as few stack entries as possible,
+// and rebuilds clusters of hard unions (or intersections) as chains. Returns the stack depth needed to evaluate the tree.
+int reorder_tree(std::vector<CSGNode>& nodes, int root_idx);
+int tree_stack_depth(const std::vector<CSGNode>& nodes, int root_idx);
+// PRIM_TYPES specialization of the tree: bit t is set when one of the nodes is a primitive of type t
+int tree_prim_types(const std::vector<CSGNode>& nodes);
+
+struct Bounds {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// per-node state of build_skip_records, kept by the caller so that its capacity is reused across calls
+struct SkipRecordScratch {
+    std::vector<Bounds> bounds;
+    std::vector<float> lipschitz;
+    std::vector<float> slack;
+    std::vector<int> size;
+};
+
+struct GPUNode;
+// Computes conservative bounds for the right subtree of every union of a tree in GPU (postfix) order, when that subtree
+// holds more than one node, so that the first pruning level can skip subtrees that are far from the cell. The bounds only
+// hold outside of the subtree's bbox.
+void build_skip_records(const std::vector<GPUNode>& gpu_nodes, const std::vector<Primitive>& primitives, const std::vector<BinaryOp>& binary_ops, std::vector<SkipRecord>& records);
+// same, from the CSG nodes listed in postfix order, without allocating once scratch has grown to the size of the tree
+void build_skip_records(const std::vector<CSGNode>& csg_nodes, const int* postfix, int num_nodes, SkipRecord* records, SkipRecordScratch& scratch);
+
+#endif //SDFCULLING_TREE_H
@@ -0,0 +1,13 @@
+#ifndef SDFCULLING_TREE_CONVERT_H
+#define SDFCULLING_TREE_CONVERT_H
+#include "utils.h"
+
+// GPU version of ConvertToGPUTree + UploadScene: the CSGNode array is uploaded as is and converted by
+// tree_convert.comp.glsl into the input buffers, which then hold the same tree as after UploadScene.
+// Every node must be reachable from root_idx. The skip records are left empty (no subtree is skipped by the first
+// level), there is no packed tree (see PackedTree) and prim_node_indices is cleared, all three would need the CPU conversion.
+
+void create_tree_convert_pipeline(Init& init, RenderData& render_data);
+void convert_tree_gpu(Init& init, RenderData& render_data, const std::vector<CSGNode>& csg_nodes, int root_idx);
+
+#endif //SDFCULLING_TREE_CONVERT_H
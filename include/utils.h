@@ -7,6 +7,10 @@
 #include <glm/glm.hpp>
 #include "vma/vk_mem_alloc.h"
 #include "constants.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -27,6 +31,8 @@ extern std::string spv_dir;
 	} while (0)
 
 const int MAX_FRAMES_IN_FLIGHT = 3;
+const int STAGING_BUFFER_SIZE = 4 * 4096 * 4096;
+const int STAGING_RING_FRAME_SIZE = 64 * 1024; // per-frame uploads, see stage_upload
 
 struct Init {
     GLFWwindow* window;
@@ -36,6 +42,7 @@ struct Init {
     vkb::Device device;
     vkb::DispatchTable disp;
     vkb::Swapchain swapchain;
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE; // shared by all pipelines, persisted next to the SPIR-V files
 };
 
 
@@ -63,21 +70,31 @@ struct PushConstants {
     uint64_t tmp_ref;
     uint64_t mvp_ref;
     uint64_t cam_ref;
+    uint64_t skip_records_ref;
     int num_nodes;
     int grid_size;
     int first_lvl;
-    float max_rel_err = 0;
     float viz_max;
-    float alpha;
     int culling_enabled;
     float gamma;
     int num_samples;
+    int frustum_pruning;
+    uint64_t packed_tree_ref; // 0 to read the nodes from nodes_ref, binary_ops_ref and prims_ref
+    uint64_t pixel_cost_ref;
+    uint64_t lod_ref;
 };
 
 struct Buffer {
     VkBuffer buf;
     VmaAllocation alloc;
     uint64_t address;
+    void* mapped;
+};
+
+// a copy from the current frame's partition of the staging ring, recorded in the frame's command buffer
+struct StagedCopy {
+    VkBuffer dst;
+    VkBufferCopy region;
 };
 
 struct Image {
@@ -90,11 +107,62 @@ struct Pipeline {
     VkPipelineLayout layout;
 };
 
+// Per-level pruning statistics, gathered when RenderData::pruning_stats_enabled is set.
+// levels[i] describes grid level 2*(i+1).
+struct PruningLevelStats {
+    bool valid;
+    float elapsed_ms;
+    int active_count;
+    int tmp_count;
+    float far_field_fraction; // includes the cells left unpruned by frustum pruning
+    uint64_t bytes_written; // estimate from the cell, active list and tmp buffer sizes
+    uint32_t num_active_histogram[PRUNING_STATS_NUM_BINS];
+};
+
+struct PruningStats {
+    PruningLevelStats levels[4];
+};
+
+// Summary of one per-pixel counter over the frame, gathered in SHADING_MODE_COST.
+struct PixelCostCounterStats {
+    float mean;
+    uint32_t p99;
+    uint32_t max;
+    uint64_t total;
+};
+
+struct PixelCostStats {
+    bool valid;
+    PixelCostCounterStats steps;
+    PixelCostCounterStats node_evals;
+    PixelCostCounterStats shading_node_evals; // shadow rays and AO samples
+};
+
+// Device addresses of the tree that is pruned and evaluated: the input buffers after an upload, or one frame of the
+// animation arena
+struct TreeRefs {
+    uint64_t nodes;
+    uint64_t binary_ops;
+    uint64_t prims;
+    uint64_t parents_init;
+    uint64_t active_nodes_init;
+    uint64_t skip_records;
+    uint64_t packed; // see PackedTree in scene_converter.h, 0 when the tree was converted on the GPU
+};
+
+struct AnimFrame {
+    TreeRefs tree;
+    int num_nodes;
+    uint64_t tree_hash;
+};
+
 struct RenderData {
     VmaAllocator alloc;
     VkQueue graphics_queue;
     VkQueue present_queue;
     uint32_t graphics_queue_family;
+    VkQueue compute_queue; // only used for async pruning
+    uint32_t compute_queue_family;
 
     std::vector<VkImage> swapchain_images;
     std::vector<VkImageView> swapchain_image_views;
@@ -106,9 +174,10 @@ struct RenderData {
 
     VkRenderPass render_pass;
     VkPipelineLayout pipeline_layout;
-    VkPipeline graphics_pipeline;
+    VkPipeline graphics_pipelines[NUM_SHADING_MODES]; // one per shading_mode specialization
 
     Pipeline culling_pipeline;
+    Pipeline culling_final_pipeline; // FINAL_LEVEL specialization, writes no parents
     Pipeline eval_grid_pipeline;
 
     VkPipelineLayout debug_plane_pipeline_layout;
@@ -119,8 +188,17 @@ struct RenderData {
 
     Pipeline fxaa_pipeline;
 
+    Pipeline query_pipeline;
+    Pipeline pruning_stats_pipeline;
+    Pipeline raycast_pipeline;
+    Pipeline tree_convert_pipeline;
+
     VkCommandPool command_pool;
     std::vector<VkCommandBuffer> command_buffers;
+    VkCommandPool compute_command_pool;
+    VkCommandBuffer compute_command_buffer;
+    VkSemaphore pruning_timeline; // signaled by the async pruning submits
+    uint64_t pruning_timeline_value = 0;
 
     std::vector<VkSemaphore> available_semaphores;
     std::vector<VkSemaphore> finished_semaphore;
@@ -128,33 +206,63 @@ struct RenderData {
     std::vector<VkFence> image_in_flight;
     size_t current_frame = 0;
 
+    VkCommandPool query_command_pool;
+    VkCommandBuffer query_command_buffers[2];
+    VkFence query_fences[2];
+
     VkDescriptorPool descriptor_pool;
     VkQueryPool query_pool;
 
     PushConstants push_constants;
     Buffer staging_buffer;
+    // persistently mapped, one STAGING_RING_FRAME_SIZE partition per frame in flight
+    Buffer staging_ring;
+    size_t staging_ring_head = 0; // bytes staged in the partition of current_frame
+    std::vector<StagedCopy> frame_uploads; // recorded at the start of the graphics command buffer
+    std::vector<StagedCopy> pruning_uploads; // recorded with the pruning, which may run on the compute queue
     Buffer prims_buffer;
     Buffer nodes_buffer;
     Buffer binary_ops_buffer;
     Buffer spheres_buffer;
-    Buffer active_nodes_buffer[2];
-    Buffer parents_buffer[2];
-    Buffer num_active_buffer[2];
-    Buffer cell_offsets_buffer[2];
+    // the pruning ping-pongs between two buffer sets, the third one is only allocated for async pruning
+    Buffer active_nodes_buffer[3];
+    Buffer parents_buffer[2] = {}; // by level parity: the final level writes none, so no set holds parents once pruned. Null with compressed lists
+    Buffer num_active_buffer[3];
+    Buffer cell_offsets_buffer[3];
     Buffer active_count_buffer;
     Buffer parents_init_buffer;
-    Buffer cell_errors[2];
+    Buffer cell_errors[3];
     Buffer active_nodes_init_buffer;
+    Buffer skip_records_buffer;
+    Buffer packed_tree_buffer;
+    TreeRefs tree = {};
+    Buffer anim_arena = {}; // all the frames of the animation, see UploadAnim
+    std::vector<AnimFrame> anim_frames;
+    int anim_frame = -1; // -1 when rendering the uploaded scene
+    // scratch of convert_tree_gpu, for up to tree_convert_capacity nodes
+    Buffer csg_nodes_buffer;
+    Buffer tree_links_buffer;
+    Buffer tour_next_buffer[2];
+    Buffer tour_rank_buffer[2];
+    int tree_convert_capacity = 0;
+    Buffer pruning_stats_buffer;
+    Buffer lod_buffer;
+    Buffer pixel_cost_buffer;
+    int pixel_cost_capacity = 0; // number of pixels pixel_cost_buffer can hold
     Buffer old_to_new_scratch_buffer;
     Buffer old_to_new_count_buffer;
     Buffer tmp_buffer;
     Buffer mvp_buffer;
     Buffer cam_buffer;
+    Buffer pruning_cam_buffer; // copy of cam_buffer for the pruning, which async compute runs concurrently with the tracing
+    Buffer query_input_buffer[2];
+    Buffer query_output_buffer[2];
 
     int input_idx = 0;
     int output_idx = 1;
 
     float culling_elapsed_ms, tracing_elapsed_ms, render_elapsed_ms, eval_grid_elapsed_ms;
+    float frame_elapsed_ms; // host time from the submits to the end of the frame
     uint64_t tracing_mem_usage;
     uint64_t pruning_mem_usage;
     int max_active_count = 0;
@@ -164,20 +272,50 @@ struct RenderData {
     glm::vec3 aabb_min = glm::vec3(-1.f);
     glm::vec3 aabb_max = glm::vec3(1);
     int final_grid_lvl = 8;
+    int stack_depth = DEFAULT_STACK_DEPTH; // STACK_DEPTH specialization of the evaluation pipelines
+    int prim_types = ALL_PRIM_TYPES; // PRIM_TYPES specialization of the evaluation pipelines
+    bool compressed_lists = false; // COMPRESSED_LISTS specialization: the active lists are byte streams without a parent buffer, and there is no LOD
+    bool half_eval = false; // HALF_EVAL specialization of the pruning and tracing pipelines, see Context::set_half_eval
     int shading_mode = SHADING_MODE_SHADED;
     bool render_enabled = true;
     bool culling_enabled = true;
     bool hierarchy_enabled = true;
     bool eval_grid_enabled = false;
+    bool pruning_stats_enabled = false;
+    PruningStats pruning_stats;
+    PixelCostStats pixel_cost_stats;
     bool show_imgui = true;
     int num_samples = 1;
     glm::vec3 cam_pos;
     float gamma = 1.2;
     bool compute_culling = true;
+    bool frustum_pruning = false; // only prune the cells in the view frustum, the others fall back to the full tree
+    bool lod_enabled = false;
+    bool packed_tree_enabled = false; // evaluate the active lists from the packed layout of the tree
+    float lod_threshold_px = 2.f;
+    int lod_active_count = 0; // active nodes stored by the LOD cells in the last pruning
+    std::string pruning_cache_dir; // on-disk cache of the pruning result, disabled when empty
+    std::string jit_cache_dir; // scene-specific shaders (see shader_jit.h) of the uploaded trees, disabled when empty
+    std::string jit_shader_dir; // SPIR-V of the tracer and the pruning for the current tree, empty for the interpreted ones
+    uint64_t tree_hash = 0; // of the uploaded GPU tree, part of the pruning cache key
+    uint64_t pruning_cache_key = 0;
+    bool pruning_cached = false; // the output set holds the cached result for pruning_cache_key, the pruning is skipped
+    bool pruning_valid = false;
+    bool async_compute_available = false;
+    bool async_compute_enabled = false; // prune on the compute queue while the previous result is traced
+    int async_pruned_grid_lvl = -1;
+    std::vector<int> prim_node_indices; // CSG node index of each uploaded primitive
     glm::vec3 sphere_albedo = glm::vec3(1,0,1);
     glm::vec3 background_color = glm::vec3(1);
 };
 
+struct RayHit {
+    float t; // -1 when the ray misses the surface
+    glm::vec3 normal;
+    int node_idx; // CSG node of the primitive closest to the hit point, -1 on miss
+    bool inside; // t is where the ray found a negative distance, e.g. starting inside a solid, rather than a surface hit
+};
+
 enum PrimitiveType {
     PRIMITIVE_SPHERE = 0,
     PRIMITIVE_BOX = 1,
@@ -225,6 +363,30 @@ struct Primitive {
 };
 static_assert(sizeof(Primitive) == 6*16);
 
+// Bounds of the right subtree of a union, stored at the index of the subtree's first node in postfix order.
+// Outside of the bbox, the subtree's value is at least bbox_min.w * distance(p, bbox) - bbox_max.w, see build_skip_records.
+struct SkipRecord {
+    glm::vec4 bbox_min; // w: lower bound on the Lipschitz constant of the subtree
+    glm::vec4 bbox_max; // w: slack from smooth unions inside the subtree
+    int end; // index of the subtree's root, -1 if no subtree starts here
+    int pad0, pad1, pad2;
+};
+static_assert(sizeof(SkipRecord) == 3*16);
+
+// Screen-space LOD of the pruning: a cell that is smaller than threshold_px on screen, or whose active list stopped
+// shrinking, is not subdivided further. Its list is appended from the end of the active node buffer of the final
+// level, and its descendants down to the final level point at it.
+struct LodParams {
+    uint64_t active_nodes_ref; // active node buffer of the final level
+    int count; // number of active nodes stored by the LOD cells
+    int capacity; // size of the active node buffer
+    int final_grid_size;
+    float threshold_px;
+    int enabled;
+    int pad0;
+};
+static_assert(sizeof(LodParams) == 32);
+
 struct BinaryOp {
     uint32_t blend_factor_and_sign;
 
@@ -247,17 +409,44 @@ struct CSGNode {
     int left, right;
     bool sign;
 };
+static_assert(sizeof(CSGNode) == 7*16); // mirrored in tree_convert.comp.glsl
 
-std::vector<char> readFile(const std::string& filename);
+// reads a SPIR-V file of dir, the build's shaders by default
+std::vector<char> readFile(const std::string& filename, const std::string& dir = spv_dir);
 VkShaderModule createShaderModule(Init& init, const std::vector<char>& code, const char* debug_name);
 void TransferToBuffer(const VmaAllocator& alloc, const Buffer& buffer, const void* data, int size);
 void TransferFromBuffer(const VmaAllocator& alloc, const Buffer& buffer, void* data, int size);
-void CopyBuffer(const RenderData& render_data, const Init& init, const Buffer& src, const Buffer& dst, int size);
+void CopyBuffer(const RenderData& render_data, const Init& init, const Buffer& src, const Buffer& dst, int size, int src_offset = 0, int dst_offset = 0);
+// copies regions[i] of src to dsts[i], all in one submit
+void CopyBufferRegions(const RenderData& render_data, const Init& init, const Buffer& src, int num_regions, const Buffer* dsts, const VkBufferCopy* regions);
+// go through the staging buffer in chunks, for buffers larger than it
+void UploadToBuffer(const RenderData& render_data, const Init& init, const Buffer& dst, const void* src, size_t size);
+void DownloadFromBuffer(const RenderData& render_data, const Init& init, const Buffer& src, void* dst, size_t size);
 void CopyImageToBuffer(const RenderData& render_data, const Init& init, VkImage src, const Buffer& dst, int width, int height);
 uint64_t GetBufferAddress(const Init& init, const Buffer& buffer);
-Pipeline create_compute_pipeline(Init& init, const char* shader_path, const char* shader_name, unsigned int push_constant_size);
-Buffer create_buffer(Init& init, RenderData& render_data, unsigned int size, VkBufferUsageFlags usage, const char* name);
+Pipeline create_compute_pipeline(Init& init, const char* shader_path, const char* shader_name, unsigned int push_constant_size, int stack_depth = DEFAULT_STACK_DEPTH, int prim_types = ALL_PRIM_TYPES, bool compressed_lists = false, bool half_eval = false);
+void destroy_pipeline(Init& init, Pipeline& pipeline);
+const uint64_t FNV1A_OFFSET_BASIS = 0xcbf29ce484222325ull;
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = FNV1A_OFFSET_BASIS);
+void load_pipeline_cache(Init& init);
+void save_pipeline_cache(Init& init);
+Buffer create_buffer(Init& init, RenderData& render_data, size_t size, VkBufferUsageFlags usage, const char* name);
+Buffer create_mapped_buffer(Init& init, RenderData& render_data, size_t size, VkBufferUsageFlags usage, VmaAllocationCreateFlags host_access, const char* name);
 
 extern size_t g_memory_usage;
 
+// runs f(i) for every i in [0, n) on a pool of worker threads
+template <typename F>
+void parallel_for(int n, F&& f) {
+    int num_threads = std::max(1, std::min(n, (int)std::thread::hardware_concurrency()));
+    std::atomic<int> next = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&]() {
+            for (int i = next++; i < n; i = next++) f(i);
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+}
+
 #endif //SDFCULLING_UTILS_H
@@ -6,6 +6,15 @@
 #define NODETYPE_BINARY 0
 #define NODETYPE_PRIMITIVE 1
 
+// size of the private evaluation stacks, set from the depth of the uploaded tree (see reorder_tree)
+layout(constant_id = 1) const int STACK_DEPTH = 128;
+// bit t is set when the uploaded tree holds primitives of type t, the evaluation drops the branches of the other types
+layout(constant_id = 2) const int PRIM_TYPES = 15;
+// the pruning writes its lists in the compressed layout, see ListCursor
+layout(constant_id = 3) const bool COMPRESSED_LISTS = false;
+// the pruning and the tracer evaluate the primitives in half precision where the error allows it, see eval_prim_bounded
+layout(constant_id = 5) const bool HALF_EVAL = false;
+
 struct Primitive {
     vec4 data;
     vec4 m_row0;
@@ -28,6 +37,14 @@ struct BinaryOp {
     uint blend_factor_and_sign;
 };
 
+// see SkipRecord in utils.h
+struct SkipRecord {
+    vec4 bbox_min; // w: Lipschitz lower bound
+    vec4 bbox_max; // w: slack
+    int end;
+    int pad0, pad1, pad2;
+};
+
 struct ActiveNode {
     uint16_t idx_and_sign;
 };
@@ -38,6 +55,7 @@ struct Tmp {
     // inactive ancestors flag: 1 bit (3)
     // sign : 1 bit (4)
     // parent: 16 bits (5)
+    // skipped range: 1 bit (21), first level only, see Tmp_skipped_range
     uint x;
 };
 
@@ -53,6 +71,10 @@ layout(std430, buffer_reference, buffer_reference_align = 8) buffer BinaryOpsRef
     BinaryOp tab[];
 };
 
+layout(std430, buffer_reference, buffer_reference_align = 16) buffer SkipRecordsRef {
+    SkipRecord tab[];
+};
+
 layout(std430, buffer_reference, buffer_reference_align = 8) buffer ActiveNodesRef {
     ActiveNode tab[];
 };
@@ -69,6 +91,10 @@ layout(std430, buffer_reference, buffer_reference_align = 8) buffer Uint16ArrayR
     uint16_t tab[];
 };
 
+layout(std430, buffer_reference, buffer_reference_align = 8) buffer ByteArrayRef {
+    uint8_t tab[];
+};
+
 layout(std430, buffer_reference, buffer_reference_align = 8) buffer TmpArrayRef {
     Tmp tab[];
 };
@@ -89,6 +115,26 @@ layout(std430, buffer_reference, buffer_reference_align = 8) buffer Vec4ArrayRef
     vec4 tab[];
 };
 
+// see PackedTree in scene_converter.h, both start at the address of the packed tree
+layout(std430, buffer_reference, buffer_reference_align = 8) buffer PackedNodesRef {
+    uvec2 tab[];
+};
+
+layout(std430, buffer_reference, buffer_reference_align = 16) buffer PackedPrimsRef {
+    uvec4 tab[];
+};
+
+// see LodParams in utils.h
+layout(std430, buffer_reference, buffer_reference_align = 8) buffer LodRef {
+    ActiveNodesRef active_nodes;
+    int count;
+    int capacity;
+    int final_grid_size;
+    float threshold_px;
+    int enabled;
+    int pad0;
+};
+
 layout(std430, buffer_reference, buffer_reference_align = 8) buffer DebugPlaneRef {
     mat4 world_to_clip;
     vec4 farfield_color;
@@ -163,6 +209,25 @@ void Tmp_parent_write(inout Tmp t, uint16_t p) {
     t.x |= uint(p) << 5;
 }
 
+// Written to the first and the last node of a union subtree that the first level skipped as a whole, the nodes in
+// between are left stale. The node is inactive and its parent field holds the index of the other end of the range, the
+// passes over the list jump past the range instead of visiting it.
+Tmp Tmp_skipped_range(int other_end) {
+    return Tmp(1u << 21 | uint(other_end) << 5);
+}
+
+bool Tmp_skipped_range_get(Tmp t) {
+    return bool((t.x >> 21) & 1);
+}
+
+
+vec2 smin_blend( float a, float b, float k )
+{
+    float h = max(k-abs(a-b), 0) / k;
+    float m = h*h*0.5;
+    float s = m*k*0.5;
+    return (a<b) ? vec2(a-s,m) : vec2(b-s,1-m);
+}
 
 float kernel(float x, float k) {
     if (k == 0) return 0;
@@ -170,6 +235,12 @@ float kernel(float x, float k) {
     return m*m*0.25/k;
 }
 
+vec4 kernel(vec4 x, float k) {
+    if (k == 0) return vec4(0);
+    vec4 m = max(vec4(0), k-x);
+    return m*m*0.25/k;
+}
+
 #if 1
 // https://fgiesen.wordpress.com/2009/12/13/decoding-morton-codes/
 uint Part1By2(uint x)
@@ -272,6 +343,51 @@ ActiveNode ActiveNode_make(int idx, bool sgn) {
     v |= uint16_t(!sgn) << 15;
     return ActiveNode(v);
 }
+
+// Reads the active list of a cell in order. The cell offset counts entries of the active node buffer, or bytes with
+// COMPRESSED_LISTS, where the list is a byte stream of two LEB128 varints per node (7 bits per byte, the high bit set
+// when another byte follows):
+//  - the index of the node minus the index of the previous one minus 1 (the index itself for the first node),
+//  - the offset of its parent in the list << 1 | 1 if its sign is negative, the offset being 0 for the root.
+// The lists are in postfix order, so both are small: most nodes take 2 bytes instead of 4 with the parent buffer.
+struct ListCursor {
+    uint pos;
+    int node_idx; // of the last node read
+};
+
+ListCursor ListCursor_make(int cell_offset) {
+    return ListCursor(uint(cell_offset), -1);
+}
+
+uint list_varint_read(ByteArrayRef list, inout uint pos) {
+    uint v = 0;
+    int shift = 0;
+    uint b;
+    do {
+        b = uint(list.tab[pos++]);
+        v |= (b & 0x7fu) << shift;
+        shift += 7;
+    } while ((b & 0x80u) != 0u);
+    return v;
+}
+
+// parent_offset is only read from compressed lists, the other lists have it in a separate buffer
+ActiveNode ListCursor_next(ActiveNodesRef list, inout ListCursor c, out int parent_offset) {
+    if (!COMPRESSED_LISTS) {
+        parent_offset = 0;
+        return list.tab[c.pos++];
+    }
+    ByteArrayRef bytes = ByteArrayRef(uint64_t(list));
+    c.node_idx += int(list_varint_read(bytes, c.pos)) + 1;
+    uint code = list_varint_read(bytes, c.pos);
+    parent_offset = int(code >> 1);
+    return ActiveNode_make(c.node_idx, (code & 1u) == 0u);
+}
+
+ActiveNode ListCursor_next(ActiveNodesRef list, inout ListCursor c) {
+    int parent_offset;
+    return ListCursor_next(list, c, parent_offset);
+}
 #endif
 
 vec3 inferno(float t) {
@@ -339,39 +455,199 @@ float sdCone(vec3 position, float radius, float halfHeight) {
     return -min(d, p.y);
 }
 
-float eval_prim(vec3 p, Primitive prim) {
-    mat4x3 m = transpose(mat3x4(prim.m_row0, prim.m_row1, prim.m_row2));
-    p = vec3(m * vec4(p, 1));
+// true when prim has type t: the PRIM_TYPES specialization folds the test when the tree holds no primitive of type t,
+// or no other type
+bool prim_has_type(Primitive prim, int t) {
+    if ((PRIM_TYPES & (1 << t)) == 0) return false;
+    return PRIM_TYPES == (1 << t) || prim.type == t;
+}
+
+// corner radii of a box from the bytes of data.w, the packed tree stores them decoded
+vec4 box_corner_rounding(vec4 data) {
+    vec3 half_sides = data.xyz * 0.5;
+    float scale = max(half_sides.x, half_sides.z) * 2;
+    uint corner_data = floatBitsToUint(data.w);
+    vec4 corner_rounding;
+    corner_rounding.x = float((corner_data >> 0) & 0xff);
+    corner_rounding.y = float((corner_data >> 8) & 0xff);
+    corner_rounding.z = float((corner_data >> 16) & 0xff);
+    corner_rounding.w = float((corner_data >> 24) & 0xff);
+    corner_rounding = corner_rounding * scale / 255.f;
+    corner_rounding /= 2;
+    return corner_rounding;
+}
 
+// distance from a point in the frame of the primitive, corner_rounding is only read for boxes
+float eval_prim_local(vec3 p, Primitive prim, vec4 corner_rounding) {
     float dist;
-    if (prim.type == PRIMITIVE_SPHERE) {
+    if (prim_has_type(prim, PRIMITIVE_SPHERE)) {
         float r = prim.data.x;
         dist = length(p) - r;
-    } else if (prim.type == PRIMITIVE_BOX) {
+    } else if (prim_has_type(prim, PRIMITIVE_BOX)) {
         vec3 half_sides = prim.data.xyz * 0.5;
-        float scale = max(half_sides.x, half_sides.z) * 2;
-        uint corner_data = floatBitsToUint(prim.data.w);
-        vec4 corner_rounding;
-        corner_rounding.x = float((corner_data >> 0) & 0xff);
-        corner_rounding.y = float((corner_data >> 8) & 0xff);
-        corner_rounding.z = float((corner_data >> 16) & 0xff);
-        corner_rounding.w = float((corner_data >> 24) & 0xff);
-        corner_rounding = corner_rounding * scale / 255.f;
-        corner_rounding /= 2;
         float d_2D = sdRoundBox(p.xz, half_sides.xz, corner_rounding);
 
         float er = p.y > 0 ? prim.extrude_rounding.x : prim.extrude_rounding.y;
         dist = sdExtrude( d_2D, p.y, half_sides.y-er, er );
-    } else if (prim.type == PRIMITIVE_CYLINDER) {
+    } else if (prim_has_type(prim, PRIMITIVE_CYLINDER)) {
         float h = prim.data.x / 2;
         float r = prim.data.y;
         vec2 d = abs(vec2(length(p.xz),p.y)) - vec2(r,h);
         dist = min(max(d.x,d.y),0.0) + length(max(d,0.0));
-    } else if (prim.type == PRIMITIVE_CONE) {
+    } else if (prim_has_type(prim, PRIMITIVE_CONE)) {
         dist = sdCone(p, prim.data.x, prim.data.y * 0.5);
     } else {
         dist = 1e20;
     }
     //dist -= prim.rounding;
     return dist;
-}
\ No newline at end of file
+}
+
+float eval_prim(vec3 p, Primitive prim, vec4 corner_rounding) {
+    mat4x3 m = transpose(mat3x4(prim.m_row0, prim.m_row1, prim.m_row2));
+    return eval_prim_local(vec3(m * vec4(p, 1)), prim, corner_rounding);
+}
+
+float16_t sdRoundBox(f16vec2 p, f16vec2 b, f16vec4 r) {
+    r.xy = (p.x>0.0hf)?r.xy : r.zw;
+    r.x  = (p.y>0.0hf)?r.x  : r.y;
+    f16vec2 q = abs(p)-b+r.x;
+    return min(max(q.x,q.y),0.0hf) + length(max(q,0.0hf)) - r.x;
+}
+
+float16_t sdExtrude(float16_t d, float16_t z, float16_t h, float16_t r) {
+    f16vec2 q = f16vec2(d+r, abs(z)-h);
+    return min(max(q.x, q.y), 0.0hf) + length(max(q, 0.0hf))-r;
+}
+
+float16_t sdCone(f16vec3 position, float16_t radius, float16_t halfHeight) {
+    f16vec2 p = f16vec2(length(position.xz) - radius, position.y + halfHeight);
+    f16vec2 e = f16vec2(-radius, 2.0hf * halfHeight);
+    f16vec2 q = p - e * clamp(dot(p, e) / dot(e, e), 0.0hf, 1.0hf);
+    float16_t d = length(q);
+    if (max(q.x, q.y) > 0.0hf) {
+        return d;
+    }
+    return -min(d, p.y);
+}
+
+// eval_prim_local in half precision
+float16_t eval_prim_local_half(f16vec3 p, Primitive prim, f16vec4 corner_rounding) {
+    f16vec3 data = f16vec3(prim.data.xyz);
+    float16_t dist;
+    if (prim_has_type(prim, PRIMITIVE_SPHERE)) {
+        dist = length(p) - data.x;
+    } else if (prim_has_type(prim, PRIMITIVE_BOX)) {
+        f16vec3 half_sides = data * 0.5hf;
+        float16_t d_2D = sdRoundBox(p.xz, half_sides.xz, corner_rounding);
+
+        float16_t er = float16_t(p.y > 0.0hf ? prim.extrude_rounding.x : prim.extrude_rounding.y);
+        dist = sdExtrude(d_2D, p.y, half_sides.y-er, er);
+    } else if (prim_has_type(prim, PRIMITIVE_CYLINDER)) {
+        float16_t h = data.x * 0.5hf;
+        float16_t r = data.y;
+        f16vec2 d = abs(f16vec2(length(p.xz),p.y)) - f16vec2(r,h);
+        dist = min(max(d.x,d.y),0.0hf) + length(max(d,0.0hf));
+    } else if (prim_has_type(prim, PRIMITIVE_CONE)) {
+        dist = sdCone(p, data.x, data.y * 0.5hf);
+    } else {
+        dist = 65504.0hf;
+    }
+    return dist;
+}
+
+// Bound on the error of eval_prim_local_half: every term of the distance formulas is at most the sum of the coordinates
+// plus the largest size, and goes through fewer than 16 roundings of 2^-11 of its magnitude. The absolute part covers
+// the squares of the small coordinates, which lose their precision in the fp16 subnormals. Past HALF_EVAL_MAX_SCALE,
+// the squares could overflow.
+const float HALF_EVAL_REL_ERROR = 1.0 / 128;
+const float HALF_EVAL_ABS_ERROR = 1e-3;
+const float HALF_EVAL_MAX_SCALE = 64;
+// largest error accepted from a half precision primitive, relative to the radius of the cell it is evaluated for
+const float HALF_EVAL_ERROR_RATIO = 0.125;
+
+// Distance to prim in half precision with HALF_EVAL, unless the bound on its error is above max_err. err receives the
+// bound, 0 when the distance was evaluated in full precision. The transform stays in full precision, the translation
+// would round the most. The operators move by at most the largest change of their operands, so the bound of a node is
+// the largest bound of its primitives.
+float eval_prim_bounded(vec3 p, Primitive prim, vec4 corner_rounding, float max_err, out float err) {
+    mat4x3 m = transpose(mat3x4(prim.m_row0, prim.m_row1, prim.m_row2));
+    p = vec3(m * vec4(p, 1));
+
+    float scale = abs(p.x) + abs(p.y) + abs(p.z) + max(max(abs(prim.data.x), abs(prim.data.y)), abs(prim.data.z));
+    err = HALF_EVAL_REL_ERROR * scale + HALF_EVAL_ABS_ERROR;
+    // also takes the full precision path for the NaNs
+    if (!HALF_EVAL || !(scale <= HALF_EVAL_MAX_SCALE) || !(err <= max_err)) {
+        err = 0;
+        return eval_prim_local(p, prim, corner_rounding);
+    }
+    return float(eval_prim_local_half(f16vec3(p), prim, f16vec4(corner_rounding)));
+}
+
+float eval_prim(vec3 p, Primitive prim) {
+    vec4 corner_rounding = prim_has_type(prim, PRIMITIVE_BOX) ? box_corner_rounding(prim.data) : vec4(0);
+    return eval_prim(p, prim, corner_rounding);
+}
+
+// Only fills the fields that eval_prim reads. After the transform, a box record holds the sizes, extrude_rounding
+// and the decoded corner radii, the other types the first two floats of data.
+Primitive PackedPrim_unpack(PackedPrimsRef prims, uint record, out vec4 corner_rounding) {
+    Primitive prim;
+    prim.type = int(record >> PACKED_TYPE_SHIFT);
+    uint unit = record & uint(PACKED_OFFSET_MASK);
+    uvec4 params; // box: sizes.xyz, extrude_rounding.x
+    uvec4 box_params = uvec4(0); // extrude_rounding.y, corner radii xyz
+    uint box_param8 = 0; // corner radius w
+    if (get_bit(record, PACKED_HALF_BIT)) {
+        uvec4 a = prims.tab[unit];
+        uvec4 b = prims.tab[unit + 1];
+        prim.m_row0 = vec4(unpackHalf2x16(a.x), unpackHalf2x16(a.y));
+        prim.m_row1 = vec4(unpackHalf2x16(a.z), unpackHalf2x16(a.w));
+        prim.m_row2 = vec4(unpackHalf2x16(b.x), unpackHalf2x16(b.y));
+        params = uvec4(b.zw, 0, 0);
+        if (prim_has_type(prim, PRIMITIVE_BOX)) {
+            uvec4 c = prims.tab[unit + 2];
+            uvec4 d = prims.tab[unit + 3];
+            params.zw = c.xy;
+            box_params = uvec4(c.zw, d.xy);
+            box_param8 = d.z;
+        }
+    } else {
+        prim.m_row0 = uintBitsToFloat(prims.tab[unit]);
+        prim.m_row1 = uintBitsToFloat(prims.tab[unit + 1]);
+        prim.m_row2 = uintBitsToFloat(prims.tab[unit + 2]);
+        params = prims.tab[unit + 3];
+        if (prim_has_type(prim, PRIMITIVE_BOX)) {
+            box_params = prims.tab[unit + 4];
+            box_param8 = prims.tab[unit + 5].x;
+        }
+    }
+    prim.data = uintBitsToFloat(params);
+    prim.extrude_rounding = uintBitsToFloat(uvec2(params.w, box_params.x));
+    corner_rounding = uintBitsToFloat(uvec4(box_params.yzw, box_param8));
+    return prim;
+}
+
+// Fetches node_idx of the packed tree, returns true for a binary node (op is set) and false for a primitive (prim and
+// corner_rounding are set, see eval_prim)
+bool PackedTree_fetch(uint64_t tree, int node_idx, out BinaryOp op, out Primitive prim, out vec4 corner_rounding) {
+    uvec2 record = PackedNodesRef(tree).tab[node_idx];
+    if (record.x >> PACKED_TYPE_SHIFT == uint(PACKED_NODE_BINARY)) {
+        op = BinaryOp(record.y);
+        return true;
+    }
+    prim = PackedPrim_unpack(PackedPrimsRef(tree), record.x, corner_rounding);
+    return false;
+}
+
+// same for the nodes, binary_ops and prims buffers
+bool Tree_fetch(NodesRef nodes, BinaryOpsRef binary_ops, PrimitivesRef prims, int node_idx, out BinaryOp op, out Primitive prim, out vec4 corner_rounding) {
+    Node node = nodes.tab[node_idx];
+    if (node.type == NODETYPE_BINARY) {
+        op = binary_ops.tab[node.idx_in_type];
+        return true;
+    }
+    prim = prims.tab[node.idx_in_type];
+    corner_rounding = prim_has_type(prim, PRIMITIVE_BOX) ? box_corner_rounding(prim.data) : vec4(0);
+    return false;
+}
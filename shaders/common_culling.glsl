@@ -3,14 +3,128 @@ shared uint16_t s_parent_node_parents[64];
 
 #define INVALID_INDEX 0xffffu
 
+// conservative test of the cell against the side planes of the view frustum, stored in cam[4..7].
+// The near and far planes are ignored: the primary rays start at the camera and are not clipped by them
+bool cell_in_frustum(vec3 cell_center, vec3 cell_size) {
+    for (int i = 4; i < 8; i++) {
+        vec4 plane = cam.tab[i];
+        if (dot(plane.xyz, cell_center) + plane.w + 0.5 * dot(abs(plane.xyz), cell_size) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// size in pixels of the cell's bounding sphere, seen from the camera
+float cell_screen_size(vec3 cell_center, vec3 cell_size) {
+    float diameter = length(cell_size);
+    float dist = max(length(cell_center - cam.tab[0].xyz) - 0.5 * diameter, 1e-6);
+    // the primary rays have a 90 degree vertical field of view
+    return diameter / dist * 0.5 * float(u_Resolution.y);
+}
+
+
+uint list_varint_write(ByteArrayRef list, uint pos, uint v) {
+    do {
+        uint b = v & 0x7fu;
+        v >>= 7;
+        list.tab[pos++] = uint8_t(v != 0u ? b | 0x80u : b);
+    } while (v != 0u);
+    return pos;
+}
+
+uint list_varint_size(uint v) {
+    return v < 0x80u ? 1u : v < 0x4000u ? 2u : 3u;
+}
+
+// node i of the parent cell's list, read in order. The first level reads the initial list of the tree, which is never
+// compressed. parent_idx is only set from compressed lists, see ListCursor
+ActiveNode read_input_node(int parent_offset, int i, inout ListCursor cursor, out uint parent_idx) {
+    parent_idx = INVALID_INDEX;
+    if (!COMPRESSED_LISTS || bool(first_lvl)) return active_nodes_in.tab[parent_offset + i];
+    int offset;
+    ActiveNode node = ListCursor_next(active_nodes_in, cursor, offset);
+    if (offset != 0) parent_idx = uint(i + offset);
+    return node;
+}
+
+// parent offset and sign of an active node, numbered by write_compressed_list. The final level writes every parent
+// offset as 0, the tracer only reads the signs
+uint list_parent_code(Tmp tmp_i) {
+    uint parent_offset = FINAL_LEVEL ? 0u : uint(Tmp_parent_get(tmp_i));
+    return parent_offset << 1 | (Tmp_sign_get(tmp_i) ? 0u : 1u);
+}
+
+// Writes the list of the cell in the compressed layout and returns its byte offset. The size is only known once the new
+// indices of the parents are, so the nodes are visited three times: backwards to number them, like the uncompressed
+// path, then forwards to size the list and forwards again to write it.
+int write_compressed_list(int num_nodes, int parent_offset, int tmp_offset, int cell_num_active) {
+    int lane = int(gl_SubgroupInvocationID);
+
+    // the parent field of each active node then holds the offset of its parent in the new list, 0 for the root
+    if (!FINAL_LEVEL) {
+        int out_idx = cell_num_active-1;
+        for (int i = num_nodes-1; i >= 0; i--) {
+            Tmp tmp_i = tmp.tab[tmp_offset + 32*i + lane];
+            if (Tmp_skipped_range_get(tmp_i)) {
+                i = Tmp_parent_get(tmp_i);
+                continue;
+            }
+            if (!Tmp_active_global_get(tmp_i)) continue;
+            old_to_new_scratch.tab[tmp_offset + 32*i + lane] = uint16_t(out_idx);
+            int new_parent_old_idx = Tmp_parent_get(tmp_i);
+            int new_parent_offset = new_parent_old_idx != INVALID_INDEX ? int(old_to_new_scratch.tab[tmp_offset + 32*new_parent_old_idx + lane]) - out_idx : 0;
+            Tmp_parent_write(tmp_i, uint16_t(new_parent_offset));
+            tmp.tab[tmp_offset + 32*i + lane] = tmp_i;
+            out_idx--;
+        }
+    }
 
+    // the input list is decoded again by the last pass rather than keeping the node indices in old_to_new_scratch.
+    // Skipped ranges only exist at the first level, whose input is indexed directly, so jumping them keeps the cursor valid
+    ListCursor cursor = ListCursor_make(parent_offset);
+    uint list_size = 0;
+    int prev_idx = -1;
+    for (int i = 0; i < num_nodes; i++) {
+        uint unused_parent;
+        int node_idx = ActiveNode_index(read_input_node(parent_offset, i, cursor, unused_parent));
+        Tmp tmp_i = tmp.tab[tmp_offset + 32*i + lane];
+        if (Tmp_skipped_range_get(tmp_i)) {
+            i = Tmp_parent_get(tmp_i);
+            continue;
+        }
+        if (!Tmp_active_global_get(tmp_i)) continue;
+        list_size += list_varint_size(uint(node_idx - prev_idx - 1)) + list_varint_size(list_parent_code(tmp_i));
+        prev_idx = node_idx;
+    }
+
+    int cell_offset = atomicAdd(active_count.val, int(list_size));
+    ByteArrayRef list = ByteArrayRef(uint64_t(active_nodes_out));
+    uint pos = uint(cell_offset);
+    cursor = ListCursor_make(parent_offset);
+    prev_idx = -1;
+    for (int i = 0; i < num_nodes; i++) {
+        uint unused_parent;
+        int node_idx = ActiveNode_index(read_input_node(parent_offset, i, cursor, unused_parent));
+        Tmp tmp_i = tmp.tab[tmp_offset + 32*i + lane];
+        if (Tmp_skipped_range_get(tmp_i)) {
+            i = Tmp_parent_get(tmp_i);
+            continue;
+        }
+        if (!Tmp_active_global_get(tmp_i)) continue;
+        pos = list_varint_write(list, pos, uint(node_idx - prev_idx - 1));
+        pos = list_varint_write(list, pos, list_parent_code(tmp_i));
+        prev_idx = node_idx;
+    }
+    return cell_offset;
+}
 
 void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
     struct StackEntry {
         int idx;
         float d;
+        float err; // bound on the error of d from the half precision primitives, see eval_prim_bounded
     };
-    const int STACK_DEPTH = 128;
     StackEntry stack[STACK_DEPTH];
     int stack_idx = 0;
 
@@ -33,17 +147,46 @@ void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
         num_nodes = parent_cells_num_active.tab[parent_cell_idx];
     }
 
+    // cells outside of the frustum are left unpruned, the children of such a cell are outside as well and inherit its state.
+    // Shadow and AO rays that leave the frustum evaluate the full tree there
+    if (num_nodes == CELL_NOT_PRUNED || (bool(frustum_pruning) && !cell_in_frustum(cell_center, cell_size))) {
+        num_active_out.tab[cell_idx] = CELL_NOT_PRUNED;
+        return;
+    }
+
+    // the parent stopped subdividing, point at its list. The final level stores the decoded count for the tracer
+    if (num_nodes < CELL_LOD_TERMINAL) {
+        num_active_out.tab[cell_idx] = grid_size == lod.final_grid_size ? CELL_LOD_TERMINAL - num_nodes : num_nodes;
+        child_cells_offset.tab[cell_idx] = parent_offset;
+        cell_value_out.tab[cell_idx] = cell_value_in.tab[parent_cell_idx];
+        return;
+    }
+
     if (num_nodes == 0) {
         num_active_out.tab[cell_idx] = 0;
         cell_value_out.tab[cell_idx] = cell_value_in.tab[parent_cell_idx];
         return;
     }
 
+    if (num_nodes == 1 && COMPRESSED_LISTS) {
+        uint unused_parent;
+        ListCursor cursor = ListCursor_make(parent_offset);
+        ActiveNode node = read_input_node(parent_offset, 0, cursor, unused_parent);
+        uint code = ActiveNode_sign(node) ? 0u : 1u;
+        int cell_offset = atomicAdd(active_count.val, int(list_varint_size(uint(ActiveNode_index(node))) + 1));
+        ByteArrayRef list = ByteArrayRef(uint64_t(active_nodes_out));
+        list_varint_write(list, list_varint_write(list, uint(cell_offset), uint(ActiveNode_index(node))), code);
+        num_active_out.tab[cell_idx] = 1;
+        child_cells_offset.tab[cell_idx] = cell_offset;
+        cell_value_out.tab[cell_idx] = cell_value_in.tab[parent_cell_idx];
+        return;
+    }
+
     if (num_nodes == 1) {
         int cell_offset = atomicAdd(active_count.val, 1);
         num_active_out.tab[cell_idx] = 1;
         child_cells_offset.tab[cell_idx] = cell_offset;
-        parents_out.tab[cell_offset] = uint16_t(INVALID_INDEX);
+        if (!FINAL_LEVEL) parents_out.tab[cell_offset] = uint16_t(INVALID_INDEX);
         active_nodes_out.tab[cell_offset] = active_nodes_in.tab[parent_offset];
         cell_value_out.tab[cell_idx] = cell_value_in.tab[parent_cell_idx];
         return;
@@ -56,8 +199,24 @@ void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
     }
     tmp_offset = subgroupBroadcastFirst(tmp_offset);
 
-    for (int block = 0; block < (num_nodes+63) / 64; block++) {
-        if (block*64+gl_LocalInvocationIndex < num_nodes) {
+    // last index of a union's right subtree that was found to be too far from the cell to be evaluated
+    int skip_end = -1;
+
+    // the parent cell's list is read in order, and the backward passes find the sign and the parent of its nodes in tmp
+    bool compressed_in = COMPRESSED_LISTS && !bool(first_lvl);
+    ListCursor in_cursor = ListCursor_make(parent_offset);
+
+    int num_blocks = (num_nodes+63) / 64;
+#ifdef JIT_FIRST_LEVEL
+    // the scene-specific shader runs the unrolled tree instead, see shader_jit.h
+    if (bool(first_lvl)) {
+        stack[0].d = jit_first_level(cell_center, R, tmp_offset);
+        stack[0].err = 0;
+        num_blocks = 0;
+    }
+#endif
+    for (int block = 0; block < num_blocks; block++) {
+        if (!compressed_in && block*64+gl_LocalInvocationIndex < num_nodes) {
             s_parent_active_nodes[gl_LocalInvocationIndex] = active_nodes_in.tab[parent_offset + block*64 + gl_LocalInvocationIndex];
         }
         barrier();
@@ -66,23 +225,61 @@ void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
             int i = block*64 + element_idx;
             if (i >= num_nodes) break;
 
+            // the rest of a skipped range, which may span blocks
+            if (i <= skip_end) {
+                element_idx = skip_end - block*64;
+                continue;
+            }
+
+            // The first level walks the whole tree, where node i is the first node of at most one union right subtree.
+            // If a lower bound of that subtree is further than 2R+k above the left operand, evaluating it would only mark it inactive:
+            // skip it and push the bound instead, the union then evaluates to the left operand like it would have.
+            // The bound only holds outside of the subtree's bbox: inside, the subtree can be as negative as its inradius.
+            // Most nodes start no subtree, their end is read alone. Only the two ends of a skipped subtree are marked in tmp,
+            // every pass over the list jumps from one to the other.
+            if (bool(first_lvl) && stack_idx > 0 && skip_records.tab[i].end >= 0) {
+                SkipRecord record = skip_records.tab[i];
+                vec3 q = max(max(record.bbox_min.xyz - cell_center, cell_center - record.bbox_max.xyz), vec3(0));
+                float dist_to_bbox = length(q);
+                if (dist_to_bbox > 0) {
+                    float lower_bound = record.bbox_min.w * dist_to_bbox - record.bbox_max.w;
+                    float k = BinaryOp_blend_factor(binary_ops.tab[nodes.tab[record.end + 1].idx_in_type]);
+                    if (lower_bound - stack[stack_idx-1].d > 2 * R + k + stack[stack_idx-1].err) {
+                        tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID] = Tmp_skipped_range(record.end);
+                        tmp.tab[tmp_offset + 32*record.end + gl_SubgroupInvocationID] = Tmp_skipped_range(i);
+                        skip_end = record.end;
+                        StackEntry bound_entry;
+                        bound_entry.idx = record.end;
+                        bound_entry.d = lower_bound;
+                        bound_entry.err = 0;
+                        stack[stack_idx++] = bound_entry;
+                        element_idx = skip_end - block*64;
+                        continue;
+                    }
+                }
+            }
+
 #if 1
-            ActiveNode active_node = active_nodes_in.tab[parent_offset + i];
+            uint in_parent_idx;
+            ActiveNode active_node = read_input_node(parent_offset, i, in_cursor, in_parent_idx);
 #else
             ActiveNode active_node = s_parent_active_nodes[element_idx];
 #endif
             int node_idx = ActiveNode_index(active_node);
-            Node node = nodes.tab[node_idx];
+            BinaryOp op;
+            Primitive prim;
+            vec4 corner_rounding;
+            bool is_binary = packed_tree != 0ul ? PackedTree_fetch(packed_tree, node_idx, op, prim, corner_rounding) : Tree_fetch(nodes, binary_ops, prims, node_idx, op, prim, corner_rounding);
 
             float d;
-            if (node.type == NODETYPE_BINARY) {
+            float err;
+            if (is_binary) {
                 StackEntry left_entry = stack[stack_idx-2];
                 StackEntry right_entry = stack[stack_idx-1];
                 float left_val = left_entry.d;
                 float right_val = right_entry.d;
                 stack_idx -= 2;
 
-                BinaryOp op = binary_ops.tab[node.idx_in_type];
                 float k = BinaryOp_blend_factor(op);
                 float s = BinaryOp_sign(op);
 
@@ -98,9 +295,12 @@ void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
 #else
                 d = s*(min(s*left_val, s*right_val) - kernel(abs(left_val-right_val), k));
 #endif
+                err = max(left_entry.err, right_entry.err);
 
+                // the operands are only known within their error bounds, the node is skipped when the bounds can't
+                // change the result
                 int current_state;
-                if (abs(left_val - right_val) <= 2 * R + k) {
+                if (abs(left_val - right_val) <= 2 * R + k + left_entry.err + right_entry.err) {
                     current_state = NODESTATE_ACTIVE;
                 } else {
                     current_state = NODESTATE_SKIPPED;
@@ -114,26 +314,33 @@ void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
                 tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID] = Tmp(0);
                 Tmp_state_write(tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID], current_state);
                 //prim_dist[i] = 1e20;
-            } else if (node.type == NODETYPE_PRIMITIVE) {
-                Primitive prim = prims.tab[node.idx_in_type];
-                d = eval_prim(cell_center, prim);
+            } else {
+                d = eval_prim_bounded(cell_center, prim, corner_rounding, HALF_EVAL_ERROR_RATIO * R, err);
                 tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID] = Tmp(0);
                 Tmp_state_write(tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID], NODESTATE_ACTIVE);
                 //prim_dist[i] = d;
             }
 
+            if (compressed_in) {
+                Tmp tmp_i = tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID];
+                Tmp_sign_write(tmp_i, ActiveNode_sign(active_node));
+                Tmp_parent_write(tmp_i, uint16_t(in_parent_idx));
+                tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID] = tmp_i;
+            }
+
             d *= ActiveNode_sign(active_node) ? 1 : -1;
             StackEntry new_entry;
             new_entry.idx = i;
             new_entry.d = d;
+            new_entry.err = err;
             stack[stack_idx++] = new_entry;
         }
     }
 
     float d = stack[0].d;
-    if (abs(d) > 2*R) {
+    if (abs(d) - stack[0].err > 2*R) {
         num_active_out.tab[cell_idx] = 0;
-        cell_value_out.tab[cell_idx] = sign(stack[0].d) * (abs(stack[0].d) - R);
+        cell_value_out.tab[cell_idx] = sign(stack[0].d) * (abs(stack[0].d) - stack[0].err - R);
         return;
     }
 
@@ -143,12 +350,15 @@ void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
 
         Tmp tmp_i = tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID];
 
-        if (Tmp_state_get(tmp_i) == NODESTATE_INACTIVE) {
+        if (Tmp_skipped_range_get(tmp_i)) {
+            // no node in the range is active, nor read as a parent from outside of it
+            i = Tmp_parent_get(tmp_i);
+        } else if (Tmp_state_get(tmp_i) == NODESTATE_INACTIVE) {
             Tmp_active_global_write(tmp_i, false);
             Tmp_inactive_ancestors_write(tmp_i, true);
             tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID] = tmp_i;
         } else {
-            uint16_t parent_idx = uint16_t(parents_in.tab[parent_offset+i]);
+            uint16_t parent_idx = compressed_in ? Tmp_parent_get(tmp_i) : uint16_t(parents_in.tab[parent_offset+i]);
             Tmp tmp_parent;
             if (parent_idx != uint16_t(INVALID_INDEX)) tmp_parent = tmp.tab[tmp_offset + 32*parent_idx + gl_SubgroupInvocationID];
             bool node_has_inactive_ancestors = parent_idx != uint16_t(INVALID_INDEX) ? Tmp_inactive_ancestors_get(tmp_parent) : false;
@@ -156,8 +366,8 @@ void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
             if (node_active_global) cell_num_active += 1;
 
 
-            ActiveNode old_active_node = active_nodes_in.tab[parent_offset+i];
-            int node_sign = ActiveNode_sign(old_active_node) ? 1 : -1;
+            bool old_sign = compressed_in ? Tmp_sign_get(tmp_i) : ActiveNode_sign(active_nodes_in.tab[parent_offset+i]);
+            int node_sign = old_sign ? 1 : -1;
             uint16_t new_parent_idx;
             if (parent_idx != INVALID_INDEX && Tmp_state_get(tmp_parent) == NODESTATE_SKIPPED) {
                 node_sign *= Tmp_sign_get(tmp_parent) ? 1 : -1;
@@ -175,27 +385,67 @@ void compute_pruning(vec3 cell_center, vec3 cell_size, int cell_idx) {
     }
 
 
+    // there is no LOD with the compressed lists
+    if (COMPRESSED_LISTS) {
+        child_cells_offset.tab[cell_idx] = write_compressed_list(num_nodes, parent_offset, tmp_offset, cell_num_active);
+        num_active_out.tab[cell_idx] = cell_num_active;
+        if (grid_size == 256) {
+            cell_value_out.tab[cell_idx] = 0;
+        }
+        return;
+    }
+
+    // a cell that is small on screen, or whose list didn't shrink from its parent's, stops subdividing: its list goes to
+    // the end of the final level's buffer and the parents, only needed to prune the next level, are not written
+    bool lod_terminal = bool(lod.enabled) && grid_size < lod.final_grid_size
+        && ((!bool(first_lvl) && cell_num_active >= num_nodes) || cell_screen_size(cell_center, cell_size) < lod.threshold_px);
+
     // TODO: warp aggregated atomics
-    int cell_offset = atomicAdd(active_count.val, cell_num_active);
+    int cell_offset = -1;
+    ActiveNodesRef cell_active_nodes;
+    if (lod_terminal) {
+        cell_offset = lod.capacity - atomicAdd(lod.count, cell_num_active) - cell_num_active;
+        cell_active_nodes = lod.active_nodes;
+
+        // The LOD lists grow backwards from the end of a buffer whose front holds forward lists: this level's when it
+        // writes there, the previous level's when it reads them. A cell whose LOD list would reach them keeps subdividing
+        // instead, and its reservation is left as a hole.
+        int forward_count = 0;
+        if (uint64_t(active_nodes_out) == uint64_t(lod.active_nodes)) {
+            forward_count = atomicAdd(active_count.val, 0);
+        } else if (!bool(first_lvl) && uint64_t(active_nodes_in) == uint64_t(lod.active_nodes)) {
+            // the counters are indexed by grid level, see set_push_constants
+            forward_count = IntRef(uint64_t(active_count) - 2*4).val;
+        }
+        lod_terminal = cell_offset >= forward_count;
+    }
+    if (!lod_terminal) {
+        cell_offset = atomicAdd(active_count.val, cell_num_active);
+        cell_active_nodes = active_nodes_out;
+    }
 
 
     int out_idx = cell_num_active-1;
     for (int i = num_nodes-1; i >= 0; i--) {
         Tmp tmp_i = tmp.tab[tmp_offset + 32*i + gl_SubgroupInvocationID];
-        if (Tmp_active_global_get(tmp_i)) {
-            active_nodes_out.tab[cell_offset + out_idx] = ActiveNode_make(ActiveNode_index(active_nodes_in.tab[parent_offset+i]), Tmp_sign_get(tmp_i));
-            old_to_new_scratch.tab[tmp_offset + i*32 + gl_SubgroupInvocationID] = uint16_t(out_idx);
-
-            int new_parent_old_idx = Tmp_parent_get(tmp_i);
-            uint16_t new_parent_idx = new_parent_old_idx != INVALID_INDEX ? old_to_new_scratch.tab[tmp_offset + 32*new_parent_old_idx + gl_SubgroupInvocationID] : uint16_t(INVALID_INDEX);
-            parents_out.tab[cell_offset + out_idx] = new_parent_idx;
+        if (Tmp_skipped_range_get(tmp_i)) {
+            i = Tmp_parent_get(tmp_i);
+        } else if (Tmp_active_global_get(tmp_i)) {
+            cell_active_nodes.tab[cell_offset + out_idx] = ActiveNode_make(ActiveNode_index(active_nodes_in.tab[parent_offset+i]), Tmp_sign_get(tmp_i));
+            if (!lod_terminal && !FINAL_LEVEL) {
+                old_to_new_scratch.tab[tmp_offset + i*32 + gl_SubgroupInvocationID] = uint16_t(out_idx);
+
+                int new_parent_old_idx = Tmp_parent_get(tmp_i);
+                uint16_t new_parent_idx = new_parent_old_idx != INVALID_INDEX ? old_to_new_scratch.tab[tmp_offset + 32*new_parent_old_idx + gl_SubgroupInvocationID] : uint16_t(INVALID_INDEX);
+                parents_out.tab[cell_offset + out_idx] = new_parent_idx;
+            }
 
             out_idx--;
         }
     }
 
     child_cells_offset.tab[cell_idx] = cell_offset;
-    num_active_out.tab[cell_idx] = cell_num_active;
+    num_active_out.tab[cell_idx] = lod_terminal ? CELL_LOD_TERMINAL - cell_num_active : cell_num_active;
 
     // TODO: constant for max grid size
     if (out_idx == 1 || grid_size == 256) {
@@ -7,6 +7,9 @@ layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
 
 #include "common.glsl"
 
+// the last level: its lists are only traced, the parents that would prune the next level are not written
+layout(constant_id = 4) const bool FINAL_LEVEL = false;
+
 layout(push_constant) uniform PushConstant {
     //mat4 world_to_clip;
     vec4 aabb_min, aabb_max;
@@ -30,16 +33,24 @@ layout(push_constant) uniform PushConstant {
     TmpArrayRef tmp;
     Mat4Ref mvp;
     Vec4ArrayRef cam;
+    SkipRecordsRef skip_records;
     int total_num_nodes;
     int grid_size;
     int first_lvl;
-    float max_rel_err;
     float viz_max;
-    float alpha;
     int culling_enabled;
-    uint8_t num_samples_u8;
+    float gamma;
+    int num_samples;
+    int frustum_pruning;
+    uint64_t packed_tree;
+    ivec2 pad12;
+    LodRef lod;
 };
 
+#ifdef JIT_SDF
+#define JIT_FIRST_LEVEL
+#include "jit_sdf.glsl"
+#endif
 #include "common_culling.glsl"
 
 void main() {
@@ -1,5 +1,46 @@
+// Node fetch of the active list loops. The shaders whose push constants hold packed_tree define PACKED_TREE, and read
+// the packed layout when there is one.
+bool fetch_node(int node_idx, out BinaryOp op, out Primitive prim, out vec4 corner_rounding) {
+#ifdef PACKED_TREE
+    if (packed_tree != 0ul) return PackedTree_fetch(packed_tree, node_idx, op, prim, corner_rounding);
+#endif
+    return Tree_fetch(nodes, binary_ops, prims, node_idx, op, prim, corner_rounding);
+}
+
+// Versions of fetch_node and ListCursor_next for a subgroup whose active lanes all evaluate the same cell: the first lane
+// reads the node, the others get it from the broadcast, instead of every lane loading the same memory.
+bool fetch_node_first(int node_idx, out BinaryOp op, out Primitive prim, out vec4 corner_rounding) {
+    bool is_binary = false;
+    if (subgroupElect()) is_binary = fetch_node(node_idx, op, prim, corner_rounding);
+    is_binary = subgroupBroadcastFirst(is_binary);
+    if (is_binary) {
+        op.blend_factor_and_sign = subgroupBroadcastFirst(op.blend_factor_and_sign);
+    } else {
+        // the fields eval_prim reads
+        prim.data = subgroupBroadcastFirst(prim.data);
+        prim.m_row0 = subgroupBroadcastFirst(prim.m_row0);
+        prim.m_row1 = subgroupBroadcastFirst(prim.m_row1);
+        prim.m_row2 = subgroupBroadcastFirst(prim.m_row2);
+        prim.extrude_rounding = subgroupBroadcastFirst(prim.extrude_rounding);
+        prim.type = subgroupBroadcastFirst(prim.type);
+        corner_rounding = subgroupBroadcastFirst(corner_rounding);
+    }
+    return is_binary;
+}
+
+ActiveNode ListCursor_next_first(ActiveNodesRef list, inout ListCursor c) {
+    ActiveNode node = ActiveNode(uint16_t(0));
+    if (subgroupElect()) node = ListCursor_next(list, c);
+    c.pos = subgroupBroadcastFirst(c.pos);
+    c.node_idx = subgroupBroadcastFirst(c.node_idx);
+    return ActiveNode(uint16_t(subgroupBroadcastFirst(uint(node.idx_and_sign))));
+}
+
 float sdf(vec3 p) {
-    const int STACK_DEPTH = 128;
+#ifdef JIT_SDF
+    // scene-specific shader, see shader_jit.h
+    return sdf_jit(p);
+#else
     float stack[STACK_DEPTH];
     int stack_idx = 0;
 
@@ -30,40 +71,51 @@ float sdf(vec3 p) {
     }
 
     return stack[0];
+#endif
 }
 
 
-float sdf_active(vec3 p, int cell_idx, out bool near_field) {
+// With HALF_EVAL, the primitives whose error bound is at most max_half_err are evaluated in half precision, and err
+// receives the bound of the result (see eval_prim_bounded). A max_half_err of 0 keeps everything in full precision.
+float sdf_active(vec3 p, int cell_idx, float max_half_err, out bool near_field, out float err) {
     int num_active = cells_num_active.tab[cell_idx];
+    err = 0;
 
     if (num_active == 0) {
         near_field = false;
         return cell_error_out.tab[cell_idx];
     }
+    if (num_active == CELL_NOT_PRUNED) {
+        near_field = true;
+        return sdf(p);
+    }
 
-    const int STACK_DEPTH = 128;
     float stack[STACK_DEPTH];
     int stack_idx = 0;
 
-    int cell_offset = cells_offset.tab[cell_idx];
+    ListCursor cursor = ListCursor_make(cells_offset.tab[cell_idx]);
+    // neighbouring pixels mostly share the cell, the first lane then fetches the nodes for the whole subgroup
+    bool uniform_cell = subgroupAllEqual(cell_idx);
 
     for (int i = 0; i < num_active; i++) {
-        ActiveNode active_node = active_nodes_out.tab[cell_offset + i];
+        ActiveNode active_node = uniform_cell ? ListCursor_next_first(active_nodes_out, cursor) : ListCursor_next(active_nodes_out, cursor);
         int node_idx = ActiveNode_index(active_node);
 
-        Node node = nodes.tab[node_idx];
+        BinaryOp op;
+        Primitive prim;
+        vec4 corner_rounding;
         float d;
-        if (node.type == NODETYPE_BINARY) {
+        if (uniform_cell ? fetch_node_first(node_idx, op, prim, corner_rounding) : fetch_node(node_idx, op, prim, corner_rounding)) {
             float left_val = stack[stack_idx-2];
             float right_val = stack[stack_idx-1];
             stack_idx -= 2;
-            BinaryOp op = binary_ops.tab[node.idx_in_type];
             float k = BinaryOp_blend_factor(op);
             float s = BinaryOp_sign(op);
             d = s*(min(s*left_val, s*right_val)-kernel(abs(left_val-right_val), k));
-        } else if (node.type == NODETYPE_PRIMITIVE) {
-            Primitive prim = prims.tab[node.idx_in_type];
-            d = eval_prim(p, prim);
+        } else {
+            float prim_err;
+            d = eval_prim_bounded(p, prim, corner_rounding, max_half_err, prim_err);
+            err = max(err, prim_err);
         }
 
         d *= ActiveNode_sign(active_node) ? 1 : -1;
@@ -77,4 +129,83 @@ float sdf_active(vec3 p, int cell_idx, out bool near_field) {
     near_field = (num_active > 0);
 
     return stack[0];
-}
\ No newline at end of file
+}
+
+float sdf_active(vec3 p, int cell_idx, out bool near_field) {
+    float err;
+    return sdf_active(p, cell_idx, 0., near_field, err);
+}
+
+// evaluates the active list of a cell at four points at once, so that the node and primitive fetches are shared
+vec4 sdf_active4(vec3 p0, vec3 p1, vec3 p2, vec3 p3, int cell_idx, out bool near_field) {
+    int num_active = cells_num_active.tab[cell_idx];
+
+    if (num_active == 0) {
+        near_field = false;
+        return vec4(cell_error_out.tab[cell_idx]);
+    }
+    if (num_active == CELL_NOT_PRUNED) {
+        near_field = true;
+        return vec4(sdf(p0), sdf(p1), sdf(p2), sdf(p3));
+    }
+
+    vec4 stack[STACK_DEPTH];
+    int stack_idx = 0;
+
+    ListCursor cursor = ListCursor_make(cells_offset.tab[cell_idx]);
+    // neighbouring pixels mostly share the cell, the first lane then fetches the nodes for the whole subgroup
+    bool uniform_cell = subgroupAllEqual(cell_idx);
+
+    for (int i = 0; i < num_active; i++) {
+        ActiveNode active_node = uniform_cell ? ListCursor_next_first(active_nodes_out, cursor) : ListCursor_next(active_nodes_out, cursor);
+        int node_idx = ActiveNode_index(active_node);
+
+        BinaryOp op;
+        Primitive prim;
+        vec4 corner_rounding;
+        vec4 d;
+        if (uniform_cell ? fetch_node_first(node_idx, op, prim, corner_rounding) : fetch_node(node_idx, op, prim, corner_rounding)) {
+            vec4 left_val = stack[stack_idx-2];
+            vec4 right_val = stack[stack_idx-1];
+            stack_idx -= 2;
+            float k = BinaryOp_blend_factor(op);
+            float s = BinaryOp_sign(op);
+            d = s*(min(s*left_val, s*right_val)-kernel(abs(left_val-right_val), k));
+        } else {
+            d = vec4(eval_prim(p0, prim, corner_rounding), eval_prim(p1, prim, corner_rounding), eval_prim(p2, prim, corner_rounding), eval_prim(p3, prim, corner_rounding));
+        }
+
+        d *= ActiveNode_sign(active_node) ? 1 : -1;
+        if (stack_idx >= STACK_DEPTH) {
+            //debugPrintfEXT("Stack overflow\n");
+            return vec4(1.0 / 0.0);
+        }
+        stack[stack_idx++] = d;
+    }
+
+    near_field = (num_active > 0);
+
+    return stack[0];
+}
+
+
+vec3 grad_active(vec3 p, int cell_idx) {
+    float h = 5e-4;
+    const vec2 k = vec2(1,-1);
+    bool nf;
+    vec4 d = sdf_active4(p+k.xyy*h, p+k.yyx*h, p+k.yxy*h, p+k.xxx*h, cell_idx, nf);
+    return normalize(k.xyy*d.x +
+                     k.yyx*d.y +
+                     k.yxy*d.z +
+                     k.xxx*d.w);
+}
+
+vec3 grad(vec3 p) {
+    float h = 5e-4;
+    const vec2 k = vec2(1,-1);
+    bool nf;
+    return normalize(k.xyy*sdf(p+k.xyy*h)+
+                     k.yyx*sdf(p+k.yyx*h)+
+                     k.yxy*sdf(p+k.yxy*h)+
+                     k.xxx*sdf(p+k.xxx*h));
+}
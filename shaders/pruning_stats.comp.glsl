@@ -0,0 +1,40 @@
+#version 460 core
+#include "extensions.glsl"
+
+layout(local_size_x = 4, local_size_y = 4, local_size_z = 4) in;
+
+#include "../include/constants.h"
+#include "common.glsl"
+
+layout(push_constant) uniform PushConstant {
+    IntArrayRef cells_num_active;
+    UintArrayRef stats; // PRUNING_STATS_NUM_BINS counters per level
+    int grid_size;
+    int level_slot;
+};
+
+shared uint s_histogram[PRUNING_STATS_NUM_BINS];
+
+// histogram of the number of active nodes per cell, bin 0 counts the far-field cells and the cells left unpruned by frustum pruning
+// and bin b > 0 counts the cells with [2^(b-1), 2^b) active nodes
+void main() {
+    if (gl_LocalInvocationIndex < PRUNING_STATS_NUM_BINS) {
+        s_histogram[gl_LocalInvocationIndex] = 0;
+    }
+    barrier();
+
+    if (all(lessThan(gl_GlobalInvocationID.xyz, uvec3(grid_size)))) {
+        int n = cells_num_active.tab[get_cell_idx(ivec3(gl_GlobalInvocationID.xyz), grid_size)];
+        if (n < CELL_LOD_TERMINAL) n = CELL_LOD_TERMINAL - n;
+        int bin = n <= 0 ? 0 : min(findMSB(n) + 1, PRUNING_STATS_NUM_BINS - 1);
+        atomicAdd(s_histogram[bin], 1);
+    }
+    barrier();
+
+    if (gl_LocalInvocationIndex < PRUNING_STATS_NUM_BINS) {
+        uint count = s_histogram[gl_LocalInvocationIndex];
+        if (count > 0) {
+            atomicAdd(stats.tab[level_slot * PRUNING_STATS_NUM_BINS + gl_LocalInvocationIndex], count);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#version 460 core
+#include "extensions.glsl"
+
+layout(local_size_x = 64) in;
+
+#include "../include/constants.h"
+#include "common.glsl"
+
+layout(push_constant) uniform PushConstant {
+    vec4 aabb_min;
+    vec4 aabb_max;
+    PrimitivesRef prims;
+    BinaryOpsRef binary_ops;
+    NodesRef nodes;
+    ActiveNodesRef active_nodes_out;
+    IntArrayRef cells_offset;
+    IntArrayRef cells_num_active;
+    FloatArrayRef cell_error_out;
+    FloatArrayRef points;
+    Vec4ArrayRef results;
+    int total_num_nodes;
+    int grid_size;
+    int culling_enabled;
+    int num_points;
+    int compute_gradients;
+};
+
+#include "eval.glsl"
+
+void main() {
+    int idx = int(gl_GlobalInvocationID.x);
+    if (idx >= num_points) return;
+
+    vec3 p = vec3(points.tab[3*idx+0], points.tab[3*idx+1], points.tab[3*idx+2]);
+
+    // the pruning grid only covers the AABB, points outside of it use the full tree
+    bool in_grid = all(greaterThanEqual(p, aabb_min.xyz)) && all(lessThan(p, aabb_max.xyz));
+
+    float d;
+    vec3 g = vec3(0);
+    if (bool(culling_enabled) && in_grid) {
+        vec3 cell_size = (aabb_max.xyz - aabb_min.xyz) / float(grid_size);
+        ivec3 cell = ivec3((p - aabb_min.xyz) / cell_size);
+        cell = clamp(cell, ivec3(0), ivec3(grid_size-1));
+        int cell_idx = int(get_cell_idx(cell, grid_size));
+
+        bool near_field;
+        d = sdf_active(p, cell_idx, near_field);
+        // far-field cells only store a distance bound, there is no gradient to return
+        if (bool(compute_gradients) && near_field) {
+            g = grad_active(p, cell_idx);
+        }
+    } else {
+        d = sdf(p);
+        if (bool(compute_gradients)) {
+            g = grad(p);
+        }
+    }
+
+    results.tab[idx] = vec4(g, d);
+}
@@ -0,0 +1,174 @@
+#version 460 core
+#include "extensions.glsl"
+
+layout(local_size_x = 64) in;
+
+#include "../include/constants.h"
+#include "common.glsl"
+
+struct RayHit {
+    vec4 normal_t; // normal in xyz, t in w, t is -1 when the ray misses
+    int prim;      // index of the closest primitive in the GPU primitive buffer, -1 on miss
+    int inside;    // 1 when t is where a negative distance was found rather than a surface hit
+    int pad0, pad1;
+};
+
+layout(std430, buffer_reference, buffer_reference_align = 16) buffer RayHitArrayRef {
+    RayHit tab[];
+};
+
+layout(push_constant) uniform PushConstant {
+    vec4 aabb_min;
+    vec4 aabb_max;
+    PrimitivesRef prims;
+    BinaryOpsRef binary_ops;
+    NodesRef nodes;
+    ActiveNodesRef active_nodes_out;
+    IntArrayRef cells_offset;
+    IntArrayRef cells_num_active;
+    FloatArrayRef cell_error_out;
+    FloatArrayRef rays; // origin and direction interleaved, 6 floats per ray
+    RayHitArrayRef hits;
+    int total_num_nodes;
+    int grid_size;
+    int culling_enabled;
+    int num_rays;
+};
+
+#include "eval.glsl"
+#include "trace.glsl"
+
+int get_prim(vec3 p);
+
+// same traversal as get_color_active, but tracks which primitive dominates the blend
+int get_prim_active(vec3 p, int cell_idx) {
+    int num_active = cells_num_active.tab[cell_idx];
+    if (num_active == 0) {
+        return -1;
+    }
+    if (num_active == CELL_NOT_PRUNED) {
+        return get_prim(p);
+    }
+
+
+    struct StackEntry {
+        float d;
+        int prim;
+    };
+    StackEntry stack[STACK_DEPTH];
+    int stack_idx = 0;
+
+    ListCursor cursor = ListCursor_make(cells_offset.tab[cell_idx]);
+
+    for (int i = 0; i < num_active; i++) {
+        ActiveNode active_node = ListCursor_next(active_nodes_out, cursor);
+        int node_idx = ActiveNode_index(active_node);
+
+        Node node = nodes.tab[node_idx];
+        float d;
+        int prim;
+        if (node.type == NODETYPE_BINARY) {
+            StackEntry left_entry = stack[stack_idx-2];
+            StackEntry right_entry = stack[stack_idx-1];
+            stack_idx -= 2;
+            BinaryOp op = binary_ops.tab[node.idx_in_type];
+            float k = BinaryOp_blend_factor(op);
+            float s = BinaryOp_sign(op);
+            vec2 v;
+            if (k == 0) {
+                v = (s*left_entry.d < s*right_entry.d) ? vec2(s*left_entry.d, 0) : vec2(s*right_entry.d, 1);
+            } else {
+                v = smin_blend(s*left_entry.d, s*right_entry.d, k);
+            }
+            d = s*v.x;
+            prim = v.y > 0.5 ? right_entry.prim : left_entry.prim;
+        } else if (node.type == NODETYPE_PRIMITIVE) {
+            d = eval_prim(p, prims.tab[node.idx_in_type]);
+            prim = node.idx_in_type;
+        }
+
+        d *= ActiveNode_sign(active_node) ? 1 : -1;
+        if (stack_idx >= STACK_DEPTH) {
+            return -1;
+        }
+        stack[stack_idx++] = StackEntry(d, prim);
+    }
+
+    return stack[0].prim;
+}
+
+int get_prim(vec3 p) {
+
+    struct StackEntry {
+        float d;
+        int prim;
+    };
+    StackEntry stack[STACK_DEPTH];
+    int stack_idx = 0;
+
+    for (int i = 0; i < total_num_nodes; i++) {
+        Node node = nodes.tab[i];
+        float d;
+        int prim;
+        if (node.type == NODETYPE_BINARY) {
+            StackEntry left_entry = stack[stack_idx-2];
+            StackEntry right_entry = stack[stack_idx-1];
+            float right_val = right_entry.d;
+            stack_idx -= 2;
+            BinaryOp op = binary_ops.tab[node.idx_in_type];
+            float k = BinaryOp_blend_factor(op);
+            float s = BinaryOp_sign(op);
+            if (BinaryOp_op(op) == OP_SUB) right_val *= -1;
+            vec2 v;
+            if (k == 0) {
+                v = (s*left_entry.d < s*right_val) ? vec2(s*left_entry.d, 0) : vec2(s*right_val, 1);
+            } else {
+                v = smin_blend(s*left_entry.d, s*right_val, k);
+            }
+            d = s*v.x;
+            prim = v.y > 0.5 ? right_entry.prim : left_entry.prim;
+        } else if (node.type == NODETYPE_PRIMITIVE) {
+            d = eval_prim(p, prims.tab[node.idx_in_type]);
+            prim = node.idx_in_type;
+        }
+
+        if (stack_idx >= STACK_DEPTH) {
+            return -1;
+        }
+        stack[stack_idx++] = StackEntry(d, prim);
+    }
+
+    return stack[0].prim;
+}
+
+void main() {
+    int idx = int(gl_GlobalInvocationID.x);
+    if (idx >= num_rays) return;
+
+    vec3 ray_o = vec3(rays.tab[6*idx+0], rays.tab[6*idx+1], rays.tab[6*idx+2]);
+    vec3 ray_d = normalize(vec3(rays.tab[6*idx+3], rays.tab[6*idx+4], rays.tab[6*idx+5]));
+
+    float t;
+    int status = sphere_trace(ray_o, ray_d, t);
+    // a ray that runs out of steps is reported as a miss rather than at wherever it stopped
+    if (status != TRACE_HIT && status != TRACE_INSIDE) {
+        hits.tab[idx] = RayHit(vec4(0,0,0,-1), -1, 0, 0, 0);
+        return;
+    }
+
+    vec3 p = ray_o + t * ray_d;
+    vec3 n;
+    int prim;
+    if (bool(culling_enabled)) {
+        vec3 cell_size = (aabb_max.xyz - aabb_min.xyz) / float(grid_size);
+        ivec3 cell = clamp(ivec3((p - aabb_min.xyz) / cell_size), ivec3(0), ivec3(grid_size-1));
+        int cell_idx = int(get_cell_idx(cell, grid_size));
+        n = grad_active(p, cell_idx);
+        prim = get_prim_active(p, cell_idx);
+    } else {
+        n = grad(p);
+        prim = get_prim(p);
+    }
+
+    hits.tab[idx] = RayHit(vec4(n, t), prim, status == TRACE_INSIDE ? 1 : 0, 0, 0);
+}
@@ -30,34 +30,40 @@ layout(push_constant) uniform PushConstant {
     ivec2 pad10;
     Mat4Ref mvp;
     Vec4ArrayRef cam;
+    ivec2 pad11;
     int total_num_nodes;
     int grid_size;
     int first_lvl;
-    float max_rel_err;
     float viz_max;
-    float alpha;
     int culling_enabled;
     float gamma;
     int num_samples;
+    int frustum_pruning;
+    uint64_t packed_tree;
+    UintArrayRef pixel_cost;
 };
 
+#define PACKED_TREE
+#ifdef JIT_SDF
+#include "jit_sdf.glsl"
+#endif
 #include "eval.glsl"
+#include "trace.glsl"
 
-vec2 smin_blend( float a, float b, float k )
-{
-    float h = max(k-abs(a-b), 0) / k;
-    float m = h*h*0.5;
-    float s = m*k*0.5;
-    return (a<b) ? vec2(a-s,m) : vec2(b-s,1-m);
-}
+// node evaluations of the shadow rays and AO samples, see SHADING_MODE_COST
+int shading_num_node_evals = 0;
+
+vec3 get_color(vec3 p);
 
 vec3 get_color_active(vec3 p, int cell_idx) {
     int num_active = cells_num_active.tab[cell_idx];
     if (num_active == 0) {
         return vec3(0);
     }
+    if (num_active == CELL_NOT_PRUNED) {
+        return get_color(p);
+    }
 
-    const int STACK_DEPTH = 128;
 
     struct StackEntry {
         float d;
@@ -66,10 +72,10 @@ vec3 get_color_active(vec3 p, int cell_idx) {
     StackEntry stack[STACK_DEPTH];
     int stack_idx = 0;
 
-    int cell_offset = cells_offset.tab[cell_idx];
+    ListCursor cursor = ListCursor_make(cells_offset.tab[cell_idx]);
 
     for (int i = 0; i < num_active; i++) {
-        ActiveNode active_node = active_nodes_out.tab[cell_offset + i];
+        ActiveNode active_node = ListCursor_next(active_nodes_out, cursor);
         int node_idx = ActiveNode_index(active_node);
 
         Node node = nodes.tab[node_idx];
@@ -108,7 +114,6 @@ vec3 get_color_active(vec3 p, int cell_idx) {
 }
 
 vec3 get_color(vec3 p) {
-    const int STACK_DEPTH = 128;
 
     struct StackEntry {
         float d;
@@ -157,27 +162,6 @@ vec3 get_color(vec3 p) {
 }
 
 
-vec3 grad_active(vec3 p, int cell_idx) {
-    float h = 5e-4;
-    const vec2 k = vec2(1,-1);
-    bool nf;
-    return normalize(k.xyy*sdf_active(p+k.xyy*h, cell_idx,nf)+
-                     k.yyx*sdf_active(p+k.yyx*h, cell_idx,nf)+
-                     k.yxy*sdf_active(p+k.yxy*h, cell_idx,nf)+
-                     k.xxx*sdf_active(p+k.xxx*h, cell_idx,nf));
-}
-
-vec3 grad(vec3 p) {
-    float h = 5e-4;
-    const vec2 k = vec2(1,-1);
-    bool nf;
-    return normalize(k.xyy*sdf(p+k.xyy*h)+
-                     k.yyx*sdf(p+k.yyx*h)+
-                     k.yxy*sdf(p+k.yxy*h)+
-                     k.xxx*sdf(p+k.xxx*h));
-}
-
-
 #if 0
 float ambient_occlusion(vec3 p, vec3 N, int cell_idx) {
     float s = 0;
@@ -232,25 +216,13 @@ float ambient_occlusion( in vec3 p, in vec3 n, in float maxDist, in float fallof
 
         bool nf;
         ao += (l - max(sdf_active( p + rd, cell_idx,  nf),0.)) / maxDist * falloff;
+        shading_num_node_evals += num_node_evals(cell_idx);
     }
 
     return clamp( 1.-ao*nbIteInv, 0., 1.);
 }
 
 
-bool BBoxIntersect(vec3 boxMin, vec3 boxMax, vec3 r_o, vec3 r_d, out float t_inter) {
-    vec3 tbot = (boxMin - r_o) / r_d;
-    vec3 ttop = (boxMax - r_o) / r_d;
-    vec3 tmin = min(ttop, tbot);
-    vec3 tmax = max(ttop, tbot);
-    vec2 t = max(tmin.xx, tmin.yz);
-    float t0 = max(t.x, t.y);
-    t = min(tmax.xx, tmax.yz);
-    float t1 = min(t.x, t.y);
-    t_inter = max(t0,0.0);
-    return t1 > max(t0, 0.0);
-}
-
 bool shadow_ray_intersects_active(vec3 ray_o, vec3 ray_d, vec3 cell_size) {
     //float t = 3e-3;
     float t = 0;
@@ -267,6 +239,7 @@ bool shadow_ray_intersects_active(vec3 ray_o, vec3 ray_d, vec3 cell_size) {
 
         bool near_field = true;
         float d = sdf_active(p, cell_idx, near_field);
+        shading_num_node_evals += num_node_evals(cell_idx);
 
         if (d < 1e-4) {
             return true;
@@ -287,6 +260,7 @@ bool shadow_ray_intersects(vec3 ray_o, vec3 ray_d, vec3 cell_size) {
         }
 
         float d = sdf(p);
+        shading_num_node_evals += total_num_nodes;
 
         if (d < 1e-4) {
             return true;
@@ -297,6 +271,14 @@ bool shadow_ray_intersects(vec3 ray_o, vec3 ray_d, vec3 cell_size) {
 }
 
 
+void write_pixel_cost() {
+    uint num_pixels = uint(u_Resolution.x) * uint(u_Resolution.y);
+    uint pixel_idx = uint(gl_FragCoord.y) * uint(u_Resolution.x) + uint(gl_FragCoord.x);
+    pixel_cost.tab[pixel_idx] = uint(trace_num_steps);
+    pixel_cost.tab[num_pixels + pixel_idx] = uint(trace_num_node_evals);
+    pixel_cost.tab[2*num_pixels + pixel_idx] = uint(shading_num_node_evals);
+}
+
 void main () { 
 
     vec3 cam_pos = vec3(cam.tab[0]);
@@ -351,51 +333,25 @@ void main () {
 
         gl_FragDepth = 1;
 
-        float t = 0;
-        if (!BBoxIntersect(aabb_min.xyz, aabb_max.xyz, ray_o, ray_d, t)) {
+        float t;
+        int trace_status = sphere_trace(ray_o, ray_d, t);
+        if (trace_status == TRACE_MISS_AABB) {
             outColor += vec4(cam.tab[3].rgb,1);
             continue;
         }
-        t += 1e-4;
+        if (trace_status == TRACE_INSIDE) {
+            outColor = vec4(0,1,0,1);
+            if (shading_mode == SHADING_MODE_COST) write_pixel_cost();
+            return;
+        }
+        if (trace_status == TRACE_MISS) {
+            t = -1;
+        }
+        // TRACE_UNCONVERGED is shaded at the last position: the budget mostly runs out on grazing rays along the surface,
+        // where a hole would stand out more than the small offset
 
         vec3 cell_size = (aabb_max.xyz - aabb_min.xyz) / float(grid_size);
 
-        for (int i = 0; i < 256; i++) {
-            vec3 p = ray_o + t * ray_d;
-
-            if (any(lessThan(p, aabb_min.xyz)) || any(greaterThanEqual(p, aabb_max.xyz))) {
-                t = -1;
-                break;
-            }
-
-            ivec3 cell = ivec3((p - aabb_min.xyz) / cell_size);
-            cell = clamp(cell, ivec3(0), ivec3(grid_size-1));
-            //if (all(greaterThanEqual(debug_cell.xyz, ivec3(0)))) {
-            //    cell = debug_cell.xyz;
-            //}
-            int cell_idx = int(get_cell_idx(cell, grid_size));
-
-
-
-            bool near_field = true;
-            float d;
-            if (bool(culling_enabled)) {
-                d = sdf_active(p, cell_idx, near_field);
-            } else {
-                d = sdf(p);
-            }
-
-            if (d < -1e-4) {
-                outColor = vec4(0,1,0,1);
-                return;
-            }
-
-            if (near_field && abs(d) < min(5e-4, 5e-4*t)) {
-                break;
-            }
-            t += abs(d);
-        }
-        
         vec3 color = vec3(0);
         if (t >= 0) {
             vec3 p = ray_o + t * ray_d;
@@ -436,7 +392,7 @@ void main () {
                 }
 
                 float ao;
-                if (shading_mode == SHADING_MODE_BEAUTY) {
+                if (shading_mode == SHADING_MODE_BEAUTY || shading_mode == SHADING_MODE_COST) {
                     ao = 0.4 * ambient_occlusion(p,normal,1e-1,3);
                 } else {
                     ao = 0.4;
@@ -476,5 +432,10 @@ void main () {
         outColor += vec4 (color, 1);
     }
     outColor /= num_samples;
+    if (shading_mode == SHADING_MODE_COST) {
+        // colormap_max is in thousands of node evaluations
+        write_pixel_cost();
+        outColor = vec4(inferno(min(1, float(trace_num_node_evals + shading_num_node_evals) / (1000 * viz_max))), 1);
+    }
     outColor = vec4(pow(outColor.rgb, vec3(gamma)), 1);
 }
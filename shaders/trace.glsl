@@ -0,0 +1,88 @@
+// sphere tracing through the pruned grid, or through the full tree when pruning is disabled
+// expects the same push constant names as eval.glsl, plus culling_enabled
+
+const int TRACE_HIT = 0;
+const int TRACE_MISS_AABB = 1; // the ray does not intersect the AABB
+const int TRACE_MISS = 2;      // the ray leaves the AABB without hitting the surface
+const int TRACE_INSIDE = 3;    // a negative distance was found along the ray
+const int TRACE_UNCONVERGED = 4; // the step budget ran out before the surface was reached, t is the last position
+
+// cost counters accumulated by sphere_trace, they are dead code unless a caller reads them
+int trace_num_steps = 0;
+int trace_num_node_evals = 0;
+
+// number of nodes evaluated by one sdf_active() call in the cell, or by one sdf() call without pruning
+int num_node_evals(int cell_idx) {
+    if (!bool(culling_enabled)) return total_num_nodes;
+    int num_active = cells_num_active.tab[cell_idx];
+    return num_active == CELL_NOT_PRUNED ? total_num_nodes : num_active;
+}
+
+bool BBoxIntersect(vec3 boxMin, vec3 boxMax, vec3 r_o, vec3 r_d, out float t_inter) {
+    vec3 tbot = (boxMin - r_o) / r_d;
+    vec3 ttop = (boxMax - r_o) / r_d;
+    vec3 tmin = min(ttop, tbot);
+    vec3 tmax = max(ttop, tbot);
+    vec2 t = max(tmin.xx, tmin.yz);
+    float t0 = max(t.x, t.y);
+    t = min(tmax.xx, tmax.yz);
+    float t1 = min(t.x, t.y);
+    t_inter = max(t0,0.0);
+    return t1 > max(t0, 0.0);
+}
+
+int sphere_trace(vec3 ray_o, vec3 ray_d, out float t) {
+    t = 0;
+    if (!BBoxIntersect(aabb_min.xyz, aabb_max.xyz, ray_o, ray_d, t)) {
+        return TRACE_MISS_AABB;
+    }
+    t += 1e-4;
+
+    vec3 cell_size = (aabb_max.xyz - aabb_min.xyz) / float(grid_size);
+    float max_half_err = HALF_EVAL ? HALF_EVAL_ERROR_RATIO * 0.5 * length(cell_size) : 0.;
+
+    for (int i = 0; i < 256; i++) {
+        vec3 p = ray_o + t * ray_d;
+
+        if (any(lessThan(p, aabb_min.xyz)) || any(greaterThanEqual(p, aabb_max.xyz))) {
+            return TRACE_MISS;
+        }
+
+        ivec3 cell = ivec3((p - aabb_min.xyz) / cell_size);
+        cell = clamp(cell, ivec3(0), ivec3(grid_size-1));
+        //if (all(greaterThanEqual(debug_cell.xyz, ivec3(0)))) {
+        //    cell = debug_cell.xyz;
+        //}
+        int cell_idx = int(get_cell_idx(cell, grid_size));
+
+        bool near_field = true;
+        float d;
+        float err = 0;
+        if (bool(culling_enabled)) {
+            d = sdf_active(p, cell_idx, max_half_err, near_field, err);
+            trace_num_node_evals += num_node_evals(cell_idx);
+            // a half precision result is only used away from the hit threshold, where its bound can't change the
+            // outcome of the tests below
+            if (err > 0 && abs(d) - err < 5e-4) {
+                d = sdf_active(p, cell_idx, near_field);
+                err = 0;
+                trace_num_node_evals += num_node_evals(cell_idx);
+            }
+        } else {
+            d = sdf(p);
+            trace_num_node_evals += num_node_evals(cell_idx);
+        }
+        trace_num_steps++;
+
+        if (d < -1e-4) {
+            return TRACE_INSIDE;
+        }
+
+        if (near_field && abs(d) < min(5e-4, 5e-4*t)) {
+            return TRACE_HIT;
+        }
+        t += abs(d) - err;
+    }
+
+    return TRACE_UNCONVERGED;
+}
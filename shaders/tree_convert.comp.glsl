@@ -0,0 +1,124 @@
+#version 460 core
+#include "extensions.glsl"
+
+layout(local_size_x = 64) in;
+
+#include "../include/constants.h"
+#include "common.glsl"
+
+// see CSGNode in utils.h, a binary node's BinaryOp is stored in the first word of the primitive
+struct CSGNode {
+    Primitive primitive;
+    int type;
+    int left;
+    int right;
+    uint sign; // C++ bool, only the low byte is set
+};
+
+layout(std430, buffer_reference, buffer_reference_align = 16) buffer CSGNodesRef {
+    CSGNode tab[];
+};
+
+layout(std430, buffer_reference, buffer_reference_align = 8) buffer Ivec2ArrayRef {
+    ivec2 tab[];
+};
+
+layout(push_constant) uniform PushConstant {
+    CSGNodesRef csg_nodes;
+    UintArrayRef csg_words; // csg_nodes as 32-bit words
+    IntArrayRef links;
+    IntArrayRef next_in;
+    IntArrayRef next_out;
+    Ivec2ArrayRef rank_in;
+    Ivec2ArrayRef rank_out;
+    NodesRef nodes;
+    PrimitivesRef prims;
+    BinaryOpsRef binary_ops;
+    Uint16ArrayRef parents;
+    ActiveNodesRef active_nodes;
+    int num_nodes;
+    int root_idx;
+    int pass;
+};
+
+const int CSG_NODE_WORDS = 28;
+
+// The GPU order is the postfix order of the tree, left subtree first. It is computed from the Euler tour of the tree,
+// where every node v has an enter event 2v and an exit event 2v+1: the tour is ranked by pointer jumping, counting the
+// exit events of the primitives (x) and of the binary nodes (y) from each event to the end of the tour. The postfix
+// index of v is the number of exit events before its own.
+void main() {
+    int idx = int(gl_GlobalInvocationID.x);
+
+    if (pass == TREE_CONVERT_PASS_LINKS) {
+        // links holds -1 for the root, parent << 1 | is_right_child for the other nodes
+        if (idx >= num_nodes) return;
+        CSGNode node = csg_nodes.tab[idx];
+        if (node.type == NODETYPE_BINARY) {
+            links.tab[node.left] = idx << 1;
+            links.tab[node.right] = (idx << 1) | 1;
+        }
+    }
+    else if (pass == TREE_CONVERT_PASS_TOUR) {
+        if (idx >= 2 * num_nodes) return;
+        int v = idx >> 1;
+        int type = csg_nodes.tab[v].type;
+        int next;
+        ivec2 weight = ivec2(0);
+        if ((idx & 1) == 0) {
+            // enter: go down the left subtree, or straight to the exit of a leaf
+            next = type == NODETYPE_BINARY ? 2 * csg_nodes.tab[v].left : idx + 1;
+        } else {
+            // exit: go to the right sibling, or to the exit of the parent
+            int link = links.tab[v];
+            int parent = link >> 1;
+            if (link < 0) next = -1;
+            else if ((link & 1) == 0) next = 2 * csg_nodes.tab[parent].right;
+            else next = 2 * parent + 1;
+            weight = type == NODETYPE_PRIMITIVE ? ivec2(1, 0) : ivec2(0, 1);
+        }
+        next_out.tab[idx] = next;
+        rank_out.tab[idx] = weight;
+    }
+    else if (pass == TREE_CONVERT_PASS_RANK) {
+        if (idx >= 2 * num_nodes) return;
+        int next = next_in.tab[idx];
+        ivec2 rank = rank_in.tab[idx];
+        if (next >= 0) {
+            rank += rank_in.tab[next];
+            next = next_in.tab[next];
+        }
+        next_out.tab[idx] = next;
+        rank_out.tab[idx] = rank;
+    }
+    else if (pass == TREE_CONVERT_PASS_SCATTER) {
+        if (idx >= num_nodes) return;
+        // the enter event of the root counts the whole tree
+        ivec2 total = rank_in.tab[2 * root_idx];
+        ivec2 rank = rank_in.tab[2 * idx + 1];
+        int gpu_idx = total.x + total.y - rank.x - rank.y;
+
+        CSGNode node = csg_nodes.tab[idx];
+        int idx_in_type;
+        if (node.type == NODETYPE_PRIMITIVE) {
+            idx_in_type = total.x - rank.x;
+            prims.tab[idx_in_type] = node.primitive;
+        } else {
+            idx_in_type = total.y - rank.y;
+            binary_ops.tab[idx_in_type].blend_factor_and_sign = csg_words.tab[idx * CSG_NODE_WORDS];
+        }
+        nodes.tab[gpu_idx].type = node.type;
+        nodes.tab[gpu_idx].idx_in_type = idx_in_type;
+
+        uint sign = (node.sign & 0xffu) != 0u ? 0u : 1u << 15;
+        active_nodes.tab[gpu_idx].idx_and_sign = uint16_t(uint(gpu_idx) | sign);
+
+        int link = links.tab[idx];
+        uint parent = 0xffff;
+        if (link >= 0) {
+            ivec2 parent_rank = rank_in.tab[2 * (link >> 1) + 1];
+            parent = uint(total.x + total.y - parent_rank.x - parent_rank.y);
+        }
+        parents.tab[gpu_idx] = uint16_t(parent);
+    }
+}
@@ -0,0 +1,412 @@
+#include "context.h"
+#include "scene.h"
+#include "tree.h"
+#include "scene_converter.h"
+#include "CLI/CLI.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/filewritestream.h>
+
+// one line per keyframe: yaw pitch dist target_x target_y target_z, same units as the viewer's CLI options
+struct CameraKeyframe {
+    float yaw;
+    float pitch;
+    float dist;
+    glm::vec3 target;
+};
+
+std::vector<CameraKeyframe> load_camera_path(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        fprintf(stderr, "Failed to open camera path: %s\n", path.c_str());
+        abort();
+    }
+
+    std::vector<CameraKeyframe> keyframes;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream ss(line);
+        CameraKeyframe k{};
+        if (!(ss >> k.yaw >> k.pitch >> k.dist)) {
+            fprintf(stderr, "Invalid camera keyframe: %s\n", line.c_str());
+            abort();
+        }
+        ss >> k.target.x >> k.target.y >> k.target.z;
+        keyframes.push_back(k);
+    }
+    if (keyframes.empty()) {
+        fprintf(stderr, "Empty camera path: %s\n", path.c_str());
+        abort();
+    }
+    return keyframes;
+}
+
+// linear interpolation along the keyframes, t in [0,1]
+CameraKeyframe sample_camera_path(const std::vector<CameraKeyframe>& keyframes, float t) {
+    if (keyframes.size() == 1) return keyframes[0];
+    float x = t * (float)(keyframes.size() - 1);
+    int i = std::min((int)x, (int)keyframes.size() - 2);
+    float a = x - (float)i;
+    const CameraKeyframe& k0 = keyframes[i];
+    const CameraKeyframe& k1 = keyframes[i+1];
+    return {
+        .yaw = glm::mix(k0.yaw, k1.yaw, a),
+        .pitch = glm::mix(k0.pitch, k1.pitch, a),
+        .dist = glm::mix(k0.dist, k1.dist, a),
+        .target = glm::mix(k0.target, k1.target, a)
+    };
+}
+
+float percentile(std::vector<float> values, float p) {
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)std::round(p * (float)(values.size() - 1));
+    return values[idx];
+}
+
+template<typename Writer>
+void write_pixel_cost(Writer& writer, const char* name, const PixelCostCounterStats& stats) {
+    writer.Key(name);
+    writer.StartObject();
+    writer.Key("mean"); writer.Double(stats.mean);
+    writer.Key("p99"); writer.Uint(stats.p99);
+    writer.Key("max"); writer.Uint(stats.max);
+    writer.Key("total"); writer.Uint64(stats.total);
+    writer.EndObject();
+}
+
+template<typename Writer>
+void write_stats(Writer& writer, const char* name, const std::vector<float>& values) {
+    float sum = 0;
+    for (float v : values) sum += v;
+
+    writer.Key(name);
+    writer.StartObject();
+    writer.Key("mean"); writer.Double(sum / (float)values.size());
+    writer.Key("min"); writer.Double(percentile(values, 0));
+    writer.Key("p50"); writer.Double(percentile(values, 0.5f));
+    writer.Key("p90"); writer.Double(percentile(values, 0.9f));
+    writer.Key("p99"); writer.Double(percentile(values, 0.99f));
+    writer.Key("max"); writer.Double(percentile(values, 1));
+    writer.EndObject();
+}
+
+// balanced tree of smooth unions over random spheres, with num_nodes nodes rounded down to an odd count
+std::vector<CSGNode> make_random_tree(int num_nodes, std::mt19937& rng) {
+    std::uniform_real_distribution<float> coord(-1, 1);
+    std::uniform_real_distribution<float> radius(0.01f, 0.1f);
+    std::vector<CSGNode> nodes;
+    std::vector<int> level;
+    for (int i = 0; i < (num_nodes + 1) / 2; i++) {
+        CSGNode node{};
+        node.primitive.sphere = { .radius = glm::vec4(radius(rng)) };
+        node.primitive.m_row0 = glm::vec4(1, 0, 0, -coord(rng));
+        node.primitive.m_row1 = glm::vec4(0, 1, 0, -coord(rng));
+        node.primitive.m_row2 = glm::vec4(0, 0, 1, -coord(rng));
+        node.primitive.type = PRIMITIVE_SPHERE;
+        node.type = NODETYPE_PRIMITIVE;
+        node.left = -1;
+        node.right = -1;
+        node.sign = true;
+        level.push_back((int)nodes.size());
+        nodes.push_back(node);
+    }
+    while (level.size() > 1) {
+        std::vector<int> next_level;
+        for (size_t i = 0; i + 1 < level.size(); i += 2) {
+            CSGNode node{};
+            node.binary_op = BinaryOp(0.02f, true, OP_UNION);
+            node.type = NODETYPE_BINARY;
+            node.left = level[i];
+            node.right = level[i+1];
+            node.sign = true;
+            next_level.push_back((int)nodes.size());
+            nodes.push_back(node);
+        }
+        if (level.size() % 2) next_level.push_back(level.back());
+        level = next_level;
+    }
+    return nodes;
+}
+
+// CPU cost of converting a tree for upload: ConvertToGPUTree + build_skip_records into fresh vectors, against a
+// SceneConverter that is reused across iterations. Doesn't need a GPU.
+int bench_tree_conversion(const std::string& output_path, int num_iterations) {
+    FILE* fp = fopen(output_path.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open output: %s\n", output_path.c_str());
+        abort();
+    }
+    char write_buf[64 * 1024];
+    rapidjson::FileWriteStream os(fp, write_buf, sizeof(write_buf));
+    rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(os);
+
+    writer.StartObject();
+    writer.Key("iterations"); writer.Int(num_iterations);
+    writer.Key("tree_conversion");
+    writer.StartArray();
+
+    std::mt19937 rng(1234);
+    for (int num_nodes : { 1000, 10000, 30000 }) {
+        std::vector<CSGNode> csg_tree = make_random_tree(num_nodes, rng);
+        int root_idx = (int)csg_tree.size() - 1;
+
+        std::vector<float> vectors_ms, converter_ms;
+        SceneConverter converter;
+        GPUTreeLayout layout = SceneConverter::layout(csg_tree);
+        std::vector<char> dst(layout.size);
+        std::vector<int> prim_nodes;
+        for (int i = 0; i < num_iterations; i++) {
+            auto before = std::chrono::high_resolution_clock::now();
+            {
+                std::vector<GPUNode> gpu_tree;
+                std::vector<Primitive> primitives;
+                std::vector<BinaryOp> binary_ops;
+                std::vector<uint16_t> parents;
+                std::vector<uint16_t> active_nodes;
+                std::vector<SkipRecord> skip_records;
+                ConvertToGPUTree(root_idx, csg_tree, gpu_tree, primitives, binary_ops, parents, active_nodes, &prim_nodes);
+                build_skip_records(gpu_tree, primitives, binary_ops, skip_records);
+                prim_nodes.clear();
+            }
+            auto middle = std::chrono::high_resolution_clock::now();
+            layout = SceneConverter::layout(csg_tree);
+            converter.convert(root_idx, csg_tree, layout, dst.data(), &prim_nodes);
+            auto after = std::chrono::high_resolution_clock::now();
+
+            vectors_ms.push_back((float)std::chrono::duration_cast<std::chrono::microseconds>(middle - before).count() / 1000.f);
+            converter_ms.push_back((float)std::chrono::duration_cast<std::chrono::microseconds>(after - middle).count() / 1000.f);
+        }
+
+        writer.StartObject();
+        writer.Key("num_nodes"); writer.Int((int)csg_tree.size());
+        write_stats(writer, "convert_to_gpu_tree_ms", vectors_ms);
+        write_stats(writer, "scene_converter_ms", converter_ms);
+        writer.EndObject();
+        printf("%zu nodes: ConvertToGPUTree p50 %.3fms, SceneConverter p50 %.3fms\n", csg_tree.size(), percentile(vectors_ms, 0.5f), percentile(converter_ms, 0.5f));
+    }
+
+    writer.EndArray();
+    writer.EndObject();
+    os.Flush();
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> scenes = { "../scenes/trees.json" };
+    std::string camera_path = "";
+    std::string output_path = "bench.json";
+    int warmup_frames = 10;
+    int num_frames = 100;
+    int final_grid_lvl = 8;
+    bool culling_enabled = true;
+    bool simplify = true;
+    bool reorder = true;
+    bool pruning_stats = false;
+    bool pixel_cost = false;
+    bool async_compute = false;
+    bool compressed_lists = false;
+    bool frustum_pruning = false;
+    float lod_threshold_px = 0;
+    bool packed_tree = false;
+    bool half_eval = false;
+    std::string pruning_cache_dir = "";
+    std::string jit_cache_dir = "";
+    bool convert_bench = false;
+    spv_dir = ".";
+
+    CLI::App cli{ "Lipschitz Pruning benchmark" };
+    cli.add_option("-i,--input", scenes, "Scenes to benchmark");
+    cli.add_option("-c,--camera", camera_path, "Camera path (one 'yaw pitch dist target_x target_y target_z' keyframe per line)");
+    cli.add_option("-o,--output", output_path, "JSON report");
+    cli.add_option("-s,--shaders", spv_dir, "SPIR-V path");
+    cli.add_option("--warmup", warmup_frames, "Frames rendered before measuring");
+    cli.add_option("--frames", num_frames, "Measured frames per scene");
+    cli.add_option("--grid_lvl", final_grid_lvl, "Final grid level");
+    cli.add_option("--culling", culling_enabled, "Enable culling");
+    cli.add_option("--simplify", simplify, "Remove subtrees that don't affect the AABB before upload");
+    cli.add_option("--reorder", reorder, "Reorder the tree to minimize the evaluation stack depth");
+    cli.add_option("--pruning-stats", pruning_stats, "Report per-level pruning statistics");
+    cli.add_option("--async-compute", async_compute, "Prune on a compute queue while the previous result is traced");
+    cli.add_option("--compressed-lists", compressed_lists, "Store the active lists as delta-coded byte streams, without LOD");
+    cli.add_option("--frustum-pruning", frustum_pruning, "Only prune the cells in the view frustum");
+    cli.add_option("--lod", lod_threshold_px, "Stop subdividing the cells smaller than this many pixels on screen (0: disabled)");
+    cli.add_option("--packed-tree", packed_tree, "Evaluate the active lists from the packed layout of the tree");
+    cli.add_option("--half-eval", half_eval, "Evaluate the primitives in half precision away from the surface");
+    cli.add_option("--pruning-cache", pruning_cache_dir, "Directory of the on-disk pruning cache for static scenes");
+    cli.add_option("--jit", jit_cache_dir, "Compile scene-specific shaders for the uploaded trees, cached in this directory");
+    cli.add_option("--pixel-cost", pixel_cost, "Render with the cost heatmap and report per-pixel evaluation counters");
+    cli.add_option("--max-active", MAX_ACTIVE_COUNT, "Max active count");
+    cli.add_option("--max-tmp", MAX_TMP_COUNT, "Max tmp count");
+    cli.add_option("--convert-bench", convert_bench, "Only time the CPU tree conversion on random 1k/10k/30k-node trees, over --frames iterations");
+    CLI11_PARSE(cli, argc, argv);
+
+    if (convert_bench) return bench_tree_conversion(output_path, num_frames);
+
+    std::vector<CameraKeyframe> keyframes;
+    if (camera_path.empty()) {
+        keyframes.push_back({ .yaw = 0, .pitch = (float)M_PI / 2, .dist = 3, .target = glm::vec3(0) });
+    } else {
+        keyframes = load_camera_path(camera_path);
+    }
+
+    Context ctx;
+    ctx.initialize(false, final_grid_lvl, async_compute, compressed_lists);
+    ctx.render_data.async_compute_enabled = async_compute;
+    ctx.render_data.final_grid_lvl = final_grid_lvl;
+    ctx.render_data.pruning_stats_enabled = pruning_stats;
+    ctx.render_data.frustum_pruning = frustum_pruning;
+    ctx.render_data.lod_enabled = lod_threshold_px > 0;
+    ctx.render_data.packed_tree_enabled = packed_tree;
+    ctx.set_half_eval(half_eval);
+    ctx.render_data.pruning_cache_dir = pruning_cache_dir;
+    ctx.render_data.jit_cache_dir = jit_cache_dir;
+    if (lod_threshold_px > 0) ctx.render_data.lod_threshold_px = lod_threshold_px;
+    if (pixel_cost) ctx.render_data.shading_mode = SHADING_MODE_COST;
+
+    FILE* fp = fopen(output_path.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open output: %s\n", output_path.c_str());
+        abort();
+    }
+    char write_buf[64 * 1024];
+    rapidjson::FileWriteStream os(fp, write_buf, sizeof(write_buf));
+    rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(os);
+
+    writer.StartObject();
+    writer.Key("warmup_frames"); writer.Int(warmup_frames);
+    writer.Key("frames"); writer.Int(num_frames);
+    writer.Key("grid_lvl"); writer.Int(final_grid_lvl);
+    writer.Key("culling"); writer.Bool(culling_enabled);
+    writer.Key("async_compute"); writer.Bool(async_compute);
+    writer.Key("compressed_lists"); writer.Bool(compressed_lists);
+    writer.Key("frustum_pruning"); writer.Bool(frustum_pruning);
+    writer.Key("lod_threshold_px"); writer.Double(lod_threshold_px);
+    writer.Key("packed_tree"); writer.Bool(packed_tree);
+    writer.Key("half_eval"); writer.Bool(half_eval);
+    writer.Key("pruning_cache"); writer.Bool(!pruning_cache_dir.empty());
+    writer.Key("jit"); writer.Bool(!jit_cache_dir.empty());
+    writer.Key("scenes");
+    writer.StartArray();
+
+    for (const std::string& scene : scenes) {
+        std::vector<CSGNode> csg_tree;
+        load_json(scene.c_str(), csg_tree, ctx.render_data.aabb_min, ctx.render_data.aabb_max);
+        int root_idx = 0;
+        int num_input_nodes = (int)csg_tree.size();
+        if (simplify) root_idx = simplify_tree(csg_tree, root_idx, ctx.render_data.aabb_min, ctx.render_data.aabb_max);
+        if (reorder) reorder_tree(csg_tree, root_idx);
+
+        ctx.alloc_input_buffers((int)csg_tree.size());
+        ctx.upload(csg_tree, root_idx);
+        ctx.render_data.culling_enabled = culling_enabled;
+
+        std::vector<float> culling_ms, tracing_ms, render_ms, frame_ms, overlap_ms;
+        int peak_active_count = 0;
+        int peak_lod_active_count = 0;
+        int peak_tmp_count = 0;
+        float peak_pruning_mem_gb = 0;
+        float peak_tracing_mem_gb = 0;
+        std::vector<float> level_ms[4];
+        PruningStats last_pruning_stats = {};
+        PixelCostStats last_pixel_cost = {};
+
+        for (int frame = 0; frame < warmup_frames + num_frames; frame++) {
+            int measured_frame = std::max(frame - warmup_frames, 0);
+            CameraKeyframe cam = sample_camera_path(keyframes, num_frames > 1 ? (float)measured_frame / (float)(num_frames - 1) : 0.f);
+            glm::vec3 v = glm::vec3{
+                cam.dist * sinf(cam.yaw) * sinf(cam.pitch),
+                cam.dist * cosf(cam.pitch),
+                cam.dist * cosf(cam.yaw) * sinf(cam.pitch),
+            };
+            Timings timing = ctx.render(cam.target + v, cam.target);
+            if (frame < warmup_frames) continue;
+
+            culling_ms.push_back(timing.culling_elapsed_ms);
+            tracing_ms.push_back(timing.tracing_elapsed_ms);
+            render_ms.push_back(timing.render_elapsed_ms);
+            frame_ms.push_back(timing.frame_elapsed_ms);
+            // with async compute the render timestamps no longer include the pruning, the time hidden
+            // by the overlap is what the frame saves over running both back to back
+            overlap_ms.push_back(async_compute ? std::max(0.f, timing.culling_elapsed_ms + timing.render_elapsed_ms - timing.frame_elapsed_ms) : 0.f);
+            peak_active_count = std::max(peak_active_count, ctx.render_data.max_active_count);
+            peak_lod_active_count = std::max(peak_lod_active_count, ctx.render_data.lod_active_count);
+            peak_tmp_count = std::max(peak_tmp_count, ctx.render_data.max_tmp_count);
+            peak_pruning_mem_gb = std::max(peak_pruning_mem_gb, timing.pruning_mem_usage_gb);
+            peak_tracing_mem_gb = std::max(peak_tracing_mem_gb, timing.tracing_mem_usage_gb);
+            for (int i = 0; i < 4; i++) {
+                if (timing.pruning_stats.levels[i].valid) level_ms[i].push_back(timing.pruning_stats.levels[i].elapsed_ms);
+            }
+            last_pruning_stats = timing.pruning_stats;
+            last_pixel_cost = timing.pixel_cost;
+        }
+
+        writer.StartObject();
+        writer.Key("scene"); writer.String(std::filesystem::path(scene).filename().string().c_str());
+        writer.Key("input_nodes"); writer.Int(num_input_nodes);
+        writer.Key("uploaded_nodes"); writer.Int((int)csg_tree.size());
+        writer.Key("stack_depth"); writer.Int(ctx.render_data.stack_depth);
+        writer.Key("prim_types"); writer.Int(ctx.render_data.prim_types);
+        if (num_frames > 0) {
+            write_stats(writer, "culling_elapsed_ms", culling_ms);
+            write_stats(writer, "tracing_elapsed_ms", tracing_ms);
+            write_stats(writer, "render_elapsed_ms", render_ms);
+            write_stats(writer, "frame_elapsed_ms", frame_ms);
+            write_stats(writer, "overlap_ms", overlap_ms);
+        }
+        writer.Key("peak_active_count"); writer.Int(peak_active_count);
+        writer.Key("peak_lod_active_count"); writer.Int(peak_lod_active_count);
+        writer.Key("peak_tmp_count"); writer.Int(peak_tmp_count);
+        writer.Key("peak_pruning_mem_usage_gb"); writer.Double(peak_pruning_mem_gb);
+        writer.Key("peak_tracing_mem_usage_gb"); writer.Double(peak_tracing_mem_gb);
+        if (pruning_stats) {
+            // timings are aggregated over the measured frames, counts are from the last one
+            writer.Key("levels");
+            writer.StartArray();
+            for (int i = 0; i < 4; i++) {
+                const PruningLevelStats& level = last_pruning_stats.levels[i];
+                if (!level.valid || level_ms[i].empty()) continue;
+                writer.StartObject();
+                writer.Key("grid_lvl"); writer.Int(2 * (i + 1));
+                write_stats(writer, "elapsed_ms", level_ms[i]);
+                writer.Key("active_count"); writer.Int(level.active_count);
+                writer.Key("tmp_count"); writer.Int(level.tmp_count);
+                writer.Key("far_field_fraction"); writer.Double(level.far_field_fraction);
+                writer.Key("bytes_written"); writer.Uint64(level.bytes_written);
+                writer.Key("num_active_histogram");
+                writer.StartArray();
+                for (int b = 0; b < PRUNING_STATS_NUM_BINS; b++) writer.Uint(level.num_active_histogram[b]);
+                writer.EndArray();
+                writer.EndObject();
+            }
+            writer.EndArray();
+        }
+        if (pixel_cost && last_pixel_cost.valid) {
+            // counters of the last measured frame
+            writer.Key("pixel_cost");
+            writer.StartObject();
+            write_pixel_cost(writer, "steps", last_pixel_cost.steps);
+            write_pixel_cost(writer, "node_evals", last_pixel_cost.node_evals);
+            write_pixel_cost(writer, "shading_node_evals", last_pixel_cost.shading_node_evals);
+            writer.EndObject();
+        }
+        writer.EndObject();
+
+        printf("%s: render p50 %.3fms\n", scene.c_str(), num_frames > 0 ? percentile(render_ms, 0.5f) : 0.f);
+    }
+
+    writer.EndArray();
+    writer.EndObject();
+    os.Flush();
+    fclose(fp);
+
+    VK_CHECK(ctx.init.disp.deviceWaitIdle());
+    return 0;
+}
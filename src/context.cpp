@@ -3,19 +3,29 @@
 #define _USE_MATH_DEFINES
 #include <cmath>
 
+#include <algorithm>
 #include <memory>
 #include <random>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <thread>
+#include <chrono>
 
 #define VMA_IMPLEMENTATION
 #include "vma/vk_mem_alloc.h"
 #include "utils.h"
 #include "debug_plane.h"
+#include "query.h"
+#include "pruning_cache.h"
+#include "tree_convert.h"
+#include "scene_converter.h"
+#include "shader_jit.h"
+#include "tree.h"
 #include "backends/imgui_impl_glfw.h"
 #include "backends/imgui_impl_vulkan.h"
 #include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/matrix_access.hpp"
 
 struct EvalGridPushConstants {
     glm::vec4 aabb_min;
@@ -33,6 +43,13 @@ struct EvalGridPushConstants {
     int culling_enabled;
 };
 
+struct PruningStatsPushConstants {
+    uint64_t cells_num_active_ref;
+    uint64_t stats_ref;
+    int grid_size;
+    int level_slot;
+};
+
 
 size_t g_mem_usage_baseline_tracing = 0;
 size_t g_mem_usage_baseline_pruning = 0;
@@ -110,6 +127,7 @@ int device_initialization(Init& init, bool gui) {
     features.shaderInt64 = true;
     features.shaderInt16 = true;
     features.fillModeNonSolid = true;
+    features.fragmentStoresAndAtomics = true;
 
     VkPhysicalDeviceVulkan11Features features11{};
     features11.storageBuffer16BitAccess = true;
@@ -117,7 +135,10 @@ int device_initialization(Init& init, bool gui) {
     VkPhysicalDeviceVulkan12Features features12{};
     features12.bufferDeviceAddress = true;
     features12.hostQueryReset = true;
+    features12.timelineSemaphore = true;
     features12.storagePushConstant8 = true;
+    // ByteArrayRef, the compressed active lists (see ListCursor in common.glsl)
+    features12.storageBuffer8BitAccess = true;
     features12.shaderFloat16 = true;
 
     VkPhysicalDeviceVulkan13Features features13{};
@@ -150,6 +171,16 @@ int device_initialization(Init& init, bool gui) {
     vkb::PhysicalDevice physical_device = phys_device_ret.value();
     printf("%s\n", physical_device.name.c_str());
 
+    // the tracer broadcasts the nodes of the cells that a whole subgroup evaluates, see fetch_node_first in eval.glsl
+    VkPhysicalDeviceSubgroupProperties subgroup_properties = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES };
+    VkPhysicalDeviceProperties2 properties2 = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &subgroup_properties };
+    vkGetPhysicalDeviceProperties2(physical_device.physical_device, &properties2);
+    VkSubgroupFeatureFlags subgroup_operations = VK_SUBGROUP_FEATURE_VOTE_BIT | VK_SUBGROUP_FEATURE_BALLOT_BIT;
+    if (!(subgroup_properties.supportedStages & VK_SHADER_STAGE_FRAGMENT_BIT) || (subgroup_properties.supportedOperations & subgroup_operations) != subgroup_operations) {
+        std::cout << "no subgroup vote and ballot operations in the fragment shaders\n";
+        abort();
+    }
+
     vkb::DeviceBuilder device_builder{ physical_device };
     auto device_ret = device_builder.build();
     if (!device_ret) {
@@ -256,6 +287,52 @@ int get_queues(Init& init, RenderData& data) {
     return 0;
 }
 
+// Prefers a compute queue from a family without graphics, so that pruning can overlap with tracing.
+int create_async_compute(Init& init, RenderData& data) {
+    auto cq = init.device.get_dedicated_queue(vkb::QueueType::compute);
+    if (cq.has_value()) {
+        data.compute_queue = cq.value();
+        data.compute_queue_family = init.device.get_dedicated_queue_index(vkb::QueueType::compute).value();
+    } else {
+        cq = init.device.get_queue(vkb::QueueType::compute);
+        if (!cq.has_value()) {
+            std::cout << "failed to get compute queue: " << cq.error().message() << "\n";
+            return -1;
+        }
+        data.compute_queue = cq.value();
+        data.compute_queue_family = init.device.get_queue_index(vkb::QueueType::compute).value();
+        std::cout << "no dedicated compute queue, async pruning won't overlap with tracing\n";
+    }
+
+    VkCommandPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.queueFamilyIndex = data.compute_queue_family;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VK_CHECK(init.disp.createCommandPool(&pool_info, nullptr, &data.compute_command_pool));
+
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = data.compute_command_pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = 1;
+    VK_CHECK(init.disp.allocateCommandBuffers(&alloc_info, &data.compute_command_buffer));
+
+    VkSemaphoreTypeCreateInfo timeline_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+            .pNext = nullptr,
+            .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+            .initialValue = 0
+    };
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &timeline_info;
+    VK_CHECK(init.disp.createSemaphore(&semaphore_info, nullptr, &data.pruning_timeline));
+    data.pruning_timeline_value = 0;
+
+    data.async_compute_available = true;
+    return 0;
+}
+
 int create_render_pass(Init& init, RenderData& data) {
     VkAttachmentDescription color_attachment = {};
     color_attachment.format = VK_FORMAT_R8G8B8A8_SRGB;
@@ -373,7 +450,7 @@ void get_pipeline_stats(Init& init, VkPipeline pipeline, uint32_t executable_idx
 
 int create_graphics_pipeline(Init& init, RenderData& data) {
     auto vert_code = readFile("vert.spv");
-    auto frag_code = readFile("frag.spv");
+    auto frag_code = readFile("frag.spv", data.jit_shader_dir.empty() ? spv_dir : data.jit_shader_dir);
 
     VkShaderModule vert_module = createShaderModule(init, vert_code, "simple.vert.glsl");
     VkShaderModule frag_module = createShaderModule(init, frag_code, "simple.frag.glsl");
@@ -390,29 +467,64 @@ int create_graphics_pipeline(Init& init, RenderData& data) {
 
     struct SpecializationConstants {
         int shading_mode;
+        int stack_depth;
+        int prim_types;
+        VkBool32 compressed_lists;
+        VkBool32 half_eval;
     };
-    SpecializationConstants spec_constants = { data.shading_mode };
-
-    VkPipelineShaderStageCreateInfo frag_stage_info = {};
-    frag_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    frag_stage_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    frag_stage_info.module = frag_module;
-    frag_stage_info.pName = "main";
-
-    VkSpecializationMapEntry map_entry = {
-        .constantID = 0,
-        .offset = offsetof(SpecializationConstants, shading_mode),
-        .size = sizeof(SpecializationConstants::shading_mode)
-    };
-    VkSpecializationInfo frag_spec_info = {
-        .mapEntryCount = 1,
-        .pMapEntries = &map_entry,
-        .dataSize = sizeof(SpecializationConstants),
-        .pData = &spec_constants
+
+    VkSpecializationMapEntry map_entries[] = {
+        {
+            .constantID = 0,
+            .offset = offsetof(SpecializationConstants, shading_mode),
+            .size = sizeof(SpecializationConstants::shading_mode)
+        },
+        {
+            .constantID = 1,
+            .offset = offsetof(SpecializationConstants, stack_depth),
+            .size = sizeof(SpecializationConstants::stack_depth)
+        },
+        {
+            .constantID = 2,
+            .offset = offsetof(SpecializationConstants, prim_types),
+            .size = sizeof(SpecializationConstants::prim_types)
+        },
+        {
+            .constantID = 3,
+            .offset = offsetof(SpecializationConstants, compressed_lists),
+            .size = sizeof(SpecializationConstants::compressed_lists)
+        },
+        {
+            .constantID = 5,
+            .offset = offsetof(SpecializationConstants, half_eval),
+            .size = sizeof(SpecializationConstants::half_eval)
+        }
     };
-    frag_stage_info.pSpecializationInfo = &frag_spec_info;
 
-    VkPipelineShaderStageCreateInfo shader_stages[] = { vert_stage_info, frag_stage_info };
+    // every shading mode is a specialization of the fragment shader, they are all built upfront
+    // so that switching modes doesn't stall
+    SpecializationConstants spec_constants[NUM_SHADING_MODES];
+    VkSpecializationInfo frag_spec_infos[NUM_SHADING_MODES];
+    VkPipelineShaderStageCreateInfo shader_stages[NUM_SHADING_MODES][2];
+    for (int mode = 0; mode < NUM_SHADING_MODES; mode++) {
+        spec_constants[mode] = { mode, data.stack_depth, data.prim_types, data.compressed_lists, data.half_eval };
+        frag_spec_infos[mode] = {
+            .mapEntryCount = 5,
+            .pMapEntries = map_entries,
+            .dataSize = sizeof(SpecializationConstants),
+            .pData = &spec_constants[mode]
+        };
+
+        VkPipelineShaderStageCreateInfo frag_stage_info = {};
+        frag_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        frag_stage_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        frag_stage_info.module = frag_module;
+        frag_stage_info.pName = "main";
+        frag_stage_info.pSpecializationInfo = &frag_spec_infos[mode];
+
+        shader_stages[mode][0] = vert_stage_info;
+        shader_stages[mode][1] = frag_stage_info;
+    }
 
     VkPipelineVertexInputStateCreateInfo vertex_input_info = {};
     vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -522,7 +634,6 @@ int create_graphics_pipeline(Init& init, RenderData& data) {
     VkGraphicsPipelineCreateInfo pipeline_info = {};
     pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
     pipeline_info.stageCount = 2;
-    pipeline_info.pStages = shader_stages;
     pipeline_info.pVertexInputState = &vertex_input_info;
     pipeline_info.pInputAssemblyState = &input_assembly;
     pipeline_info.pViewportState = &viewport_state;
@@ -537,9 +648,23 @@ int create_graphics_pipeline(Init& init, RenderData& data) {
     pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
     pipeline_info.flags = VK_PIPELINE_CREATE_CAPTURE_STATISTICS_BIT_KHR;
 
-    if (init.disp.createGraphicsPipelines(VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &data.graphics_pipeline) != VK_SUCCESS) {
-        std::cout << "failed to create pipline\n";
-        return -1; // failed to create graphics pipeline
+    // one thread per variant, the pipeline cache is internally synchronized
+    VkResult results[NUM_SHADING_MODES];
+    std::vector<std::thread> threads;
+    for (int mode = 0; mode < NUM_SHADING_MODES; mode++) {
+        threads.emplace_back([&, mode]() {
+            VkGraphicsPipelineCreateInfo info = pipeline_info;
+            info.pStages = shader_stages[mode];
+            results[mode] = init.disp.createGraphicsPipelines(init.pipeline_cache, 1, &info, nullptr, &data.graphics_pipelines[mode]);
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    for (int mode = 0; mode < NUM_SHADING_MODES; mode++) {
+        if (results[mode] != VK_SUCCESS) {
+            std::cout << "failed to create pipline\n";
+            return -1; // failed to create graphics pipeline
+        }
     }
 
     init.disp.destroyShaderModule(frag_module, nullptr);
@@ -547,10 +672,16 @@ int create_graphics_pipeline(Init& init, RenderData& data) {
     return 0;
 }
 
+void destroy_graphics_pipeline(Init& init, RenderData& data) {
+    for (VkPipeline pipeline : data.graphics_pipelines) {
+        init.disp.destroyPipeline(pipeline, nullptr);
+    }
+    init.disp.destroyPipelineLayout(data.pipeline_layout, nullptr);
+}
 
-Pipeline create_culling_pipeline(Init& init, RenderData& render_data, const char* shader_path, const char* debug_name) {
-    auto code = readFile("culling.comp.spv");
-    VkShaderModule module = createShaderModule(init, code, "culling.comp.glsl");
+Pipeline create_culling_pipeline(Init& init, RenderData& render_data, const char* shader_path, const char* debug_name, bool final_level) {
+    auto code = readFile(shader_path, render_data.jit_shader_dir.empty() ? spv_dir : render_data.jit_shader_dir);
+    VkShaderModule module = createShaderModule(init, code, debug_name);
     if (module == VK_NULL_HANDLE) abort();
 
     VkPushConstantRange range = {
@@ -571,6 +702,22 @@ Pipeline create_culling_pipeline(Init& init, RenderData& render_data, const char
     Pipeline pipeline;
     VK_CHECK(vkCreatePipelineLayout(init.device, &layout_info, nullptr, &pipeline.layout));
 
+    // STACK_DEPTH, PRIM_TYPES, COMPRESSED_LISTS, FINAL_LEVEL and HALF_EVAL
+    int spec_constants[5] = { render_data.stack_depth, render_data.prim_types, render_data.compressed_lists, final_level, render_data.half_eval };
+    VkSpecializationMapEntry map_entries[] = {
+            { .constantID = 1, .offset = 0, .size = sizeof(int) },
+            { .constantID = 2, .offset = sizeof(int), .size = sizeof(int) },
+            { .constantID = 3, .offset = 2 * sizeof(int), .size = sizeof(VkBool32) },
+            { .constantID = 4, .offset = 3 * sizeof(int), .size = sizeof(VkBool32) },
+            { .constantID = 5, .offset = 4 * sizeof(int), .size = sizeof(VkBool32) }
+    };
+    VkSpecializationInfo spec_info = {
+            .mapEntryCount = 5,
+            .pMapEntries = map_entries,
+            .dataSize = sizeof(spec_constants),
+            .pData = spec_constants
+    };
+
     VkComputePipelineCreateInfo pipeline_info =  {
             .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
             .pNext = nullptr,
@@ -582,18 +729,20 @@ Pipeline create_culling_pipeline(Init& init, RenderData& render_data, const char
                     .stage = VK_SHADER_STAGE_COMPUTE_BIT,
                     .module = module,
                     .pName = "main",
+                    .pSpecializationInfo = &spec_info
             },
             .layout = pipeline.layout,
             .basePipelineHandle = VK_NULL_HANDLE,
             .basePipelineIndex = -1
     };
-    VK_CHECK(vkCreateComputePipelines(init.device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline.pipe));
+    VK_CHECK(vkCreateComputePipelines(init.device, init.pipeline_cache, 1, &pipeline_info, nullptr, &pipeline.pipe));
 
     return pipeline;
 }
 
 void create_culling_pipelines(Init& init, RenderData& render_data) {
-    render_data.culling_pipeline = create_culling_pipeline(init, render_data, "culling.comp.spv", "culling.comp.glsl");
+    render_data.culling_pipeline = create_culling_pipeline(init, render_data, "culling.comp.spv", "culling.comp.glsl", false);
+    render_data.culling_final_pipeline = create_culling_pipeline(init, render_data, "culling.comp.spv", "culling.comp.glsl", true);
 }
 
 void create_depth_buffers(Init& init, RenderData& data) {
@@ -735,7 +884,7 @@ int create_command_buffers(Init& init, RenderData& data) {
 
         init.disp.cmdBeginRenderPass(data.command_buffers[i], &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
 
-        init.disp.cmdBindPipeline(data.command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, data.graphics_pipeline);
+        init.disp.cmdBindPipeline(data.command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, data.graphics_pipelines[data.shading_mode]);
 
         init.disp.cmdPushConstants(data.command_buffers[i], data.pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(PushConstants), &data.push_constants);
 
@@ -830,13 +979,57 @@ void pipeline_barrier(VkCommandBuffer cmd_buf, VkPipelineStageFlagBits2 src_stag
     vkCmdPipelineBarrier2(cmd_buf, &dependency);
 }
 
+// Starts staging the uploads of a frame in the ring partition of current_frame, once the GPU is done with it
+static void begin_staging_frame(Init& init, RenderData& data) {
+    init.disp.waitForFences(1, &data.in_flight_fences[data.current_frame], VK_TRUE, UINT64_MAX);
+    data.staging_ring_head = 0;
+    data.frame_uploads.clear();
+    data.pruning_uploads.clear();
+}
+
+// Copies src to the ring now, the copy to dst is recorded later by record_staged_uploads
+static void stage_upload(RenderData& data, std::vector<StagedCopy>& copies, const Buffer& dst, const void* src, size_t size) {
+    size_t offset = (data.staging_ring_head + 15) & ~(size_t)15;
+    if (offset + size > STAGING_RING_FRAME_SIZE) {
+        fprintf(stderr, "staging ring partition overflow: %zu bytes\n", offset + size);
+        abort();
+    }
+    size_t ring_offset = data.current_frame * STAGING_RING_FRAME_SIZE + offset;
+    memcpy((char*)data.staging_ring.mapped + ring_offset, src, size);
+    copies.push_back({ .dst = dst.buf, .region = { .srcOffset = ring_offset, .dstOffset = 0, .size = size } });
+    data.staging_ring_head = offset + size;
+}
+
+// one flush for everything staged this frame, before the submits
+static void flush_staging_frame(RenderData& data) {
+    if (data.staging_ring_head == 0) return;
+    VK_CHECK(vmaFlushAllocation(data.alloc, data.staging_ring.alloc, data.current_frame * STAGING_RING_FRAME_SIZE, data.staging_ring_head));
+}
+
+static void record_staged_uploads(RenderData& data, VkCommandBuffer cmd, std::vector<StagedCopy>& copies) {
+    if (copies.empty()) return;
+    // the previous frame may still read the destinations
+    pipeline_barrier(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_NONE, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+    for (const StagedCopy& copy : copies) {
+        vkCmdCopyBuffer(cmd, data.staging_ring.buf, copy.dst, 1, &copy.region);
+    }
+    pipeline_barrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT);
+    copies.clear();
+}
+
 void set_push_constants(RenderData& data, int grid_lvl, bool first_lvl) {
     data.push_constants.grid_size = 1 << grid_lvl;
     data.push_constants.first_lvl = first_lvl;
     data.push_constants.active_nodes_in_ref = data.active_nodes_buffer[data.input_idx].address;
     data.push_constants.active_nodes_out_ref = data.active_nodes_buffer[data.output_idx].address;
-    data.push_constants.parents_in_ref = data.parents_buffer[data.input_idx].address;
-    data.push_constants.parents_out_ref = data.parents_buffer[data.output_idx].address;
+    // the parents only go from one level to the next, the buffers alternate with the levels rather than the sets
+    data.push_constants.parents_in_ref = data.parents_buffer[(grid_lvl / 2 + 1) % 2].address;
+    if (first_lvl) {
+        // the first level reads the whole tree straight from the uploaded lists
+        data.push_constants.active_nodes_in_ref = data.tree.active_nodes_init;
+        data.push_constants.parents_in_ref = data.tree.parents_init;
+    }
+    data.push_constants.parents_out_ref = data.parents_buffer[grid_lvl / 2 % 2].address;
     data.push_constants.cell_offsets_in_ref = data.cell_offsets_buffer[data.input_idx].address;
     data.push_constants.cell_offsets_out_ref = data.cell_offsets_buffer[data.output_idx].address;
     data.push_constants.num_active_in_ref = data.num_active_buffer[data.input_idx].address;
@@ -850,14 +1043,133 @@ void set_push_constants(RenderData& data, int grid_lvl, bool first_lvl) {
     data.push_constants.viz_max = (float)data.colormap_max;
     data.push_constants.mvp_ref = data.mvp_buffer.address;
     data.push_constants.culling_enabled = data.culling_enabled;
+    data.push_constants.frustum_pruning = data.frustum_pruning;
+    data.push_constants.lod_ref = data.lod_buffer.address;
     data.push_constants.num_samples = (uint8_t)data.num_samples;
     data.push_constants.cam_ref = data.cam_buffer.address;
     data.push_constants.gamma = data.gamma;
 }
 
+static PixelCostCounterStats summarize_pixel_cost(std::vector<uint32_t>& values) {
+    PixelCostCounterStats stats = {};
+    if (values.empty()) return stats;
+    for (uint32_t v : values) {
+        stats.total += v;
+        stats.max = std::max(stats.max, v);
+    }
+    stats.mean = (float)((double)stats.total / (double)values.size());
+    auto p99 = values.begin() + (size_t)(0.99 * (double)(values.size() - 1));
+    std::nth_element(values.begin(), p99, values.end());
+    stats.p99 = *p99;
+    return stats;
+}
+
+// reads back the per-pixel counters written by SHADING_MODE_COST, one plane at a time
+static void read_pixel_cost(Init& init, RenderData& data) {
+    int num_pixels = (int)(init.swapchain.extent.width * init.swapchain.extent.height);
+    std::vector<uint32_t> values(num_pixels);
+    PixelCostCounterStats* counters[PIXEL_COST_NUM_COUNTERS] = {
+        &data.pixel_cost_stats.steps,
+        &data.pixel_cost_stats.node_evals,
+        &data.pixel_cost_stats.shading_node_evals
+    };
+    for (int i = 0; i < PIXEL_COST_NUM_COUNTERS; i++) {
+        CopyBuffer(data, init, data.pixel_cost_buffer, data.staging_buffer, num_pixels * sizeof(uint32_t), i * num_pixels * sizeof(uint32_t));
+        TransferFromBuffer(data.alloc, data.staging_buffer, values.data(), num_pixels * sizeof(uint32_t));
+        *counters[i] = summarize_pixel_cost(values);
+    }
+    data.pixel_cost_stats.valid = true;
+}
+
+// Records the pruning of all the grid levels into cmd, which can belong to the graphics or the async compute queue.
+// The final level is written to the output_idx buffer set.
+static void record_pruning(RenderData& data, VkCommandBuffer cmd, uint32_t& pruned_levels) {
+    record_staged_uploads(data, cmd, data.pruning_uploads);
+    vkCmdFillBuffer(cmd, data.active_count_buffer.buf, 0, 10 * sizeof(int), 0);
+    vkCmdFillBuffer(cmd, data.old_to_new_count_buffer.buf, 0, 10 * sizeof(int), 0);
+    if (data.pruning_stats_enabled) {
+        vkCmdFillBuffer(cmd, data.pruning_stats_buffer.buf, 0, 4 * PRUNING_STATS_NUM_BINS * sizeof(uint32_t), 0);
+    }
+#if FAR_FIELD_VIZ
+    assert(false); // check that grid size is 256
+    vkCmdFillBuffer(cmd, data.cell_errors[0].buf, 0, 256 * 256 * 256 * sizeof(float), 0);
+    vkCmdFillBuffer(cmd, data.cell_errors[1].buf, 0, 256 * 256 * 256 * sizeof(float), 0);
+#endif
+    pipeline_barrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT);
+
+    // CULLING
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, data.query_pool, 0);
+    bool first_lvl = true;
+   
+    set_push_constants(data, data.final_grid_lvl, first_lvl);
+   
+    if (data.culling_enabled && data.compute_culling && !data.pruning_cached) {
+        int initial_grid_lvl = data.hierarchy_enabled ? 2 : data.final_grid_lvl;
+
+        // the sets swap after every level but the last, so the final level writes to output_idx after an even number of swaps
+        int num_swaps = (data.final_grid_lvl - initial_grid_lvl) / 2;
+        int final_set = num_swaps % 2 == 0 ? data.output_idx : data.input_idx;
+        LodParams lod = {
+                .active_nodes_ref = data.active_nodes_buffer[final_set].address,
+                .count = 0,
+                .capacity = MAX_ACTIVE_COUNT,
+                .final_grid_size = 1 << data.final_grid_lvl,
+                .threshold_px = data.lod_threshold_px,
+                // the compressed lists have no room for the LOD lists at the end of the buffer
+                .enabled = data.lod_enabled && !data.compressed_lists
+        };
+        vkCmdUpdateBuffer(cmd, data.lod_buffer.buf, 0, sizeof(lod), &lod);
+
+        for (int grid_lvl = initial_grid_lvl; grid_lvl <= data.final_grid_lvl; grid_lvl += 2) {
+            //vkCmdFillBuffer(cmd, data.active_count_buffer.buf, grid_lvl*sizeof(int), sizeof(int), 0);
+            //vkCmdFillBuffer(cmd, data.old_to_new_count_buffer.buf, grid_lvl*sizeof(int), sizeof(int), 0);
+            pipeline_barrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+            set_push_constants(data, grid_lvl, first_lvl);
+            data.push_constants.cam_ref = data.pruning_cam_buffer.address;
+
+            int num_groups = (data.push_constants.grid_size + 3) / 4;
+
+            int level_slot = grid_lvl / 2 - 1;
+            vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, data.query_pool, 8 + 2*level_slot);
+            // only the next level reads the parents, the final level writes none
+            const Pipeline& culling_pipeline = grid_lvl == data.final_grid_lvl ? data.culling_final_pipeline : data.culling_pipeline;
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, culling_pipeline.pipe);
+            vkCmdPushConstants(cmd, culling_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &data.push_constants);
+            vkCmdDispatch(cmd, num_groups, num_groups, num_groups);
+            vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, data.query_pool, 9 + 2*level_slot);
+            pruned_levels |= 1u << level_slot;
+
+            if (data.pruning_stats_enabled) {
+                pipeline_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+                PruningStatsPushConstants stats_push_constants = {
+                        .cells_num_active_ref = data.num_active_buffer[data.output_idx].address,
+                        .stats_ref = data.pruning_stats_buffer.address,
+                        .grid_size = data.push_constants.grid_size,
+                        .level_slot = level_slot
+                };
+                vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, data.pruning_stats_pipeline.pipe);
+                vkCmdPushConstants(cmd, data.pruning_stats_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PruningStatsPushConstants), &stats_push_constants);
+                vkCmdDispatch(cmd, num_groups, num_groups, num_groups);
+            }
+
+            pipeline_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+            first_lvl = false;
+            if (grid_lvl != data.final_grid_lvl) std::swap(data.input_idx, data.output_idx);
+        }
+        data.pruning_valid = true;
+    }
+
+
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, data.query_pool, 1);
+}
+
 int draw_frame(Init& init, RenderData& data, bool gui) {
     init.disp.waitForFences(1, &data.in_flight_fences[data.current_frame], VK_TRUE, UINT64_MAX);
 
+    // bit i is set when grid level 2*(i+1) was pruned this frame
+    uint32_t pruned_levels = 0;
+
     uint32_t image_index = 0;
     if (gui) {
         VkResult result = init.disp.acquireNextImageKHR(
@@ -879,6 +1191,38 @@ int draw_frame(Init& init, RenderData& data, bool gui) {
     }
     data.image_in_flight[image_index] = data.in_flight_fences[data.current_frame];
 
+    // With async compute, this frame's pruning runs on the compute queue while the graphics queue traces the
+    // previous result, which stays in the buffer set that the pruning doesn't touch. The graphics queue only
+    // waits on the pruning when there is no usable previous result.
+    bool async_pruning = data.async_compute_enabled && data.culling_enabled && data.compute_culling && !data.pruning_cached;
+    bool wait_for_pruning = false;
+    int traced_set = data.output_idx;
+    int pruned_input_set = data.input_idx;
+    int pruned_output_set = data.output_idx;
+    if (async_pruning) {
+        wait_for_pruning = !data.pruning_valid || data.async_pruned_grid_lvl != data.final_grid_lvl;
+
+        int free_sets[2];
+        int num_free_sets = 0;
+        for (int set = 0; set < 3; set++) {
+            if (set != data.output_idx) free_sets[num_free_sets++] = set;
+        }
+        data.input_idx = free_sets[0];
+        data.output_idx = free_sets[1];
+
+        VkCommandBufferBeginInfo begin_info = {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(init.disp.beginCommandBuffer(data.compute_command_buffer, &begin_info));
+        record_pruning(data, data.compute_command_buffer, pruned_levels);
+        VK_CHECK(init.disp.endCommandBuffer(data.compute_command_buffer));
+
+        pruned_input_set = data.input_idx;
+        pruned_output_set = data.output_idx;
+        if (wait_for_pruning) traced_set = pruned_output_set;
+        // the graphics commands below read the traced set
+        data.output_idx = traced_set;
+    }
 
     {
         int i = image_index;
@@ -890,53 +1234,12 @@ int draw_frame(Init& init, RenderData& data, bool gui) {
         vkResetQueryPool(init.device, data.query_pool, 0, 128);
 
         vkCmdWriteTimestamp(data.command_buffers[i], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, data.query_pool, 4);
+        record_staged_uploads(data, data.command_buffers[i], data.frame_uploads);
 
-        VkBufferCopy region = {
-                .srcOffset = 0,
-                .dstOffset = 0,
-                .size = data.push_constants.num_nodes * sizeof(uint16_t)
-        };
-        vkCmdCopyBuffer(data.command_buffers[i], data.parents_init_buffer.buf, data.parents_buffer[data.input_idx].buf, 1, &region);
-        vkCmdCopyBuffer(data.command_buffers[i], data.active_nodes_init_buffer.buf, data.active_nodes_buffer[data.input_idx].buf, 1, &region);
-        vkCmdFillBuffer(data.command_buffers[i], data.active_count_buffer.buf, 0, 10 * sizeof(int), 0);
-        vkCmdFillBuffer(data.command_buffers[i], data.old_to_new_count_buffer.buf, 0, 10 * sizeof(int), 0);
-#if FAR_FIELD_VIZ
-        assert(false); // check that grid size is 256
-        vkCmdFillBuffer(data.command_buffers[i], data.cell_errors[0].buf, 0, 256 * 256 * 256 * sizeof(float), 0);
-        vkCmdFillBuffer(data.command_buffers[i], data.cell_errors[1].buf, 0, 256 * 256 * 256 * sizeof(float), 0);
-#endif
-        pipeline_barrier(data.command_buffers[i], VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT);
-
-        // CULLING
-        vkCmdWriteTimestamp(data.command_buffers[i], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, data.query_pool, 0);
-        bool first_lvl = true;
-       
-        set_push_constants(data, data.final_grid_lvl, first_lvl);
-       
-        if (data.culling_enabled && data.compute_culling) {
-            int initial_grid_lvl = data.hierarchy_enabled ? 2 : data.final_grid_lvl;
-            for (int grid_lvl = initial_grid_lvl; grid_lvl <= data.final_grid_lvl; grid_lvl += 2) {
-                //vkCmdFillBuffer(data.command_buffers[i], data.active_count_buffer.buf, grid_lvl*sizeof(int), sizeof(int), 0);
-                //vkCmdFillBuffer(data.command_buffers[i], data.old_to_new_count_buffer.buf, grid_lvl*sizeof(int), sizeof(int), 0);
-                pipeline_barrier(data.command_buffers[i], VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
-                set_push_constants(data, grid_lvl, first_lvl);
-
-                int num_groups = (data.push_constants.grid_size + 3) / 4;
-
-                vkCmdBindPipeline(data.command_buffers[i], VK_PIPELINE_BIND_POINT_COMPUTE, data.culling_pipeline.pipe);
-                vkCmdPushConstants(data.command_buffers[i], data.culling_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &data.push_constants);
-                vkCmdDispatch(data.command_buffers[i], num_groups, num_groups, num_groups);
-
-                pipeline_barrier(data.command_buffers[i], VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
-
-                first_lvl = false;
-                if (grid_lvl != data.final_grid_lvl) std::swap(data.input_idx, data.output_idx);
-            }
+        if (!async_pruning) {
+            record_pruning(data, data.command_buffers[i], pruned_levels);
         }
 
-
-        vkCmdWriteTimestamp(data.command_buffers[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, data.query_pool, 1);
-
         pipeline_barrier(data.command_buffers[i], VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
 
         {
@@ -1083,7 +1386,7 @@ int draw_frame(Init& init, RenderData& data, bool gui) {
 
         init.disp.cmdBeginRenderPass(data.command_buffers[i], &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
 
-        init.disp.cmdBindPipeline(data.command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, data.graphics_pipeline);
+        init.disp.cmdBindPipeline(data.command_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, data.graphics_pipelines[data.shading_mode]);
         set_push_constants(data, data.final_grid_lvl, false);
         init.disp.cmdPushConstants(data.command_buffers[i], data.pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(PushConstants), &data.push_constants);
 
@@ -1228,9 +1531,9 @@ int draw_frame(Init& init, RenderData& data, bool gui) {
             EvalGridPushConstants eval_grid_push_constants = {
                 .aabb_min = glm::vec4(data.aabb_min,0),
                 .aabb_max = glm::vec4(data.aabb_max,0),
-                .prims_ref = data.prims_buffer.address,
-                .binary_ops_ref = data.binary_ops_buffer.address,
-                .nodes_ref = data.nodes_buffer.address,
+                .prims_ref = data.tree.prims,
+                .binary_ops_ref = data.tree.binary_ops,
+                .nodes_ref = data.tree.nodes,
                 .active_nodes_ref = data.active_nodes_buffer[data.input_idx].address,
                 .cells_offset_ref = data.cell_offsets_buffer[data.input_idx].address,
                 .cells_num_active_ref = data.num_active_buffer[data.input_idx].address,
@@ -1258,20 +1561,62 @@ int draw_frame(Init& init, RenderData& data, bool gui) {
 
 
 
+    flush_staging_frame(data);
+    auto submit_start = std::chrono::high_resolution_clock::now();
+
+    if (async_pruning) {
+        data.pruning_timeline_value++;
+        VkTimelineSemaphoreSubmitInfo timeline_info = {
+                .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+                .pNext = nullptr,
+                .waitSemaphoreValueCount = 0,
+                .pWaitSemaphoreValues = nullptr,
+                .signalSemaphoreValueCount = 1,
+                .pSignalSemaphoreValues = &data.pruning_timeline_value
+        };
+        VkSubmitInfo compute_submit_info = {};
+        compute_submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        compute_submit_info.pNext = &timeline_info;
+        compute_submit_info.commandBufferCount = 1;
+        compute_submit_info.pCommandBuffers = &data.compute_command_buffer;
+        compute_submit_info.signalSemaphoreCount = 1;
+        compute_submit_info.pSignalSemaphores = &data.pruning_timeline;
+        if (init.disp.queueSubmit(data.compute_queue, 1, &compute_submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+            std::cout << "failed to submit pruning command buffer\n";
+            return -1;
+        }
+    }
+
     VkSubmitInfo submitInfo = {};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-    VkSemaphore wait_semaphores[] = { data.available_semaphores[data.current_frame] };
-    VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+    VkSemaphore wait_semaphores[2];
+    VkPipelineStageFlags wait_stages[2];
+    uint64_t wait_values[2] = { 0, 0 };
+    uint32_t wait_count = 0;
     if (gui) {
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = wait_semaphores;
-        submitInfo.pWaitDstStageMask = wait_stages;
-    } else {
-        submitInfo.waitSemaphoreCount = 0;
-        submitInfo.pWaitSemaphores = nullptr;
-        submitInfo.pWaitDstStageMask = nullptr;
+        wait_semaphores[wait_count] = data.available_semaphores[data.current_frame];
+        wait_stages[wait_count] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        wait_count++;
+    }
+    if (wait_for_pruning) {
+        wait_semaphores[wait_count] = data.pruning_timeline;
+        wait_stages[wait_count] = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        wait_values[wait_count] = data.pruning_timeline_value;
+        wait_count++;
     }
+    VkTimelineSemaphoreSubmitInfo timeline_info = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+            .pNext = nullptr,
+            .waitSemaphoreValueCount = wait_count,
+            .pWaitSemaphoreValues = wait_values,
+            .signalSemaphoreValueCount = 0,
+            .pSignalSemaphoreValues = nullptr
+    };
+    submitInfo.pNext = &timeline_info;
+    submitInfo.waitSemaphoreCount = wait_count;
+    submitInfo.pWaitSemaphores = wait_count > 0 ? wait_semaphores : nullptr;
+    submitInfo.pWaitDstStageMask = wait_count > 0 ? wait_stages : nullptr;
 
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &data.command_buffers[image_index];
@@ -1318,6 +1663,14 @@ int draw_frame(Init& init, RenderData& data, bool gui) {
     data.current_frame = (data.current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
 
     VK_CHECK(vkDeviceWaitIdle(init.device));
+    data.frame_elapsed_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - submit_start).count();
+
+    if (async_pruning) {
+        // the next frame traces what was just pruned
+        data.input_idx = pruned_input_set;
+        data.output_idx = pruned_output_set;
+        data.async_pruned_grid_lvl = data.final_grid_lvl;
+    }
 
     std::vector<uint64_t> timestamps(8);
     //TODO: don't wait for results
@@ -1342,19 +1695,81 @@ int draw_frame(Init& init, RenderData& data, bool gui) {
     CopyBuffer(data, init, data.old_to_new_count_buffer, data.staging_buffer, 10 * sizeof(int));
     TransferFromBuffer(data.alloc, data.staging_buffer, tmp_counts.data(), tmp_counts.size() * sizeof(tmp_counts[0]));
 
+    if (pruned_levels != 0) {
+        LodParams lod;
+        CopyBuffer(data, init, data.lod_buffer, data.staging_buffer, sizeof(lod));
+        TransferFromBuffer(data.alloc, data.staging_buffer, &lod, sizeof(lod));
+        data.lod_active_count = lod.count;
+    }
+
     data.pruning_mem_usage = 0;
     data.max_tmp_count = 0;
     data.max_active_count = 0;
     data.tracing_mem_usage = 0;
     for (int i = 2; i <= data.final_grid_lvl; i += 2) {
-        uint64_t pruning_mem_usage = g_mem_usage_baseline_pruning + (uint64_t)active_counts[i] * 4 * sizeof(uint16_t)
+        // the compressed lists count bytes, and hold the parents. The final level writes no parents
+        uint64_t entry_size = i == data.final_grid_lvl ? sizeof(uint16_t) : 2 * sizeof(uint16_t);
+        uint64_t list_bytes = data.compressed_lists ? (uint64_t)active_counts[i] : (uint64_t)active_counts[i] * entry_size;
+        uint64_t pruning_mem_usage = g_mem_usage_baseline_pruning + 2 * list_bytes
             + (uint64_t)tmp_counts[i] * (sizeof(uint16_t) + sizeof(uint32_t));
         uint64_t tracing_mem_usage = 
         data.pruning_mem_usage = std::max(data.pruning_mem_usage, pruning_mem_usage);
         data.max_tmp_count = std::max(data.max_tmp_count, tmp_counts[i]);
         data.max_active_count = std::max(data.max_active_count, active_counts[i]);
     }
-    data.tracing_mem_usage = g_mem_usage_baseline_tracing + 2 * (uint64_t)active_counts[data.final_grid_lvl] * sizeof(uint16_t);
+    // the LOD lists share the final level's buffer
+    data.max_active_count = std::max(data.max_active_count, active_counts[data.final_grid_lvl] + data.lod_active_count);
+    // the LOD cells only avoid the forward lists written so far, a later level writing to the same buffer can still reach them
+    for (int i = data.final_grid_lvl; i >= 2 && data.lod_active_count > 0; i -= 4) {
+        if (active_counts[i] + data.lod_active_count > MAX_ACTIVE_COUNT) {
+            fprintf(stderr, "The active lists of level %d overlap the LOD lists, increase --max-active\n", i);
+            break;
+        }
+    }
+    if (data.compressed_lists) {
+        data.tracing_mem_usage = g_mem_usage_baseline_tracing + (uint64_t)active_counts[data.final_grid_lvl];
+    } else {
+        data.tracing_mem_usage = g_mem_usage_baseline_tracing + (uint64_t)(active_counts[data.final_grid_lvl] + data.lod_active_count) * sizeof(uint16_t);
+    }
+
+    if (data.pruning_stats_enabled) {
+        std::vector<uint64_t> level_timestamps(8);
+        std::vector<uint32_t> histograms(4 * PRUNING_STATS_NUM_BINS);
+        CopyBuffer(data, init, data.pruning_stats_buffer, data.staging_buffer, histograms.size() * sizeof(histograms[0]));
+        TransferFromBuffer(data.alloc, data.staging_buffer, histograms.data(), histograms.size() * sizeof(histograms[0]));
+
+        for (int slot = 0; slot < 4; slot++) {
+            PruningLevelStats& level = data.pruning_stats.levels[slot];
+            level = {};
+            if ((pruned_levels & (1u << slot)) == 0) continue;
+
+            VK_CHECK(vkGetQueryPoolResults(init.device, data.query_pool, 8 + 2*slot, 2, 2 * sizeof(uint64_t), &level_timestamps[2*slot], sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+            int grid_lvl = 2 * (slot + 1);
+            uint64_t num_cells = 1ull << (3 * grid_lvl);
+
+            level.valid = true;
+            level.elapsed_ms = (float)(level_timestamps[2*slot+1] - level_timestamps[2*slot]) * period / 1000000.0f;
+            level.active_count = active_counts[grid_lvl];
+            level.tmp_count = tmp_counts[grid_lvl];
+            memcpy(level.num_active_histogram, &histograms[slot * PRUNING_STATS_NUM_BINS], sizeof(level.num_active_histogram));
+            level.far_field_fraction = (float)level.num_active_histogram[0] / (float)num_cells;
+            // per cell: count, offset and value; per active node: index, parent and old-to-new entry (only the index at
+            // the final level); per tmp entry: the state. With compressed lists, active_count is the size of the lists in bytes
+            bool final_level = grid_lvl == data.final_grid_lvl;
+            uint64_t list_bytes = data.compressed_lists ? (uint64_t)level.active_count : (uint64_t)level.active_count * (final_level ? 1 : 2) * sizeof(uint16_t);
+            level.bytes_written = num_cells * (2 * sizeof(int) + sizeof(float))
+                + list_bytes + (final_level ? 0 : (uint64_t)level.active_count * sizeof(uint16_t))
+                + (uint64_t)level.tmp_count * sizeof(uint32_t);
+        }
+    } else {
+        data.pruning_stats = {};
+    }
+
+    if (data.shading_mode == SHADING_MODE_COST && data.render_enabled) {
+        read_pixel_cost(init, data);
+    } else {
+        data.pixel_cost_stats = {};
+    }
 
     return 0;
 }
@@ -1372,8 +1787,7 @@ void cleanup(Init& init, RenderData& data) {
         init.disp.destroyFramebuffer(framebuffer, nullptr);
     }
 
-    init.disp.destroyPipeline(data.graphics_pipeline, nullptr);
-    init.disp.destroyPipelineLayout(data.pipeline_layout, nullptr);
+    destroy_graphics_pipeline(init, data);
     init.disp.destroyRenderPass(data.render_pass, nullptr);
 
     init.swapchain.destroy_image_views(data.swapchain_image_views);
@@ -1386,36 +1800,7 @@ void cleanup(Init& init, RenderData& data) {
 }
 
 
-#if 0
-// returns stack size needed to evaluate the subtree
-int MakeLeftHeavy(int idx, std::vector<CSGNode>& csg_nodes) {
-    const CSGNode& node = csg_nodes[idx];
-    switch (node.type) {
-    case NODETYPE_BINARY:
-        int num_left = MakeLeftHeavy(node.left, csg_nodes);
-        int num_right = MakeLeftHeavy(node.right, csg_nodes);
-
-        if (num_left == num_right) {
-            // 0,0 -> no stack needed
-            if (num_left == 0) {
-                return 0;
-            }
-            return num_left + 1;
-        }
-        else if (num_left < num_right) {
-            return num_left + 1;
-        }
-        break;
-    case NODETYPE_SPHERE:
-        return 0;
-        break;
-    default:
-        abort();
-    }
-}
-#endif
-
-int ConvertToGPUTree(int root_idx, const std::vector<CSGNode>& csg_nodes, std::vector<GPUNode>& gpu_nodes, std::vector<Primitive>& primitives, std::vector<BinaryOp>& binary_ops, std::vector<uint16_t>& parent, std::vector<uint16_t>& active_nodes) {
+int ConvertToGPUTree(int root_idx, const std::vector<CSGNode>& csg_nodes, std::vector<GPUNode>& gpu_nodes, std::vector<Primitive>& primitives, std::vector<BinaryOp>& binary_ops, std::vector<uint16_t>& parent, std::vector<uint16_t>& active_nodes, std::vector<int>* prim_nodes) {
 
     std::vector<int> cpu_to_gpu(csg_nodes.size());
     std::vector<int> stack = { root_idx };
@@ -1455,6 +1840,7 @@ int ConvertToGPUTree(int root_idx, const std::vector<CSGNode>& csg_nodes, std::v
             case NODETYPE_PRIMITIVE:
             {
                 primitives.push_back(node.primitive);
+                if (prim_nodes) prim_nodes->push_back(current_idx);
                 GPUNode gpu_node = {
                         .type = node.type,
                         .idx_in_type = (int)primitives.size() - 1,
@@ -1500,7 +1886,7 @@ void init_imgui(Init& init, RenderData& render_data) {
             .MinImageCount = 2,
             .ImageCount = 2,
             .MSAASamples = VK_SAMPLE_COUNT_1_BIT,
-            .PipelineCache = VK_NULL_HANDLE,
+            .PipelineCache = init.pipeline_cache,
             .Subpass = 0,
             .UseDynamicRendering = true,
             .PipelineRenderingCreateInfo = {
@@ -1543,73 +1929,101 @@ void create_query_pool(Init& init, RenderData& render_data) {
     VK_CHECK(vkCreateQueryPool(init.device, &query_pool_info, nullptr, &render_data.query_pool));
 }
 
-void UploadGPUTree(const std::vector<BinaryOp>& binary_ops, const std::vector<GPUNode>& gpu_nodes, const std::vector<Primitive>& primitives, const std::vector<uint16_t>& parent, const std::vector<uint16_t>& active_nodes, RenderData& render_data, Init& init)
-{
-    if (!primitives.empty()) {
-        TransferToBuffer(render_data.alloc, render_data.staging_buffer, primitives.data(), primitives.size() * sizeof(primitives[0]));
-        CopyBuffer(render_data, init, render_data.staging_buffer, render_data.prims_buffer, primitives.size() * sizeof(primitives[0]));
-    }
-
-    {
-        TransferToBuffer(render_data.alloc, render_data.staging_buffer, gpu_nodes.data(), gpu_nodes.size() * sizeof(gpu_nodes[0]));
-        CopyBuffer(render_data, init, render_data.staging_buffer, render_data.nodes_buffer, gpu_nodes.size() * sizeof(gpu_nodes[0]));
-    }
-
-    if (!binary_ops.empty()) {
-        TransferToBuffer(render_data.alloc, render_data.staging_buffer, binary_ops.data(), binary_ops.size() * sizeof(binary_ops[0]));
-        CopyBuffer(render_data, init, render_data.staging_buffer, render_data.binary_ops_buffer, binary_ops.size() * sizeof(binary_ops[0]));
+void UploadScene(const std::vector<CSGNode>& csg_tree, int root_idx, Init& init, RenderData& render_data, SceneConverter& converter) {
+    GPUTreeLayout layout = SceneConverter::layout(csg_tree);
+    if (layout.size > STAGING_BUFFER_SIZE) {
+        fprintf(stderr, "The converted tree (%zu bytes) doesn't fit in the staging buffer\n", layout.size);
+        abort();
     }
 
-    if (!primitives.empty()) {
-        TransferToBuffer(render_data.alloc, render_data.staging_buffer, primitives.data(), primitives.size() * sizeof(primitives[0]));
-        CopyBuffer(render_data, init, render_data.staging_buffer, render_data.prims_buffer, primitives.size() * sizeof(primitives[0]));
-    }
+    // the tree is converted straight into the staging buffer, which the previous copies must be done reading
+    VK_CHECK(vkDeviceWaitIdle(init.device));
+    // hashed even without a pruning cache directory, which can be set after the upload
+    converter.set_bounds(render_data.aabb_min, render_data.aabb_max);
+    converter.convert(root_idx, csg_tree, layout, render_data.staging_buffer.mapped, &render_data.prim_node_indices, &render_data.tree_hash);
+    VK_CHECK(vmaFlushAllocation(render_data.alloc, render_data.staging_buffer.alloc, 0, layout.size));
+
+    Buffer dsts[] = {
+            render_data.nodes_buffer,
+            render_data.binary_ops_buffer,
+            render_data.prims_buffer,
+            render_data.parents_init_buffer,
+            render_data.active_nodes_init_buffer,
+            render_data.skip_records_buffer,
+            render_data.packed_tree_buffer
+    };
+    VkBufferCopy regions[] = {
+            { .srcOffset = layout.nodes, .dstOffset = 0, .size = layout.num_nodes * sizeof(GPUNode) },
+            { .srcOffset = layout.binary_ops, .dstOffset = 0, .size = layout.num_binary_ops * sizeof(BinaryOp) },
+            { .srcOffset = layout.prims, .dstOffset = 0, .size = layout.num_prims * sizeof(Primitive) },
+            { .srcOffset = layout.parents, .dstOffset = 0, .size = layout.num_nodes * sizeof(uint16_t) },
+            { .srcOffset = layout.active_nodes, .dstOffset = 0, .size = layout.num_nodes * sizeof(uint16_t) },
+            { .srcOffset = layout.skip_records, .dstOffset = 0, .size = layout.num_nodes * sizeof(SkipRecord) },
+            { .srcOffset = layout.packed, .dstOffset = 0, .size = layout.packed_size }
+    };
+    CopyBufferRegions(render_data, init, render_data.staging_buffer, 7, dsts, regions);
+
+    render_data.tree = {
+            .nodes = render_data.nodes_buffer.address,
+            .binary_ops = render_data.binary_ops_buffer.address,
+            .prims = render_data.prims_buffer.address,
+            .parents_init = render_data.parents_init_buffer.address,
+            .active_nodes_init = render_data.active_nodes_init_buffer.address,
+            .skip_records = render_data.skip_records_buffer.address,
+            .packed = render_data.packed_tree_buffer.address
+    };
+    render_data.anim_frame = -1;
+}
 
-    {
-        TransferToBuffer(render_data.alloc, render_data.staging_buffer, parent.data(),
-            parent.size() * sizeof(parent[0]));
-        CopyBuffer(render_data, init, render_data.staging_buffer, render_data.parents_init_buffer,
-            parent.size() * sizeof(parent[0]));
+// Converts all the frames of an animation on worker threads and packs them into one device-local arena. Switching
+// frames then only changes the tree addresses, see Context::set_anim_frame.
+void UploadAnim(const std::vector<std::vector<CSGNode>>& csg_trees, const std::vector<int>& root_indices, Init& init, RenderData& render_data) {
+    int num_frames = (int)csg_trees.size();
+    std::vector<GPUTreeLayout> layouts(num_frames);
+    std::vector<size_t> offsets(num_frames);
+    size_t arena_size = 0;
+    for (int i = 0; i < num_frames; i++) {
+        layouts[i] = SceneConverter::layout(csg_trees[i]);
+        offsets[i] = arena_size;
+        arena_size += layouts[i].size;
     }
 
-    {
+    std::vector<char> arena(arena_size);
+    render_data.anim_frames.resize(num_frames);
+    parallel_for(num_frames, [&](int i) {
+        SceneConverter converter;
+        converter.set_bounds(render_data.aabb_min, render_data.aabb_max);
+        converter.convert(root_indices[i], csg_trees[i], layouts[i], arena.data() + offsets[i], nullptr, &render_data.anim_frames[i].tree_hash);
+    });
 
-        TransferToBuffer(render_data.alloc, render_data.staging_buffer, active_nodes.data(), active_nodes.size() * sizeof(active_nodes[0]));
-        CopyBuffer(render_data, init, render_data.staging_buffer, render_data.active_nodes_init_buffer, active_nodes.size() * sizeof(active_nodes[0]));
-    }
     vkDeviceWaitIdle(init.device);
-}
-
-void UploadScene(const std::vector<CSGNode>& csg_tree, int root_idx, Init& init, RenderData& render_data) {
-
-    std::vector<BinaryOp> binary_ops;
-    std::vector<GPUNode> gpu_tree;
-    std::vector<Primitive> primitives;
-    std::vector<uint16_t> parent;
-    std::vector<uint16_t> active_nodes;
-    int gpu_root_idx = ConvertToGPUTree(root_idx, csg_tree, gpu_tree, primitives, binary_ops, parent, active_nodes);
-
-    UploadGPUTree(binary_ops, gpu_tree, primitives, parent, active_nodes, render_data, init);
-}
+    if (render_data.anim_arena.address) {
+        vmaDestroyBuffer(render_data.alloc, render_data.anim_arena.buf, render_data.anim_arena.alloc);
+    }
+    VkBufferUsageFlags buffer_usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    render_data.anim_arena = create_buffer(init, render_data, arena_size, buffer_usage, "anim_arena");
+    UploadToBuffer(render_data, init, render_data.anim_arena, arena.data(), arena_size);
 
-void UploadAnim(const std::vector<std::vector<CSGNode>>& csg_trees, const std::vector<int>& root_indices, Init& init, RenderData& render_data) {
-    int num_frames = csg_trees.size();
-
-    std::vector<std::vector<GPUNode>> gpu_trees(num_frames);
-    std::vector<int> gpu_root_indices(num_frames);
-    std::vector<std::vector<Primitive>> prims(num_frames);
-    std::vector<std::vector<BinaryOp>> binary_ops(num_frames);
-    std::vector<std::vector<uint16_t>> parents(num_frames);
-    std::vector<std::vector<uint16_t>> active_nodes(num_frames);
     for (int i = 0; i < num_frames; i++) {
-        gpu_root_indices[i] = ConvertToGPUTree(root_indices[i], csg_trees[i], gpu_trees[i], prims[i], binary_ops[i], parents[i], active_nodes[i]);
+        uint64_t base = render_data.anim_arena.address + offsets[i];
+        AnimFrame& frame = render_data.anim_frames[i];
+        frame.tree = {
+                .nodes = base + layouts[i].nodes,
+                .binary_ops = base + layouts[i].binary_ops,
+                .prims = base + layouts[i].prims,
+                .parents_init = base + layouts[i].parents,
+                .active_nodes_init = base + layouts[i].active_nodes,
+                .skip_records = base + layouts[i].skip_records,
+                .packed = base + layouts[i].packed
+        };
+        frame.num_nodes = layouts[i].num_nodes;
     }
 }
 
-
-void Context::initialize(bool gui, int final_grid_lvl) {
+void Context::initialize(bool gui, int final_grid_lvl, bool async_compute, bool compressed_lists) {
     this->gui = gui;
     render_data = {};
+    render_data.compressed_lists = compressed_lists;
 
     if (0 != device_initialization(init, gui)) abort();
     VkPhysicalDeviceProperties props;
@@ -1637,11 +2051,13 @@ void Context::initialize(bool gui, int final_grid_lvl) {
         };
         VK_CHECK(vmaCreateAllocator(&alloc_info, &render_data.alloc));
     }
+    load_pipeline_cache(init);
 
     if (gui) {
         if (0 != create_swapchain(init, render_data)) abort();
     }
     if (0 != get_queues(init, render_data)) abort();
+    if (async_compute && 0 != create_async_compute(init, render_data)) abort();
     if (0 != create_command_pool(init, render_data)) abort();
     if (0 != create_command_buffers(init, render_data)) abort();
     create_render_images(init, render_data, gui);
@@ -1649,55 +2065,75 @@ void Context::initialize(bool gui, int final_grid_lvl) {
     if (gui) init_imgui(init, render_data);
     if (0 != create_render_pass(init, render_data)) abort();
     if (0 != create_graphics_pipeline(init, render_data)) abort();
-    render_data.push_constants.max_rel_err = 1;
     create_culling_pipelines(init, render_data);
     create_debug_plane_pipeline(init, render_data, render_data.debug_plane_pipeline, render_data.debug_plane_pipeline_layout);
-    render_data.eval_grid_pipeline = create_compute_pipeline(init, "dense_eval.comp.spv", "dense_eval.comp.glsl", sizeof(EvalGridPushConstants));
+    render_data.eval_grid_pipeline = create_compute_pipeline(init, "dense_eval.comp.spv", "dense_eval.comp.glsl", sizeof(EvalGridPushConstants), render_data.stack_depth, render_data.prim_types, render_data.compressed_lists);
+    render_data.pruning_stats_pipeline = create_compute_pipeline(init, "pruning_stats.comp.spv", "pruning_stats.comp.glsl", sizeof(PruningStatsPushConstants));
+    create_tree_convert_pipeline(init, render_data);
     if (0 != create_framebuffers(init, render_data)) abort();
     if (0 != create_sync_objects(init, render_data)) abort();
     create_query_pool(init, render_data);
+    create_query_resources(init, render_data);
 
     VkBufferUsageFlags buffer_usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
     render_data.mvp_buffer = create_buffer(init, render_data, sizeof(glm::mat4), buffer_usage, "mvp_buffer");
-    render_data.cam_buffer = create_buffer(init, render_data, sizeof(glm::vec4)*4, buffer_usage, "cam_buffer");
+    render_data.cam_buffer = create_buffer(init, render_data, sizeof(glm::vec4)*8, buffer_usage, "cam_buffer");
+    render_data.pruning_cam_buffer = create_buffer(init, render_data, sizeof(glm::vec4)*8, buffer_usage, "pruning_cam_buffer");
+    render_data.staging_ring = create_mapped_buffer(init, render_data, MAX_FRAMES_IN_FLIGHT * STAGING_RING_FRAME_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, "staging_ring");
+    render_data.pruning_stats_buffer = create_buffer(init, render_data, 4 * PRUNING_STATS_NUM_BINS * sizeof(uint32_t), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "pruning_stats_buffer");
+    render_data.lod_buffer = create_buffer(init, render_data, sizeof(LodParams), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "lod_buffer");
     int s = 1 << final_grid_lvl;
     int num_cells = s*s*s;
     render_data.num_active_buffer[0] = create_buffer(init, render_data, num_cells*sizeof(int), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "num_active_buffer[0]");
-    render_data.cell_offsets_buffer[0] = create_buffer(init, render_data, num_cells*sizeof(int), buffer_usage, "cell_offsets_buffer[0]");
-    render_data.cell_errors[0] = create_buffer(init, render_data, num_cells*sizeof(float), buffer_usage, "cell_errors[0]");
+    render_data.cell_offsets_buffer[0] = create_buffer(init, render_data, num_cells*sizeof(int), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "cell_offsets_buffer[0]");
+    render_data.cell_errors[0] = create_buffer(init, render_data, num_cells*sizeof(float), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "cell_errors[0]");
     g_mem_usage_baseline_tracing = g_memory_usage;
 
     render_data.active_count_buffer = create_buffer(init, render_data, 10 * sizeof(int), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "active_count_buffer");
-    render_data.cell_errors[1] = create_buffer(init, render_data, num_cells * sizeof(float), buffer_usage, "cell_errors[1]");
+    render_data.cell_errors[1] = create_buffer(init, render_data, num_cells * sizeof(float), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "cell_errors[1]");
     render_data.num_active_buffer[1] = create_buffer(init, render_data, num_cells * sizeof(int), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "num_active_buffer[1]");
-    render_data.cell_offsets_buffer[1] = create_buffer(init, render_data, num_cells * sizeof(int), buffer_usage, "cell_offsets_buffer[1]");
+    render_data.cell_offsets_buffer[1] = create_buffer(init, render_data, num_cells * sizeof(int), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "cell_offsets_buffer[1]");
     render_data.old_to_new_count_buffer = create_buffer(init, render_data, 10 * sizeof(int), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "old_to_new_count_buffer");
     g_mem_usage_baseline_pruning = g_memory_usage;
 
     render_data.old_to_new_scratch_buffer = create_buffer(init, render_data, MAX_TMP_COUNT*sizeof(uint16_t), VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, "old_to_new_scratch_buffer");
     render_data.tmp_buffer = create_buffer(init, render_data, MAX_TMP_COUNT*sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_SRC_BIT|buffer_usage, "tmp_buffer");
-    render_data.active_nodes_buffer[0] = create_buffer(init, render_data, MAX_ACTIVE_COUNT*sizeof(uint16_t), buffer_usage, "active_nodes_buffer[0]");
-    render_data.active_nodes_buffer[1] = create_buffer(init, render_data, MAX_ACTIVE_COUNT*sizeof(uint16_t), buffer_usage, "active_nodes_buffer[1]");
-    render_data.parents_buffer[0] = create_buffer(init, render_data, MAX_ACTIVE_COUNT * sizeof(uint16_t), buffer_usage, "parents_buffer[0]");
-    render_data.parents_buffer[1] = create_buffer(init, render_data, MAX_ACTIVE_COUNT * sizeof(uint16_t), buffer_usage, "parents_buffer[1]");
+    render_data.active_nodes_buffer[0] = create_buffer(init, render_data, MAX_ACTIVE_COUNT*sizeof(uint16_t), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "active_nodes_buffer[0]");
+    render_data.active_nodes_buffer[1] = create_buffer(init, render_data, MAX_ACTIVE_COUNT*sizeof(uint16_t), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "active_nodes_buffer[1]");
+    if (!render_data.compressed_lists) {
+        // the compressed lists carry their parents inline, these stay null
+        render_data.parents_buffer[0] = create_buffer(init, render_data, MAX_ACTIVE_COUNT * sizeof(uint16_t), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "parents_buffer[0]");
+        render_data.parents_buffer[1] = create_buffer(init, render_data, MAX_ACTIVE_COUNT * sizeof(uint16_t), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "parents_buffer[1]");
+    }
+    if (render_data.async_compute_available) {
+        render_data.num_active_buffer[2] = create_buffer(init, render_data, num_cells * sizeof(int), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "num_active_buffer[2]");
+        render_data.cell_offsets_buffer[2] = create_buffer(init, render_data, num_cells * sizeof(int), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "cell_offsets_buffer[2]");
+        render_data.cell_errors[2] = create_buffer(init, render_data, num_cells * sizeof(float), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "cell_errors[2]");
+        render_data.active_nodes_buffer[2] = create_buffer(init, render_data, MAX_ACTIVE_COUNT * sizeof(uint16_t), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "active_nodes_buffer[2]");
+    }
 
     {
         VkBufferCreateInfo buffer_info = {
                 .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
                 .pNext = nullptr,
                 .flags = 0,
-                .size = 4 * 4096 * 4096,
+                .size = STAGING_BUFFER_SIZE,
                 .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                 .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
         };
+        // persistently mapped, so that the scene converter can write to it directly
         VmaAllocationCreateInfo alloc_info{};
         alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
-        alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
-        VK_CHECK(vmaCreateBuffer(render_data.alloc, &buffer_info, &alloc_info, &render_data.staging_buffer.buf, &render_data.staging_buffer.alloc, nullptr));
+        alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+        VmaAllocationInfo info;
+        VK_CHECK(vmaCreateBuffer(render_data.alloc, &buffer_info, &alloc_info, &render_data.staging_buffer.buf, &render_data.staging_buffer.alloc, &info));
+        render_data.staging_buffer.mapped = info.pMappedData;
     }
 
     render_data.input_idx = 0;
     render_data.output_idx = 1;
+
+    save_pipeline_cache(init);
 }
 
 void Context::alloc_input_buffers(int num_nodes) {
@@ -1707,6 +2143,8 @@ void Context::alloc_input_buffers(int num_nodes) {
         vmaDestroyBuffer(render_data.alloc, render_data.prims_buffer.buf, render_data.prims_buffer.alloc);
         vmaDestroyBuffer(render_data.alloc, render_data.parents_init_buffer.buf, render_data.parents_init_buffer.alloc);
         vmaDestroyBuffer(render_data.alloc, render_data.active_nodes_init_buffer.buf, render_data.active_nodes_init_buffer.alloc);
+        vmaDestroyBuffer(render_data.alloc, render_data.skip_records_buffer.buf, render_data.skip_records_buffer.alloc);
+        vmaDestroyBuffer(render_data.alloc, render_data.packed_tree_buffer.buf, render_data.packed_tree_buffer.alloc);
     }
     VkBufferUsageFlags buffer_usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
     render_data.nodes_buffer = create_buffer(init, render_data, num_nodes * sizeof(GPUNode), buffer_usage, "nodes_buffer");
@@ -1714,6 +2152,9 @@ void Context::alloc_input_buffers(int num_nodes) {
     render_data.prims_buffer = create_buffer(init, render_data, num_nodes*sizeof(Primitive), buffer_usage, "prims_buffer");
     render_data.parents_init_buffer = create_buffer(init, render_data, num_nodes * sizeof(uint16_t), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "parents_init_buffer");
     render_data.active_nodes_init_buffer = create_buffer(init, render_data, num_nodes * sizeof(uint16_t), buffer_usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, "active_nodes_init");
+    render_data.skip_records_buffer = create_buffer(init, render_data, num_nodes * sizeof(SkipRecord), buffer_usage, "skip_records_buffer");
+    // node records, then at most 6 units (a box with a full precision transform) per primitive
+    render_data.packed_tree_buffer = create_buffer(init, render_data, ((num_nodes + 1) / 2 + 6 * num_nodes) * 16, buffer_usage, "packed_tree_buffer");
 }
 
 
@@ -1724,13 +2165,13 @@ Timings Context::render(glm::vec3 cam_position, glm::vec3 cam_target) {
     //render_data.push_constants.cam_pos = glm::vec4(0,0,1,0);
     render_data.push_constants.resolution = { init.swapchain.extent.width, init.swapchain.extent.height };
     render_data.push_constants.num_nodes = render_data.total_num_nodes;
-    render_data.push_constants.prims_ref = GetBufferAddress(init, render_data.prims_buffer);
-    render_data.push_constants.binary_ops_ref = GetBufferAddress(init, render_data.binary_ops_buffer);
-    render_data.push_constants.nodes_ref = GetBufferAddress(init, render_data.nodes_buffer);
+    render_data.push_constants.prims_ref = render_data.tree.prims;
+    render_data.push_constants.binary_ops_ref = render_data.tree.binary_ops;
+    render_data.push_constants.nodes_ref = render_data.tree.nodes;
     render_data.push_constants.active_nodes_in_ref = GetBufferAddress(init, render_data.active_nodes_buffer[0]);
-    render_data.push_constants.parents_in_ref = GetBufferAddress(init, render_data.parents_buffer[0]);
+    render_data.push_constants.parents_in_ref = render_data.parents_buffer[0].address;
     render_data.push_constants.active_nodes_out_ref = GetBufferAddress(init, render_data.active_nodes_buffer[1]);
-    render_data.push_constants.parents_out_ref = GetBufferAddress(init, render_data.parents_buffer[1]);
+    render_data.push_constants.parents_out_ref = render_data.parents_buffer[1].address;
     render_data.push_constants.num_active_in_ref = GetBufferAddress(init, render_data.num_active_buffer[0]);
     render_data.push_constants.num_active_out_ref = GetBufferAddress(init, render_data.num_active_buffer[1]);
     render_data.push_constants.cell_offsets_in_ref = render_data.cell_offsets_buffer[render_data.input_idx].address;
@@ -1739,6 +2180,21 @@ Timings Context::render(glm::vec3 cam_position, glm::vec3 cam_target) {
     render_data.push_constants.old_to_new_scratch_ref = render_data.old_to_new_scratch_buffer.address;
     render_data.push_constants.old_to_new_count_ref = render_data.old_to_new_count_buffer.address;
     render_data.push_constants.tmp_ref = render_data.tmp_buffer.address;
+    render_data.push_constants.skip_records_ref = render_data.tree.skip_records;
+    render_data.push_constants.packed_tree_ref = render_data.packed_tree_enabled ? render_data.tree.packed : 0;
+    if (render_data.shading_mode == SHADING_MODE_COST) {
+        int num_pixels = (int)(init.swapchain.extent.width * init.swapchain.extent.height);
+        if (num_pixels > render_data.pixel_cost_capacity) {
+            VK_CHECK(vkDeviceWaitIdle(init.device));
+            if (render_data.pixel_cost_capacity > 0) {
+                vmaDestroyBuffer(render_data.alloc, render_data.pixel_cost_buffer.buf, render_data.pixel_cost_buffer.alloc);
+            }
+            VkBufferUsageFlags buffer_usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+            render_data.pixel_cost_buffer = create_buffer(init, render_data, PIXEL_COST_NUM_COUNTERS * num_pixels * sizeof(uint32_t), buffer_usage, "pixel_cost_buffer");
+            render_data.pixel_cost_capacity = num_pixels;
+        }
+        render_data.push_constants.pixel_cost_ref = render_data.pixel_cost_buffer.address;
+    }
     int grid_dim_log2 = 8;
     render_data.push_constants.grid_size = 1 << grid_dim_log2;
     render_data.push_constants.first_lvl = true;
@@ -1746,32 +2202,146 @@ Timings Context::render(glm::vec3 cam_position, glm::vec3 cam_target) {
     glm::mat4 view_mat = glm::lookAt(cam_position, glm::vec3(0), glm::vec3(0, 1, 0));
     glm::mat4 proj_mat = glm::perspective((float)M_PI / 2.f, (float)init.swapchain.extent.width / (float)init.swapchain.extent.height, 0.01f, 10.f);
     glm::mat4 mvp = proj_mat * view_mat;
-    TransferToBuffer(render_data.alloc, render_data.staging_buffer, &mvp[0], sizeof(mvp));
-    CopyBuffer(render_data, init, render_data.staging_buffer, render_data.mvp_buffer, sizeof(mvp));
+    begin_staging_frame(init, render_data);
+    stage_upload(render_data, render_data.frame_uploads, render_data.mvp_buffer, &mvp[0], sizeof(mvp));
 
     render_data.cam_pos = cam_position;
 
-    glm::vec4 cam_data[4];
+    glm::vec4 cam_data[8];
     cam_data[0] = glm::vec4(cam_position,0);
     cam_data[1] = glm::vec4(cam_target, 0);
     cam_data[2] = glm::vec4(render_data.sphere_albedo, 1);
     cam_data[3] = glm::vec4(render_data.background_color, 1);
-    TransferToBuffer(render_data.alloc, render_data.staging_buffer, cam_data, sizeof(cam_data));
-    CopyBuffer(render_data, init, render_data.staging_buffer, render_data.cam_buffer, sizeof(cam_data));
 
+    // left, right, bottom and top planes of the frustum of the primary rays, for frustum pruning.
+    // The fragment shader looks at cam_target, where the mvp above always looks at the origin
+    glm::mat4 frustum_mat = proj_mat * glm::lookAt(cam_position, cam_target, glm::vec3(0, 1, 0));
+    glm::vec4 row0 = glm::row(frustum_mat, 0), row1 = glm::row(frustum_mat, 1), row3 = glm::row(frustum_mat, 3);
+    glm::vec4 planes[4] = { row3 + row0, row3 - row0, row3 + row1, row3 - row1 };
+    for (int i = 0; i < 4; i++) {
+        cam_data[4+i] = planes[i] / glm::length(glm::vec3(planes[i]));
+    }
+    stage_upload(render_data, render_data.frame_uploads, render_data.cam_buffer, cam_data, sizeof(cam_data));
+    stage_upload(render_data, render_data.pruning_uploads, render_data.pruning_cam_buffer, cam_data, sizeof(cam_data));
+
+    load_cached_pruning(init, render_data);
     draw_frame(init, render_data, gui);
+    save_cached_pruning(init, render_data);
 
     return {
         .culling_elapsed_ms = render_data.culling_elapsed_ms,
         .tracing_elapsed_ms = render_data.tracing_elapsed_ms,
         .render_elapsed_ms = render_data.render_elapsed_ms,
         .eval_grid_elapsed_ms = render_data.eval_grid_elapsed_ms,
+        .frame_elapsed_ms = render_data.frame_elapsed_ms,
         .pruning_mem_usage_gb = (float)((double)render_data.pruning_mem_usage / (double)(1024. * 1024. * 1024.)),
-        .tracing_mem_usage_gb = (float)((double)render_data.tracing_mem_usage / (double)(1024.*1024.*1024.))
+        .tracing_mem_usage_gb = (float)((double)render_data.tracing_mem_usage / (double)(1024.*1024.*1024.)),
+        .pruning_stats = render_data.pruning_stats,
+        .pixel_cost = render_data.pixel_cost_stats
     };
 }
 
-void Context::upload(const std::vector<CSGNode> &nodes, int root_idx) {
-    UploadScene(nodes, root_idx, init, render_data);
+// Recompiles the pipelines that evaluate the tree when the uploaded tree needs a different stack size, or has other
+// primitive types. Depths are rounded up to a power of two so that small edits don't trigger a recompilation.
+// jit_dir switches the tracer and the pruning to the shaders compiled for the tree (see shader_jit.h), or back to the
+// interpreted ones when empty, in the same rebuild.
+static void update_specialization(Init& init, RenderData& render_data, int tree_depth, int prim_types, const std::string& jit_dir) {
+    int stack_depth = 8;
+    while (stack_depth < tree_depth) stack_depth *= 2;
+    bool specialization_changed = stack_depth != render_data.stack_depth || prim_types != render_data.prim_types;
+    if (!specialization_changed && jit_dir == render_data.jit_shader_dir) return;
+
+    vkDeviceWaitIdle(init.device);
+    render_data.stack_depth = stack_depth;
+    render_data.prim_types = prim_types;
+    render_data.jit_shader_dir = jit_dir;
+
+    destroy_graphics_pipeline(init, render_data);
+    if (0 != create_graphics_pipeline(init, render_data)) abort();
+
+    destroy_pipeline(init, render_data.culling_pipeline);
+    destroy_pipeline(init, render_data.culling_final_pipeline);
+    create_culling_pipelines(init, render_data);
+
+    // the other pipelines have no scene-specific version
+    if (!specialization_changed) {
+        save_pipeline_cache(init);
+        return;
+    }
+
+    destroy_pipeline(init, render_data.eval_grid_pipeline);
+    render_data.eval_grid_pipeline = create_compute_pipeline(init, "dense_eval.comp.spv", "dense_eval.comp.glsl", sizeof(EvalGridPushConstants), render_data.stack_depth, render_data.prim_types, render_data.compressed_lists);
+
+    destroy_pipeline(init, render_data.query_pipeline);
+    destroy_pipeline(init, render_data.raycast_pipeline);
+    create_query_pipelines(init, render_data);
+
+    save_pipeline_cache(init);
+}
+
+void Context::set_half_eval(bool enabled) {
+    if (enabled == render_data.half_eval) return;
+
+    vkDeviceWaitIdle(init.device);
+    render_data.half_eval = enabled;
+
+    destroy_graphics_pipeline(init, render_data);
+    if (0 != create_graphics_pipeline(init, render_data)) abort();
+
+    destroy_pipeline(init, render_data.culling_pipeline);
+    destroy_pipeline(init, render_data.culling_final_pipeline);
+    create_culling_pipelines(init, render_data);
+
+    destroy_pipeline(init, render_data.query_pipeline);
+    destroy_pipeline(init, render_data.raycast_pipeline);
+    create_query_pipelines(init, render_data);
+
+    save_pipeline_cache(init);
+}
+
+void Context::upload(const std::vector<CSGNode> &nodes, int root_idx, bool jit) {
+    std::string jit_dir = jit ? compile_jit_shaders(render_data, nodes, root_idx) : "";
+    update_specialization(init, render_data, tree_stack_depth(nodes, root_idx), tree_prim_types(nodes), jit_dir);
+    UploadScene(nodes, root_idx, init, render_data, scene_converter);
     render_data.total_num_nodes = (int)nodes.size();
+    render_data.pruning_valid = false;
+}
+
+void Context::upload_gpu(const std::vector<CSGNode> &nodes, int root_idx) {
+    // the tree changes every frame, compiling it would cost more than interpreting it
+    update_specialization(init, render_data, tree_stack_depth(nodes, root_idx), tree_prim_types(nodes), "");
+    convert_tree_gpu(init, render_data, nodes, root_idx);
+    render_data.total_num_nodes = (int)nodes.size();
+    render_data.pruning_valid = false;
+}
+
+void Context::upload_anim(const std::vector<std::vector<CSGNode>>& frames, const std::vector<int>& root_indices) {
+    int stack_depth = 0;
+    int prim_types = 0;
+    for (size_t i = 0; i < frames.size(); i++) {
+        stack_depth = std::max(stack_depth, tree_stack_depth(frames[i], root_indices[i]));
+        prim_types |= tree_prim_types(frames[i]);
+    }
+    // one set of shaders for all the frames
+    update_specialization(init, render_data, stack_depth, prim_types, "");
+    UploadAnim(frames, root_indices, init, render_data);
+    set_anim_frame(0);
+}
+
+void Context::set_anim_frame(int frame) {
+    const AnimFrame& anim_frame = render_data.anim_frames[frame];
+    render_data.tree = anim_frame.tree;
+    render_data.total_num_nodes = anim_frame.num_nodes;
+    render_data.tree_hash = anim_frame.tree_hash;
+    render_data.anim_frame = frame;
+    // the previous result belongs to another tree, async pruning must not trace it
+    render_data.pruning_valid = false;
+}
+
+void Context::query_distances(const glm::vec3* pts, size_t n, float* out, glm::vec3* gradients) {
+    query_points(init, render_data, pts, n, out, gradients);
+}
+
+void Context::query_rays(const glm::vec3* origins, const glm::vec3* directions, size_t n, RayHit* hits) {
+    ::query_rays(init, render_data, origins, directions, n, hits);
 }
\ No newline at end of file
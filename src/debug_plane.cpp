@@ -43,6 +43,16 @@ void create_debug_plane_pipeline(Init& init, RenderData& data, VkPipeline& pipel
     frag_stage_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
     frag_stage_info.module = frag_module;
     frag_stage_info.pName = "main";
+    // COMPRESSED_LISTS, for the lists read by sdf_active
+    VkBool32 compressed_lists = data.compressed_lists;
+    VkSpecializationMapEntry map_entry = { .constantID = 3, .offset = 0, .size = sizeof(VkBool32) };
+    VkSpecializationInfo frag_spec_info = {
+        .mapEntryCount = 1,
+        .pMapEntries = &map_entry,
+        .dataSize = sizeof(compressed_lists),
+        .pData = &compressed_lists
+    };
+    frag_stage_info.pSpecializationInfo = &frag_spec_info;
 
     VkPipelineShaderStageCreateInfo shader_stages[] = { vert_stage_info, frag_stage_info };
 
@@ -176,7 +186,7 @@ void create_debug_plane_pipeline(Init& init, RenderData& data, VkPipeline& pipel
     pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
     pipeline_info.pNext = &pipeline_rendering;
 
-    VK_CHECK(init.disp.createGraphicsPipelines(VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline));
+    VK_CHECK(init.disp.createGraphicsPipelines(init.pipeline_cache, 1, &pipeline_info, nullptr, &pipeline));
 
     init.disp.destroyShaderModule(frag_module, nullptr);
     init.disp.destroyShaderModule(vert_module, nullptr);
@@ -8,15 +8,68 @@
 #include "backends/imgui_impl_vulkan.h"
 #include "backends/imgui_impl_glfw.h"
 #include "scene.h"
+#include "tree.h"
 #include <filesystem>
 
+bool simplify_scene = true;
+bool reorder_scene = true;
+
 int create_scene(std::vector<CSGNode>& csg_tree, const std::string& input_path, glm::vec3& aabb_min, glm::vec3& aabb_max) {
     csg_tree.clear();
     load_json(input_path.c_str(), csg_tree, aabb_min, aabb_max);
     int root_idx = 0;
+    if (simplify_scene) {
+        size_t num_nodes = csg_tree.size();
+        root_idx = simplify_tree(csg_tree, root_idx, aabb_min, aabb_max);
+        printf("Simplified tree: %zu -> %zu nodes\n", num_nodes, csg_tree.size());
+    }
+    if (reorder_scene) {
+        int depth = tree_stack_depth(csg_tree, root_idx);
+        int reordered_depth = reorder_tree(csg_tree, root_idx);
+        printf("Evaluation stack depth: %d -> %d\n", depth, reordered_depth);
+    }
     return root_idx;
 }
 
+// Loads every .json scene of the directory as one frame, in file name order. The frames are converted on worker threads
+// and share the union of their AABBs, so that the pruning grid stays put during the playback. Returns the largest node count.
+int load_anim(const std::string& anim_dir, std::vector<std::vector<CSGNode>>& frames, std::vector<int>& root_indices, glm::vec3& aabb_min, glm::vec3& aabb_max) {
+    std::vector<std::string> paths;
+    for (const auto& entry : std::filesystem::directory_iterator(anim_dir)) {
+        if (entry.path().extension() == ".json") paths.push_back(entry.path().string());
+    }
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty()) {
+        fprintf(stderr, "No .json frames in %s\n", anim_dir.c_str());
+        abort();
+    }
+
+    int num_frames = (int)paths.size();
+    frames.assign(num_frames, {});
+    root_indices.assign(num_frames, 0);
+    std::vector<glm::vec3> aabb_mins(num_frames);
+    std::vector<glm::vec3> aabb_maxs(num_frames);
+    parallel_for(num_frames, [&](int i) {
+        load_json(paths[i].c_str(), frames[i], aabb_mins[i], aabb_maxs[i]);
+    });
+    aabb_min = aabb_mins[0];
+    aabb_max = aabb_maxs[0];
+    for (int i = 1; i < num_frames; i++) {
+        aabb_min = glm::min(aabb_min, aabb_mins[i]);
+        aabb_max = glm::max(aabb_max, aabb_maxs[i]);
+    }
+
+    parallel_for(num_frames, [&](int i) {
+        if (simplify_scene) root_indices[i] = simplify_tree(frames[i], root_indices[i], aabb_min, aabb_max);
+        if (reorder_scene) reorder_tree(frames[i], root_indices[i]);
+    });
+
+    int max_num_nodes = 0;
+    for (const auto& frame : frames) max_num_nodes = std::max(max_num_nodes, (int)frame.size());
+    printf("Loaded %d frames, up to %d nodes\n", num_frames, max_num_nodes);
+    return max_num_nodes;
+}
+
 float cam_distance = 3.f;
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
@@ -38,6 +91,14 @@ int main(int argc, char** argv) {
     float cam_pitch = M_PI / 2;
 
     bool culling_enabled = true;
+    bool async_compute = false;
+    bool compressed_lists = false;
+    bool frustum_pruning = false;
+    float lod_threshold_px = 0;
+    bool packed_tree = false;
+    bool half_eval = false;
+    std::string pruning_cache_dir = "";
+    std::string jit_cache_dir = "";
     int num_samples = 1;
     std::string shading_mode_str = "shaded";
 
@@ -56,11 +117,21 @@ int main(int argc, char** argv) {
     cli.add_option("--cam_pitch", cam_pitch, "Camera pitch");
     cli.add_option("--cam_dist", cam_distance, "Camera pitch");
     cli.add_option("--culling", culling_enabled, "Enable culling");
+    cli.add_option("--async-compute", async_compute, "Prune on a compute queue while the previous result is traced");
+    cli.add_option("--compressed-lists", compressed_lists, "Store the active lists as delta-coded byte streams, without LOD");
+    cli.add_option("--frustum-pruning", frustum_pruning, "Only prune the cells in the view frustum");
+    cli.add_option("--lod", lod_threshold_px, "Stop subdividing the cells smaller than this many pixels on screen (0: disabled)");
+    cli.add_option("--packed-tree", packed_tree, "Evaluate the active lists from the packed layout of the tree");
+    cli.add_option("--half-eval", half_eval, "Evaluate the primitives in half precision away from the surface");
+    cli.add_option("--pruning-cache", pruning_cache_dir, "Directory of the on-disk pruning cache for static scenes");
+    cli.add_option("--jit", jit_cache_dir, "Compile scene-specific shaders for the uploaded trees, cached in this directory");
     cli.add_option("--samples", num_samples, "Samples per pixel");
     cli.add_option("--shading", shading_mode_str, "Shading mode");
     cli.add_option("--max-active", MAX_ACTIVE_COUNT, "Max active count");
     cli.add_option("--max-tmp", MAX_TMP_COUNT, "Max tmp count");
     cli.add_option("--anim", anim_path, "Animation directory");
+    cli.add_option("--simplify", simplify_scene, "Remove subtrees that don't affect the AABB before upload");
+    cli.add_option("--reorder", reorder_scene, "Reorder the tree to minimize the evaluation stack depth");
     cli.add_option("--target_x", cam_target.x, "Target X");
     cli.add_option("--target_y", cam_target.y, "Target Y");
     cli.add_option("--target_z", cam_target.z, "Target Z");
@@ -84,7 +155,11 @@ int main(int argc, char** argv) {
 
 
     Context ctx;
-    ctx.initialize(true, 8);
+    ctx.initialize(true, 8, async_compute, compressed_lists);
+    // before the first upload, which compiles the shaders of the scene and hashes the tree for the pruning cache
+    ctx.render_data.jit_cache_dir = jit_cache_dir;
+    ctx.render_data.pruning_cache_dir = pruning_cache_dir;
+    ctx.render_data.async_compute_enabled = async_compute;
 
     int root_idx = create_scene(csg_tree, input_file, ctx.render_data.aabb_min, ctx.render_data.aabb_max);
     num_nodes = csg_tree.size();
@@ -92,8 +167,25 @@ int main(int argc, char** argv) {
     ctx.alloc_input_buffers(num_nodes);
     ctx.upload(csg_tree, root_idx);
 
-    ctx.render_data.push_constants.alpha = 1;
+    // the frames stay resident in the animation arena, playing them back only swaps the tree addresses
+    int num_anim_frames = 0;
+    float anim_fps = 24;
+    if (!anim_path.empty()) {
+        std::vector<std::vector<CSGNode>> anim_frames;
+        std::vector<int> anim_roots;
+        num_nodes = load_anim(anim_path, anim_frames, anim_roots, ctx.render_data.aabb_min, ctx.render_data.aabb_max);
+        num_anim_frames = (int)anim_frames.size();
+        ctx.upload_anim(anim_frames, anim_roots);
+    }
+    bool anim_frames_play = num_anim_frames > 0;
+    double anim_frames_start_time = glfwGetTime();
+
     ctx.render_data.culling_enabled = culling_enabled;
+    ctx.render_data.frustum_pruning = frustum_pruning;
+    ctx.render_data.lod_enabled = lod_threshold_px > 0;
+    ctx.render_data.packed_tree_enabled = packed_tree;
+    ctx.set_half_eval(half_eval);
+    if (lod_threshold_px > 0) ctx.render_data.lod_threshold_px = lod_threshold_px;
     ctx.render_data.num_samples = num_samples;
 
     if (shading_mode_str == "normals") {
@@ -105,6 +197,9 @@ int main(int argc, char** argv) {
     else if (shading_mode_str == "beauty") {
         ctx.render_data.shading_mode = SHADING_MODE_BEAUTY;
     }
+    else if (shading_mode_str == "cost") {
+        ctx.render_data.shading_mode = SHADING_MODE_COST;
+    }
     else {
         fprintf(stderr, "Unknown shading mode: %s\n", shading_mode_str.c_str());
         abort();
@@ -121,6 +216,7 @@ int main(int argc, char** argv) {
     double anim_start_time;
     float anim_speed = 4;
     bool anim_play = false;
+    bool gpu_tree_conversion = true;
     while (!glfwWindowShouldClose(ctx.init.window)/* && g_frame < 10000*/) {
         glfwPollEvents();
 
@@ -143,6 +239,7 @@ int main(int argc, char** argv) {
                     ctx.upload(csg_tree, root_idx);
 
                     anim_play = false;
+                    anim_frames_play = false;
                     ctx.render_data.culling_enabled = true;
                 }
             }
@@ -152,12 +249,25 @@ int main(int argc, char** argv) {
             std::vector<CSGNode> csg_tree;
             int root_idx = create_scene(csg_tree, input_file, ctx.render_data.aabb_min, ctx.render_data.aabb_max);
             ctx.upload(csg_tree, root_idx);
+            anim_frames_play = false;
         }
         ImGui::SliderFloat3("AABB min", &ctx.render_data.aabb_min[0], -3, 0);
         ImGui::SliderFloat3("AABB max", &ctx.render_data.aabb_max[0], 0, 3);
         ImGui::Text("Num nodes: %d", num_nodes);
 
         ImGui::SeparatorText("Animation");
+        if (num_anim_frames > 0) {
+            if (ImGui::Checkbox("Play frames", &anim_frames_play) && anim_frames_play) {
+                anim_frames_start_time = glfwGetTime();
+            }
+            ImGui::SliderFloat("Frames per second", &anim_fps, 1, 60);
+            // loading another scene replaces the tree, the animation frames are shown again once the playback restarts
+            if (anim_frames_play) {
+                int frame = (int)((glfwGetTime() - anim_frames_start_time) * anim_fps) % num_anim_frames;
+                if (frame != ctx.render_data.anim_frame) ctx.set_anim_frame(frame);
+            }
+            ImGui::Text("Frame: %d / %d", ctx.render_data.anim_frame, num_anim_frames);
+        }
         if (anim_play) {
             if (ImGui::Button("Stop anim")) {
                 anim_play = false;
@@ -168,6 +278,7 @@ int main(int argc, char** argv) {
             }
         } else if (ImGui::Button("Play anim")) {
             anim_play = true;
+            anim_frames_play = false;
             anim_start_time = glfwGetTime();
             {
                 CSGNode node{};
@@ -195,9 +306,11 @@ int main(int argc, char** argv) {
             num_nodes = csg_tree.size();
             root_idx = csg_tree.size()-1;
             ctx.alloc_input_buffers(num_nodes);
-            ctx.upload(csg_tree, root_idx);
+            // the tree changes every frame from now on
+            ctx.upload(csg_tree, root_idx, false);
         }
         ImGui::SliderFloat("Anim speed", &anim_speed, 0, 4.f);
+        ImGui::Checkbox("GPU tree conversion", &gpu_tree_conversion);
         if (anim_play) {
             auto before = std::chrono::high_resolution_clock::now();
             float anim_time = (float)(glfwGetTime() - anim_start_time);
@@ -213,7 +326,8 @@ int main(int argc, char** argv) {
             csg_tree[num_nodes-2].primitive.m_row0[3] = -center.x;
             csg_tree[num_nodes-2].primitive.m_row1[3] = -center.y;
             csg_tree[num_nodes-2].primitive.m_row2[3] = -center.z;
-            ctx.upload(csg_tree, root_idx);
+            if (gpu_tree_conversion) ctx.upload_gpu(csg_tree, root_idx);
+            else ctx.upload(csg_tree, root_idx, false);
             auto after = std::chrono::high_resolution_clock::now();
             float upload_ms = (float)std::chrono::duration_cast<std::chrono::microseconds>(after - before).count() / (float)1000.f;
             ImGui::Text("Upload time: %fms\n", upload_ms);
@@ -230,6 +344,36 @@ int main(int argc, char** argv) {
             ImGui::EndDisabled();
         }
         ImGui::Checkbox("Recompute pruning", &ctx.render_data.compute_culling);
+        if (ctx.render_data.pruning_cached) {
+            ImGui::SameLine();
+            ImGui::Text("(cached)");
+        }
+        ImGui::Checkbox("Frustum pruning", &ctx.render_data.frustum_pruning);
+        if (ctx.render_data.compressed_lists) ImGui::BeginDisabled();
+        ImGui::Checkbox("Screen-space LOD", &ctx.render_data.lod_enabled);
+        if (ctx.render_data.compressed_lists) {
+            ImGui::SameLine();
+            ImGui::Text("(not with --compressed-lists)");
+            ImGui::EndDisabled();
+        }
+        if (ctx.render_data.lod_enabled && !ctx.render_data.compressed_lists) {
+            ImGui::SliderFloat("LOD threshold (px)", &ctx.render_data.lod_threshold_px, 0.5f, 64.f, "%.1f", ImGuiSliderFlags_Logarithmic);
+            ImGui::Text("LOD active nodes: %d", ctx.render_data.lod_active_count);
+        }
+        ImGui::Checkbox("Packed tree", &ctx.render_data.packed_tree_enabled);
+        if (ctx.render_data.packed_tree_enabled && !ctx.render_data.tree.packed) {
+            ImGui::SameLine();
+            ImGui::Text("(unavailable for GPU-converted trees)");
+        }
+        bool half_eval_enabled = ctx.render_data.half_eval;
+        if (ImGui::Checkbox("Half precision", &half_eval_enabled)) ctx.set_half_eval(half_eval_enabled);
+        if (!ctx.render_data.async_compute_available) ImGui::BeginDisabled();
+        ImGui::Checkbox("Async pruning", &ctx.render_data.async_compute_enabled);
+        if (!ctx.render_data.async_compute_available) {
+            ImGui::SameLine();
+            ImGui::Text("(needs --async-compute)");
+            ImGui::EndDisabled();
+        }
         if (ImGui::Button("-")) {
             ctx.render_data.final_grid_lvl -= 2;
             if (ctx.render_data.final_grid_lvl < 2) ctx.render_data.final_grid_lvl = 2;
@@ -284,6 +428,40 @@ int main(int argc, char** argv) {
         ImGui::Text("Render: %fms", ctx.render_data.render_elapsed_ms);
         ImGui::Text("Culling: %fms", ctx.render_data.culling_elapsed_ms);
         ImGui::Text("Tracing: %fms", ctx.render_data.tracing_elapsed_ms);
+        ImGui::Text("Frame: %fms", ctx.render_data.frame_elapsed_ms);
+
+        ImGui::Checkbox("Pruning stats", &ctx.render_data.pruning_stats_enabled);
+        if (ctx.render_data.pruning_stats_enabled && ImGui::BeginTable("pruning_stats", 6, ImGuiTableFlags_Borders)) {
+            ImGui::TableSetupColumn("Level");
+            ImGui::TableSetupColumn("Time (ms)");
+            ImGui::TableSetupColumn("Active");
+            ImGui::TableSetupColumn("Tmp");
+            ImGui::TableSetupColumn("Far field");
+            ImGui::TableSetupColumn("Written (MB)");
+            ImGui::TableHeadersRow();
+            for (int i = 0; i < 4; i++) {
+                const PruningLevelStats& level = timing.pruning_stats.levels[i];
+                if (!level.valid) continue;
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn(); ImGui::Text("%d", 2 * (i + 1));
+                ImGui::TableNextColumn(); ImGui::Text("%.3f", level.elapsed_ms);
+                ImGui::TableNextColumn(); ImGui::Text("%d", level.active_count);
+                ImGui::TableNextColumn(); ImGui::Text("%d", level.tmp_count);
+                ImGui::TableNextColumn(); ImGui::Text("%.1f%%", 100.f * level.far_field_fraction);
+                ImGui::TableNextColumn(); ImGui::Text("%.2f", (double)level.bytes_written / (1024. * 1024.));
+            }
+            ImGui::EndTable();
+
+            const PruningLevelStats& final_level = timing.pruning_stats.levels[ctx.render_data.final_grid_lvl / 2 - 1];
+            if (final_level.valid) {
+                float histogram[PRUNING_STATS_NUM_BINS];
+                for (int b = 0; b < PRUNING_STATS_NUM_BINS; b++) {
+                    histogram[b] = (float)final_level.num_active_histogram[b];
+                }
+                // bin 0 is the far field, bin b holds the cells with [2^(b-1), 2^b) active nodes
+                ImGui::PlotHistogram("Active per cell", histogram, PRUNING_STATS_NUM_BINS, 0, nullptr, 0, FLT_MAX, ImVec2(0, 60));
+            }
+        }
 
         ImGui::SeparatorText("VRAM");
         //ImGui::Text("Memory usage: %lfG", (double)g_memory_usage / (1024. * 1024. * 1024.));
@@ -309,13 +487,19 @@ int main(int argc, char** argv) {
 
 
         ImGui::SeparatorText("Render");
-        if (ImGui::Combo("Shading mode", &ctx.render_data.shading_mode, "Shaded\0Heatmap\0Normals\0AO\0")) {
-            ctx.init.disp.destroyPipeline(ctx.render_data.graphics_pipeline, nullptr);
-            create_graphics_pipeline(ctx.init, ctx.render_data);
-        }
+        ImGui::Combo("Shading mode", &ctx.render_data.shading_mode, "Shaded\0Heatmap\0Normals\0AO\0Cost\0");
         if (ctx.render_data.shading_mode == SHADING_MODE_HEATMAP) {
             ImGui::SliderInt("Colormap max", &ctx.render_data.colormap_max, 1, 64);
         }
+        if (ctx.render_data.shading_mode == SHADING_MODE_COST) {
+            ImGui::SliderInt("Colormap max (k evals)", &ctx.render_data.colormap_max, 1, 64);
+            const PixelCostStats& cost = timing.pixel_cost;
+            if (cost.valid) {
+                ImGui::Text("Steps: mean %.1f, p99 %u, max %u", cost.steps.mean, cost.steps.p99, cost.steps.max);
+                ImGui::Text("Node evals: mean %.0f, p99 %u, total %.3fG", cost.node_evals.mean, cost.node_evals.p99, (double)cost.node_evals.total * 1e-9);
+                ImGui::Text("Shadow/AO evals: mean %.0f, p99 %u, total %.3fG", cost.shading_node_evals.mean, cost.shading_node_evals.p99, (double)cost.shading_node_evals.total * 1e-9);
+            }
+        }
         ImGui::SliderInt("Samples per pixel", &ctx.render_data.num_samples, 1, 64);
 
         ImGui::SliderFloat("Gamma", &ctx.render_data.gamma, 1, 4);
@@ -330,7 +514,7 @@ int main(int argc, char** argv) {
         }
         if (ImGui::TreeNode("Fragment shader")) {
             char pipeline_stats[4096];
-            get_pipeline_stats(ctx.init, ctx.render_data.graphics_pipeline, 1, pipeline_stats, 4096);
+            get_pipeline_stats(ctx.init, ctx.render_data.graphics_pipelines[ctx.render_data.shading_mode], 1, pipeline_stats, 4096);
             ImGui::Text("%s", pipeline_stats);
             ImGui::TreePop();
         }
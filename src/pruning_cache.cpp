@@ -0,0 +1,215 @@
+#include "pruning_cache.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+
+// The file starts with this header, followed by the run-length encoded cell counts, offsets and values, then the
+// active node indices (the final level writes no parents). Cells with identical lists share them, the offsets point into
+// the deduplicated lists.
+struct PruningCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    int grid_lvl;
+    int num_list_nodes;
+};
+
+static const uint32_t PRUNING_CACHE_MAGIC = 0x4350524c; // "LRPC"
+static const uint32_t PRUNING_CACHE_VERSION = 2;
+
+static bool pruning_cache_enabled(const RenderData& data) {
+    return !data.pruning_cache_dir.empty() && data.culling_enabled && !data.frustum_pruning && !data.lod_enabled && !data.compressed_lists;
+}
+
+static uint64_t pruning_cache_key(const RenderData& data) {
+    int hierarchy = data.hierarchy_enabled;
+    int half_eval = data.half_eval;
+    uint64_t key = fnv1a(&PRUNING_CACHE_VERSION, sizeof(PRUNING_CACHE_VERSION));
+    key = fnv1a(&data.tree_hash, sizeof(data.tree_hash), key);
+    key = fnv1a(&data.aabb_min, sizeof(data.aabb_min), key);
+    key = fnv1a(&data.aabb_max, sizeof(data.aabb_max), key);
+    key = fnv1a(&data.final_grid_lvl, sizeof(data.final_grid_lvl), key);
+    key = fnv1a(&half_eval, sizeof(half_eval), key);
+    return fnv1a(&hierarchy, sizeof(hierarchy), key);
+}
+
+static std::string pruning_cache_path(const RenderData& data, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return data.pruning_cache_dir + "/" + name;
+}
+
+// (run length, value) pairs of 32-bit words
+static void rle_encode(const uint32_t* words, size_t n, std::vector<uint32_t>& out) {
+    for (size_t i = 0; i < n;) {
+        size_t run = 1;
+        while (i + run < n && words[i + run] == words[i] && run < UINT32_MAX) run++;
+        out.push_back((uint32_t)run);
+        out.push_back(words[i]);
+        i += run;
+    }
+}
+
+static bool rle_decode(const std::vector<uint32_t>& in, uint32_t* words, size_t n) {
+    size_t pos = 0;
+    for (size_t i = 0; i + 1 < in.size(); i += 2) {
+        if (in[i] > n - pos) return false;
+        std::fill(words + pos, words + pos + in[i], in[i + 1]);
+        pos += in[i];
+    }
+    return pos == n;
+}
+
+static void write_rle(std::ofstream& file, const void* words, size_t n) {
+    std::vector<uint32_t> encoded;
+    rle_encode((const uint32_t*)words, n, encoded);
+    uint64_t size = encoded.size();
+    file.write((const char*)&size, sizeof(size));
+    file.write((const char*)encoded.data(), (std::streamsize)(size * sizeof(uint32_t)));
+}
+
+static bool read_rle(std::ifstream& file, void* words, size_t n) {
+    uint64_t size = 0;
+    if (!file.read((char*)&size, sizeof(size)) || size > 2 * n) return false;
+    std::vector<uint32_t> encoded(size);
+    if (!file.read((char*)encoded.data(), (std::streamsize)(size * sizeof(uint32_t)))) return false;
+    return rle_decode(encoded, (uint32_t*)words, n);
+}
+
+static bool read_pruning_cache(Init& init, RenderData& data, uint64_t key) {
+    std::ifstream file(pruning_cache_path(data, key), std::ios::binary);
+    PruningCacheHeader header = {};
+    if (!file.is_open() || !file.read((char*)&header, sizeof(header))
+        || header.magic != PRUNING_CACHE_MAGIC || header.version != PRUNING_CACHE_VERSION
+        || header.key != key || header.grid_lvl != data.final_grid_lvl
+        || header.num_list_nodes < 0 || header.num_list_nodes > MAX_ACTIVE_COUNT) {
+        return false;
+    }
+
+    size_t num_cells = (size_t)1 << (3 * header.grid_lvl);
+    std::vector<int> num_active(num_cells);
+    std::vector<int> cell_offsets(num_cells);
+    std::vector<float> cell_errors(num_cells);
+    std::vector<uint16_t> active_nodes(header.num_list_nodes);
+    size_t list_size = active_nodes.size() * sizeof(uint16_t);
+    if (!read_rle(file, num_active.data(), num_cells)
+        || !read_rle(file, cell_offsets.data(), num_cells)
+        || !read_rle(file, cell_errors.data(), num_cells)
+        || !file.read((char*)active_nodes.data(), (std::streamsize)list_size)) {
+        return false;
+    }
+    for (size_t i = 0; i < num_cells; i++) {
+        if (num_active[i] > 0 && (cell_offsets[i] < 0 || cell_offsets[i] + num_active[i] > header.num_list_nodes)) return false;
+    }
+
+    int set = data.output_idx;
+    UploadToBuffer(data, init, data.num_active_buffer[set], num_active.data(), num_cells * sizeof(int));
+    UploadToBuffer(data, init, data.cell_offsets_buffer[set], cell_offsets.data(), num_cells * sizeof(int));
+    UploadToBuffer(data, init, data.cell_errors[set], cell_errors.data(), num_cells * sizeof(float));
+    UploadToBuffer(data, init, data.active_nodes_buffer[set], active_nodes.data(), list_size);
+    return true;
+}
+
+void load_cached_pruning(Init& init, RenderData& data) {
+    if (!pruning_cache_enabled(data)) {
+        data.pruning_cached = false;
+        return;
+    }
+    uint64_t key = pruning_cache_key(data);
+    if (key == data.pruning_cache_key) return;
+
+    data.pruning_cache_key = key;
+    data.pruning_cached = read_pruning_cache(init, data, key);
+    if (data.pruning_cached) {
+        data.pruning_valid = true;
+        data.async_pruned_grid_lvl = data.final_grid_lvl;
+    }
+}
+
+void save_cached_pruning(Init& init, RenderData& data) {
+    // the output set only holds a result for the current key when this frame pruned
+    if (!pruning_cache_enabled(data) || data.pruning_cached || !data.compute_culling) return;
+    data.pruning_cached = true;
+
+    std::string path = pruning_cache_path(data, data.pruning_cache_key);
+    if (std::filesystem::exists(path)) return;
+
+    int set = data.output_idx;
+    size_t num_cells = (size_t)1 << (3 * data.final_grid_lvl);
+    std::vector<int> num_active(num_cells);
+    std::vector<int> cell_offsets(num_cells);
+    std::vector<float> cell_errors(num_cells);
+    DownloadFromBuffer(data, init, data.num_active_buffer[set], num_active.data(), num_cells * sizeof(int));
+    DownloadFromBuffer(data, init, data.cell_offsets_buffer[set], cell_offsets.data(), num_cells * sizeof(int));
+    DownloadFromBuffer(data, init, data.cell_errors[set], cell_errors.data(), num_cells * sizeof(float));
+
+    int list_end = 0;
+    for (size_t i = 0; i < num_cells; i++) {
+        if (num_active[i] > 0) list_end = std::max(list_end, cell_offsets[i] + num_active[i]);
+    }
+    std::vector<uint16_t> active_nodes(list_end);
+    DownloadFromBuffer(data, init, data.active_nodes_buffer[set], active_nodes.data(), list_end * sizeof(uint16_t));
+
+    // neighbouring cells often end up with the same list, store each one once. The unused offsets and the values of
+    // the near-field cells are zeroed so that they compress
+    std::vector<uint16_t> unique_nodes;
+    std::unordered_map<uint64_t, std::vector<int>> lists_by_hash;
+    for (size_t i = 0; i < num_cells; i++) {
+        int n = num_active[i];
+        if (n <= 0) {
+            cell_offsets[i] = 0;
+            continue;
+        }
+        cell_errors[i] = 0;
+
+        const uint16_t* nodes = &active_nodes[cell_offsets[i]];
+        uint64_t hash = fnv1a(nodes, n * sizeof(uint16_t));
+        hash = fnv1a(&n, sizeof(n), hash);
+
+        int offset = -1;
+        std::vector<int>& candidates = lists_by_hash[hash];
+        for (int candidate : candidates) {
+            if (std::equal(nodes, nodes + n, &unique_nodes[candidate])) {
+                offset = candidate;
+                break;
+            }
+        }
+        if (offset < 0) {
+            offset = (int)unique_nodes.size();
+            unique_nodes.insert(unique_nodes.end(), nodes, nodes + n);
+            candidates.push_back(offset);
+        }
+        cell_offsets[i] = offset;
+    }
+
+    // a failed write only costs a pruning on the next run. The file is renamed once complete, so that an interrupted
+    // write doesn't leave a truncated file behind
+    std::error_code ec;
+    std::filesystem::create_directories(data.pruning_cache_dir, ec);
+    std::string tmp_path = path + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        fprintf(stderr, "failed to write %s\n", tmp_path.c_str());
+        return;
+    }
+    PruningCacheHeader header = {
+            .magic = PRUNING_CACHE_MAGIC,
+            .version = PRUNING_CACHE_VERSION,
+            .key = data.pruning_cache_key,
+            .grid_lvl = data.final_grid_lvl,
+            .num_list_nodes = (int)unique_nodes.size()
+    };
+    file.write((const char*)&header, sizeof(header));
+    write_rle(file, num_active.data(), num_cells);
+    write_rle(file, cell_offsets.data(), num_cells);
+    write_rle(file, cell_errors.data(), num_cells);
+    file.write((const char*)unique_nodes.data(), (std::streamsize)(unique_nodes.size() * sizeof(uint16_t)));
+    file.close();
+    if (!file) {
+        fprintf(stderr, "failed to write %s\n", tmp_path.c_str());
+        std::filesystem::remove(tmp_path, ec);
+        return;
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+}
@@ -0,0 +1,248 @@
+#include "query.h"
+#include <algorithm>
+#include <cstring>
+
+struct QueryPushConstants {
+    glm::vec4 aabb_min;
+    glm::vec4 aabb_max;
+    uint64_t prims_ref;
+    uint64_t binary_ops_ref;
+    uint64_t nodes_ref;
+    uint64_t active_nodes_ref;
+    uint64_t cells_offset_ref;
+    uint64_t cells_num_active_ref;
+    uint64_t cells_value_ref;
+    uint64_t points_ref;
+    uint64_t results_ref;
+    int total_num_nodes;
+    int grid_size;
+    int culling_enabled;
+    int num_points;
+    int compute_gradients;
+};
+
+struct RaycastPushConstants {
+    glm::vec4 aabb_min;
+    glm::vec4 aabb_max;
+    uint64_t prims_ref;
+    uint64_t binary_ops_ref;
+    uint64_t nodes_ref;
+    uint64_t active_nodes_ref;
+    uint64_t cells_offset_ref;
+    uint64_t cells_num_active_ref;
+    uint64_t cells_value_ref;
+    uint64_t rays_ref;
+    uint64_t hits_ref;
+    int total_num_nodes;
+    int grid_size;
+    int culling_enabled;
+    int num_rays;
+};
+
+// matches RayHit in raycast.comp.glsl
+struct GPURayHit {
+    glm::vec4 normal_t;
+    int prim;
+    int inside;
+    int pad[2];
+};
+
+void create_query_pipelines(Init& init, RenderData& render_data) {
+    render_data.query_pipeline = create_compute_pipeline(init, "query.comp.spv", "query.comp.glsl", sizeof(QueryPushConstants), render_data.stack_depth, render_data.prim_types, render_data.compressed_lists, render_data.half_eval);
+    render_data.raycast_pipeline = create_compute_pipeline(init, "raycast.comp.spv", "raycast.comp.glsl", sizeof(RaycastPushConstants), render_data.stack_depth, render_data.prim_types, render_data.compressed_lists, render_data.half_eval);
+}
+
+void create_query_resources(Init& init, RenderData& render_data) {
+    create_query_pipelines(init, render_data);
+
+    // separate pool: the frame command pool is destroyed when the swapchain is recreated
+    VkCommandPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = render_data.graphics_queue_family
+    };
+    VK_CHECK(init.disp.createCommandPool(&pool_info, nullptr, &render_data.query_command_pool));
+
+    VkCommandBufferAllocateInfo alloc_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .commandPool = render_data.query_command_pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 2
+    };
+    VK_CHECK(init.disp.allocateCommandBuffers(&alloc_info, render_data.query_command_buffers));
+
+    VkFenceCreateInfo fence_info = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0
+    };
+    for (int i = 0; i < 2; i++) {
+        VK_CHECK(init.disp.createFence(&fence_info, nullptr, &render_data.query_fences[i]));
+        render_data.query_input_buffer[i] = create_mapped_buffer(init, render_data, QUERY_BATCH_SIZE * 2 * sizeof(glm::vec3), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, "query_input_buffer");
+        render_data.query_output_buffer[i] = create_mapped_buffer(init, render_data, QUERY_BATCH_SIZE * sizeof(GPURayHit), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, "query_output_buffer");
+    }
+}
+
+// The items are streamed through the two batch slots: while the GPU processes batch b,
+// the CPU reads back batch b-1 and fills batch b+1.
+// fill(slot, first, count) writes the inputs, record(cmd_buf, slot, count) records the dispatch,
+// read(slot, first, count) consumes the outputs once the batch has completed.
+template<typename Fill, typename Record, typename Read>
+static void stream_batches(Init& init, RenderData& data, size_t num_items, Fill fill, Record record, Read read) {
+    size_t num_batches = (num_items + QUERY_BATCH_SIZE - 1) / QUERY_BATCH_SIZE;
+
+    auto read_back = [&](size_t batch) {
+        int slot = (int)(batch % 2);
+        size_t first = batch * QUERY_BATCH_SIZE;
+        size_t count = std::min(num_items - first, (size_t)QUERY_BATCH_SIZE);
+
+        VK_CHECK(init.disp.waitForFences(1, &data.query_fences[slot], VK_TRUE, UINT64_MAX));
+        read(slot, first, count);
+    };
+
+    for (size_t batch = 0; batch < num_batches; batch++) {
+        int slot = (int)(batch % 2);
+        size_t first = batch * QUERY_BATCH_SIZE;
+        size_t count = std::min(num_items - first, (size_t)QUERY_BATCH_SIZE);
+
+        if (batch >= 2) read_back(batch - 2);
+
+        fill(slot, first, count);
+
+        VkCommandBuffer cmd_buf = data.query_command_buffers[slot];
+        VkCommandBufferBeginInfo begin_info = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                .pNext = nullptr,
+                .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+                .pInheritanceInfo = nullptr
+        };
+        VK_CHECK(vkBeginCommandBuffer(cmd_buf, &begin_info));
+        record(cmd_buf, slot, count);
+        VK_CHECK(vkEndCommandBuffer(cmd_buf));
+
+        VkCommandBufferSubmitInfo cmd_buf_info = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                .pNext = nullptr,
+                .commandBuffer = cmd_buf,
+                .deviceMask = 0
+        };
+        VkSubmitInfo2 submit_info = {
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                .pNext = nullptr,
+                .flags = 0,
+                .waitSemaphoreInfoCount = 0,
+                .pWaitSemaphoreInfos = nullptr,
+                .commandBufferInfoCount = 1,
+                .pCommandBufferInfos = &cmd_buf_info,
+                .signalSemaphoreInfoCount = 0,
+                .pSignalSemaphoreInfos = nullptr
+        };
+        VK_CHECK(init.disp.resetFences(1, &data.query_fences[slot]));
+        VK_CHECK(vkQueueSubmit2(data.graphics_queue, 1, &submit_info, data.query_fences[slot]));
+    }
+
+    for (size_t batch = num_batches >= 2 ? num_batches - 2 : 0; batch < num_batches; batch++) {
+        read_back(batch);
+    }
+}
+
+// Queries read the final level of the last pruning pass, so they see the same pruned field as the last rendered frame.
+void query_points(Init& init, RenderData& data, const glm::vec3* points, size_t num_points, float* distances, glm::vec3* gradients) {
+    auto fill = [&](int slot, size_t first, size_t count) {
+        memcpy(data.query_input_buffer[slot].mapped, points + first, count * sizeof(glm::vec3));
+        VK_CHECK(vmaFlushAllocation(data.alloc, data.query_input_buffer[slot].alloc, 0, count * sizeof(glm::vec3)));
+    };
+
+    auto record = [&](VkCommandBuffer cmd_buf, int slot, size_t count) {
+        QueryPushConstants push_constants = {
+                .aabb_min = glm::vec4(data.aabb_min, 0),
+                .aabb_max = glm::vec4(data.aabb_max, 0),
+                .prims_ref = data.tree.prims,
+                .binary_ops_ref = data.tree.binary_ops,
+                .nodes_ref = data.tree.nodes,
+                .active_nodes_ref = data.active_nodes_buffer[data.output_idx].address,
+                .cells_offset_ref = data.cell_offsets_buffer[data.output_idx].address,
+                .cells_num_active_ref = data.num_active_buffer[data.output_idx].address,
+                .cells_value_ref = data.cell_errors[data.output_idx].address,
+                .points_ref = data.query_input_buffer[slot].address,
+                .results_ref = data.query_output_buffer[slot].address,
+                .total_num_nodes = data.total_num_nodes,
+                .grid_size = 1 << data.final_grid_lvl,
+                .culling_enabled = data.culling_enabled && data.pruning_valid,
+                .num_points = (int)count,
+                .compute_gradients = gradients != nullptr
+        };
+        vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, data.query_pipeline.pipe);
+        vkCmdPushConstants(cmd_buf, data.query_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(QueryPushConstants), &push_constants);
+        vkCmdDispatch(cmd_buf, (uint32_t)((count + 63) / 64), 1, 1);
+    };
+
+    auto read = [&](int slot, size_t first, size_t count) {
+        VK_CHECK(vmaInvalidateAllocation(data.alloc, data.query_output_buffer[slot].alloc, 0, count * sizeof(glm::vec4)));
+        const glm::vec4* results = (const glm::vec4*)data.query_output_buffer[slot].mapped;
+        for (size_t i = 0; i < count; i++) {
+            distances[first + i] = results[i].w;
+        }
+        if (gradients) {
+            for (size_t i = 0; i < count; i++) {
+                gradients[first + i] = glm::vec3(results[i]);
+            }
+        }
+    };
+
+    stream_batches(init, data, num_points, fill, record, read);
+}
+
+void query_rays(Init& init, RenderData& data, const glm::vec3* origins, const glm::vec3* directions, size_t num_rays, RayHit* hits) {
+    auto fill = [&](int slot, size_t first, size_t count) {
+        glm::vec3* rays = (glm::vec3*)data.query_input_buffer[slot].mapped;
+        for (size_t i = 0; i < count; i++) {
+            rays[2*i+0] = origins[first + i];
+            rays[2*i+1] = directions[first + i];
+        }
+        VK_CHECK(vmaFlushAllocation(data.alloc, data.query_input_buffer[slot].alloc, 0, count * 2 * sizeof(glm::vec3)));
+    };
+
+    auto record = [&](VkCommandBuffer cmd_buf, int slot, size_t count) {
+        RaycastPushConstants push_constants = {
+                .aabb_min = glm::vec4(data.aabb_min, 0),
+                .aabb_max = glm::vec4(data.aabb_max, 0),
+                .prims_ref = data.tree.prims,
+                .binary_ops_ref = data.tree.binary_ops,
+                .nodes_ref = data.tree.nodes,
+                .active_nodes_ref = data.active_nodes_buffer[data.output_idx].address,
+                .cells_offset_ref = data.cell_offsets_buffer[data.output_idx].address,
+                .cells_num_active_ref = data.num_active_buffer[data.output_idx].address,
+                .cells_value_ref = data.cell_errors[data.output_idx].address,
+                .rays_ref = data.query_input_buffer[slot].address,
+                .hits_ref = data.query_output_buffer[slot].address,
+                .total_num_nodes = data.total_num_nodes,
+                .grid_size = 1 << data.final_grid_lvl,
+                .culling_enabled = data.culling_enabled && data.pruning_valid,
+                .num_rays = (int)count
+        };
+        vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, data.raycast_pipeline.pipe);
+        vkCmdPushConstants(cmd_buf, data.raycast_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(RaycastPushConstants), &push_constants);
+        vkCmdDispatch(cmd_buf, (uint32_t)((count + 63) / 64), 1, 1);
+    };
+
+    auto read = [&](int slot, size_t first, size_t count) {
+        VK_CHECK(vmaInvalidateAllocation(data.alloc, data.query_output_buffer[slot].alloc, 0, count * sizeof(GPURayHit)));
+        const GPURayHit* results = (const GPURayHit*)data.query_output_buffer[slot].mapped;
+        for (size_t i = 0; i < count; i++) {
+            const GPURayHit& h = results[i];
+            // the GPU reports the primitive index, translate it back to the node of the uploaded tree
+            int node_idx = (h.prim >= 0 && h.prim < (int)data.prim_node_indices.size()) ? data.prim_node_indices[h.prim] : -1;
+            hits[first + i] = RayHit {
+                    .t = h.normal_t.w,
+                    .normal = glm::vec3(h.normal_t),
+                    .node_idx = node_idx,
+                    .inside = h.inside != 0
+            };
+        }
+    };
+
+    stream_batches(init, data, num_rays, fill, record, read);
+}
@@ -0,0 +1,201 @@
+#include "scene_converter.h"
+#include "context.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+// size of the record of a primitive in 16 byte units, see PackedTree
+static uint32_t packed_record_units(PrimitiveType type, bool half) {
+    int transform_words = half ? 6 : 12;
+    int param_words = type == PRIMITIVE_BOX ? 9 : 2;
+    return (uint32_t)(transform_words + param_words + 3) / 4;
+}
+
+static bool half_transform_safe(const Primitive& prim, glm::vec3 extent) {
+    const glm::vec4* rows[] = { &prim.m_row0, &prim.m_row1, &prim.m_row2 };
+    for (const glm::vec4* row : rows) {
+        glm::vec4 rounded(glm::unpackHalf2x16(glm::packHalf2x16(glm::vec2(row->x, row->y))), glm::unpackHalf2x16(glm::packHalf2x16(glm::vec2(row->z, row->w))));
+        glm::vec4 err = glm::abs(rounded - *row);
+        // also rejects the values that overflow to infinity
+        if (!(glm::dot(glm::vec3(err), extent) + err.w <= PACKED_HALF_MAX_ERROR)) return false;
+    }
+    return true;
+}
+
+// decoded like box_corner_rounding in common.glsl
+static glm::vec4 box_corner_rounding(const glm::vec4& data) {
+    glm::vec3 half_sides = glm::vec3(data) * 0.5f;
+    float scale = std::max(half_sides.x, half_sides.z) * 2;
+    uint32_t corner_data;
+    memcpy(&corner_data, &data.w, sizeof(corner_data));
+    glm::vec4 corner_rounding;
+    for (int i = 0; i < 4; i++) {
+        corner_rounding[i] = (float)((corner_data >> (8 * i)) & 0xff) * scale / 255.f / 2;
+    }
+    return corner_rounding;
+}
+
+GPUTreeLayout SceneConverter::layout(const std::vector<CSGNode>& csg_nodes) {
+    GPUTreeLayout layout = {};
+    layout.num_nodes = (int)csg_nodes.size();
+    int num_boxes = 0;
+    for (const CSGNode& node : csg_nodes) {
+        if (node.type == NODETYPE_PRIMITIVE) {
+            layout.num_prims++;
+            if (node.primitive.type == PRIMITIVE_BOX) num_boxes++;
+        }
+        else layout.num_binary_ops++;
+    }
+    layout.packed_size = ((layout.num_nodes + 1) / 2 + (layout.num_prims - num_boxes) * packed_record_units(PRIMITIVE_SPHERE, false) + num_boxes * packed_record_units(PRIMITIVE_BOX, false)) * 16;
+
+    const size_t ALIGNMENT = 64;
+    auto reserve = [&](size_t size) {
+        size_t offset = layout.size;
+        layout.size += (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        return offset;
+    };
+    layout.nodes = reserve(layout.num_nodes * sizeof(GPUNode));
+    layout.binary_ops = reserve(layout.num_binary_ops * sizeof(BinaryOp));
+    layout.prims = reserve(layout.num_prims * sizeof(Primitive));
+    layout.parents = reserve(layout.num_nodes * sizeof(uint16_t));
+    layout.active_nodes = reserve(layout.num_nodes * sizeof(uint16_t));
+    layout.skip_records = reserve(layout.num_nodes * sizeof(SkipRecord));
+    layout.packed = reserve(layout.packed_size);
+    return layout;
+}
+
+int SceneConverter::convert(int root_idx, const std::vector<CSGNode>& csg_nodes, const GPUTreeLayout& layout, void* dst, std::vector<int>* prim_nodes, uint64_t* tree_hash) {
+    char* base = (char*)dst;
+    GPUNode* gpu_nodes = (GPUNode*)(base + layout.nodes);
+    BinaryOp* binary_ops = (BinaryOp*)(base + layout.binary_ops);
+    Primitive* primitives = (Primitive*)(base + layout.prims);
+    uint16_t* parent = (uint16_t*)(base + layout.parents);
+    uint16_t* active_nodes = (uint16_t*)(base + layout.active_nodes);
+    SkipRecord* skip_records = (SkipRecord*)(base + layout.skip_records);
+
+    int num_nodes = layout.num_nodes;
+    cpu_to_gpu.resize(num_nodes);
+    postfix.clear();
+    stack.clear();
+    stack.push_back(root_idx);
+    while (!stack.empty()) {
+        int current_idx = stack.back();
+        stack.pop_back();
+
+        postfix.push_back(current_idx);
+        if (csg_nodes[current_idx].type == NODETYPE_BINARY) {
+            stack.push_back(csg_nodes[current_idx].left);
+            stack.push_back(csg_nodes[current_idx].right);
+        }
+    }
+    assert((int)postfix.size() == num_nodes);
+    // reverse preorder visits the children first: it is the postfix order, see ConvertToGPUTree
+    std::reverse(postfix.begin(), postfix.end());
+    if (prim_nodes) prim_nodes->resize(layout.num_prims);
+
+    int num_prims = 0;
+    int num_binary_ops = 0;
+    uint64_t nodes_hash = FNV1A_OFFSET_BASIS;
+    uint64_t prims_hash = FNV1A_OFFSET_BASIS;
+    uint64_t binary_ops_hash = FNV1A_OFFSET_BASIS;
+    for (int gpu_idx = 0; gpu_idx < num_nodes; gpu_idx++) {
+        int current_idx = postfix[gpu_idx];
+        const CSGNode& node = csg_nodes[current_idx];
+
+        GPUNode gpu_node;
+        if (node.type == NODETYPE_BINARY) {
+            binary_ops[num_binary_ops] = node.binary_op;
+            if (tree_hash) binary_ops_hash = fnv1a(&node.binary_op, sizeof(BinaryOp), binary_ops_hash);
+            gpu_node = { .type = node.type, .idx_in_type = num_binary_ops++ };
+            parent[cpu_to_gpu[node.left]] = (uint16_t)gpu_idx;
+            parent[cpu_to_gpu[node.right]] = (uint16_t)gpu_idx;
+        } else {
+            primitives[num_prims] = node.primitive;
+            if (tree_hash) prims_hash = fnv1a(&node.primitive, sizeof(Primitive), prims_hash);
+            if (prim_nodes) (*prim_nodes)[num_prims] = current_idx;
+            gpu_node = { .type = node.type, .idx_in_type = num_prims++ };
+        }
+        gpu_nodes[gpu_idx] = gpu_node;
+        if (tree_hash) nodes_hash = fnv1a(&gpu_node, sizeof(GPUNode), nodes_hash);
+        parent[gpu_idx] = 0xffff;
+        cpu_to_gpu[current_idx] = gpu_idx;
+        active_nodes[gpu_idx] = (uint16_t)(node.sign ? gpu_idx : gpu_idx | 1 << 15);
+    }
+
+    if (tree_hash) {
+        uint64_t hash = fnv1a(&prims_hash, sizeof(prims_hash), nodes_hash);
+        *tree_hash = fnv1a(&binary_ops_hash, sizeof(binary_ops_hash), hash);
+    }
+
+    // from the CSG nodes rather than dst, which is slow to read back when it is mapped device memory
+    build_skip_records(csg_nodes, postfix.data(), num_nodes, skip_records, skip_scratch);
+    pack(csg_nodes, num_nodes, base + layout.packed);
+    return cpu_to_gpu[root_idx];
+}
+
+void SceneConverter::set_bounds(glm::vec3 aabb_min, glm::vec3 aabb_max) {
+    extent = glm::max(glm::abs(aabb_min), glm::abs(aabb_max));
+}
+
+void SceneConverter::pack(const std::vector<CSGNode>& csg_nodes, int num_nodes, char* dst) {
+    glm::uvec2* records = (glm::uvec2*)dst;
+    glm::uvec4* units = (glm::uvec4*)dst;
+
+    // the records of each primitive type follow each other, after the node records
+    uint32_t type_offset[4] = {};
+    packed_units.resize(num_nodes);
+    for (int gpu_idx = 0; gpu_idx < num_nodes; gpu_idx++) {
+        const CSGNode& node = csg_nodes[postfix[gpu_idx]];
+        if (node.type != NODETYPE_PRIMITIVE) continue;
+        bool half = half_transform_safe(node.primitive, extent);
+        uint32_t num_units = packed_record_units(node.primitive.type, half);
+        packed_units[gpu_idx] = num_units | (uint32_t)half << PACKED_HALF_BIT;
+        type_offset[node.primitive.type] += num_units;
+    }
+    uint32_t offset = (uint32_t)(num_nodes + 1) / 2;
+    for (int type = 0; type < 4; type++) {
+        uint32_t type_units = type_offset[type];
+        type_offset[type] = offset;
+        offset += type_units;
+    }
+
+    for (int gpu_idx = 0; gpu_idx < num_nodes; gpu_idx++) {
+        const CSGNode& node = csg_nodes[postfix[gpu_idx]];
+        if (node.type == NODETYPE_BINARY) {
+            records[gpu_idx] = glm::uvec2((uint32_t)PACKED_NODE_BINARY << PACKED_TYPE_SHIFT, node.binary_op.blend_factor_and_sign);
+            continue;
+        }
+        const Primitive& prim = node.primitive;
+        bool half = (packed_units[gpu_idx] >> PACKED_HALF_BIT) & 1;
+        uint32_t unit = type_offset[prim.type];
+        type_offset[prim.type] += packed_units[gpu_idx] & PACKED_OFFSET_MASK;
+        records[gpu_idx] = glm::uvec2((uint32_t)prim.type << PACKED_TYPE_SHIFT | (uint32_t)half << PACKED_HALF_BIT | unit, prim.color);
+
+        // assembled here and written with whole 16 byte stores, dst may be write-combined memory
+        uint32_t words[24] = {};
+        int num_words = 0;
+        const glm::vec4* rows[] = { &prim.m_row0, &prim.m_row1, &prim.m_row2 };
+        for (const glm::vec4* row : rows) {
+            if (half) {
+                words[num_words++] = glm::packHalf2x16(glm::vec2(row->x, row->y));
+                words[num_words++] = glm::packHalf2x16(glm::vec2(row->z, row->w));
+            } else {
+                memcpy(&words[num_words], row, sizeof(glm::vec4));
+                num_words += 4;
+            }
+        }
+        if (prim.type == PRIMITIVE_BOX) {
+            // decoded here rather than for every evaluation
+            glm::vec4 corner_rounding = box_corner_rounding(prim.box.sizes);
+            memcpy(&words[num_words], &prim.box.sizes, 3 * sizeof(float));
+            memcpy(&words[num_words + 3], &prim.extrude_rounding, sizeof(glm::vec2));
+            memcpy(&words[num_words + 5], &corner_rounding, sizeof(glm::vec4));
+            num_words += 9;
+        } else {
+            // the first two floats of the union: radius, height and radius, or radius and height
+            memcpy(&words[num_words], &prim.sphere, 2 * sizeof(float));
+            num_words += 2;
+        }
+        memcpy(&units[unit], words, (num_words + 3) / 4 * sizeof(glm::uvec4));
+    }
+}
@@ -0,0 +1,280 @@
+#include "shader_jit.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+
+// set by CMake to the compiler and the sources of the build
+#ifndef GLSLC_EXECUTABLE
+#define GLSLC_EXECUTABLE "glslc"
+#endif
+#ifndef SHADER_SOURCE_DIR
+#define SHADER_SOURCE_DIR "shaders"
+#endif
+
+// part of the cache key, to bump when the generated code changes
+static const uint32_t JIT_VERSION = 2;
+
+// literal that reads back to the same float
+static void emit_float(std::string& out, float f) {
+    char buf[48];
+    if (!std::isfinite(f)) {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        snprintf(buf, sizeof(buf), "uintBitsToFloat(0x%08xu)", bits);
+    } else {
+        snprintf(buf, sizeof(buf), "%.9g", f);
+        if (!strpbrk(buf, ".e")) strcat(buf, ".0");
+    }
+    out += buf;
+}
+
+static void emit_vec(std::string& out, const float* v, int n) {
+    out += "vec" + std::to_string(n) + "(";
+    for (int i = 0; i < n; i++) {
+        if (i > 0) out += ", ";
+        emit_float(out, v[i]);
+    }
+    out += ")";
+}
+
+// the first 16 bytes are a union, the box stores its corner radii as the bits of data.w
+static void emit_primitive(std::string& out, const Primitive& prim) {
+    uint32_t data[4];
+    memcpy(data, &prim.sphere, sizeof(data));
+    char buf[160];
+    snprintf(buf, sizeof(buf), "Primitive(uintBitsToFloat(uvec4(0x%08xu, 0x%08xu, 0x%08xu, 0x%08xu)), ", data[0], data[1], data[2], data[3]);
+    out += buf;
+    emit_vec(out, &prim.m_row0.x, 4);
+    out += ", ";
+    emit_vec(out, &prim.m_row1.x, 4);
+    out += ", ";
+    emit_vec(out, &prim.m_row2.x, 4);
+    out += ", ";
+    emit_vec(out, &prim.extrude_rounding.x, 2);
+    snprintf(buf, sizeof(buf), ", %d, ", (int)prim.type);
+    out += buf;
+    emit_float(out, prim.bevel);
+    snprintf(buf, sizeof(buf), ", 0x%08xu, 0.0, 0.0, 0.0)", prim.color);
+    out += buf;
+}
+
+// same order as SceneConverter::convert, the generated indices are the GPU indices the pruning writes its state at
+static std::vector<int> postfix_order(const std::vector<CSGNode>& csg_nodes, int root_idx) {
+    std::vector<int> postfix;
+    std::vector<int> stack = { root_idx };
+    while (!stack.empty()) {
+        int current_idx = stack.back();
+        stack.pop_back();
+        postfix.push_back(current_idx);
+        if (csg_nodes[current_idx].type == NODETYPE_BINARY) {
+            stack.push_back(csg_nodes[current_idx].left);
+            stack.push_back(csg_nodes[current_idx].right);
+        }
+    }
+    std::reverse(postfix.begin(), postfix.end());
+    return postfix;
+}
+
+// The tree is unrolled twice: sdf_jit() is sdf() in eval.glsl, which ignores the node signs and negates the right
+// operand of a subtraction, and jit_first_level() is the first level of compute_pruning(), which applies the signs of
+// the active nodes instead. Every node is a local variable dN, N being its GPU index.
+std::string generate_jit_sdf(const std::vector<CSGNode>& csg_nodes, int root_idx) {
+    std::vector<int> postfix = postfix_order(csg_nodes, root_idx);
+    int num_nodes = (int)postfix.size();
+    std::vector<int> cpu_to_gpu(csg_nodes.size());
+    for (int gpu_idx = 0; gpu_idx < num_nodes; gpu_idx++) cpu_to_gpu[postfix[gpu_idx]] = gpu_idx;
+
+    std::string out;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "// generated by shader_jit.cpp for a tree of %d nodes\n\n", num_nodes);
+    out += buf;
+
+    for (int gpu_idx = 0; gpu_idx < num_nodes; gpu_idx++) {
+        const CSGNode& node = csg_nodes[postfix[gpu_idx]];
+        if (node.type != NODETYPE_PRIMITIVE) continue;
+        snprintf(buf, sizeof(buf), "#define JIT_PRIM_%d ", gpu_idx);
+        out += buf;
+        emit_primitive(out, node.primitive);
+        out += "\n";
+    }
+
+    out +=
+        "\n"
+        "float jit_op(uint word, float left_val, float right_val) {\n"
+        "    BinaryOp op = BinaryOp(word);\n"
+        "    float k = BinaryOp_blend_factor(op);\n"
+        "    float s = BinaryOp_sign(op);\n"
+        "    return s*(min(s*left_val, s*right_val) - kernel(abs(left_val-right_val), k));\n"
+        "}\n"
+        "\n"
+        "float sdf_jit(vec3 p) {\n";
+    for (int gpu_idx = 0; gpu_idx < num_nodes; gpu_idx++) {
+        const CSGNode& node = csg_nodes[postfix[gpu_idx]];
+        if (node.type == NODETYPE_PRIMITIVE) {
+            snprintf(buf, sizeof(buf), "    float d%d = eval_prim(p, JIT_PRIM_%d);\n", gpu_idx, gpu_idx);
+        } else {
+            uint32_t word = node.binary_op.blend_factor_and_sign;
+            bool sub = ((word >> 1) & 3) == OP_SUB;
+            snprintf(buf, sizeof(buf), "    float d%d = jit_op(0x%08xu, d%d, %sd%d);\n", gpu_idx, word, cpu_to_gpu[node.left], sub ? "-" : "", cpu_to_gpu[node.right]);
+        }
+        out += buf;
+    }
+    snprintf(buf, sizeof(buf), "    return d%d;\n}\n", num_nodes - 1);
+    out += buf;
+
+    out +=
+        "\n"
+        "#ifdef JIT_FIRST_LEVEL\n"
+        "void jit_state(int tmp_offset, int i, int state) {\n"
+        "    int at = tmp_offset + 32*i + int(gl_SubgroupInvocationID);\n"
+        "    tmp.tab[at] = Tmp(0);\n"
+        "    Tmp_state_write(tmp.tab[at], state);\n"
+        "}\n"
+        "\n"
+        "// node i is active, or skipped with its further operand inactive, like in compute_pruning()\n"
+        "float jit_prune_op(int tmp_offset, float R, int i, uint word, int left, float left_val, int right, float right_val) {\n"
+        "    BinaryOp op = BinaryOp(word);\n"
+        "    float k = BinaryOp_blend_factor(op);\n"
+        "    float s = BinaryOp_sign(op);\n"
+        "    if (abs(left_val - right_val) <= 2 * R + k) {\n"
+        "        jit_state(tmp_offset, i, 2);\n"
+        "    } else {\n"
+        "        jit_state(tmp_offset, i, 1);\n"
+        "        int inactive = s*left_val < s*right_val ? right : left;\n"
+        "        Tmp_state_write(tmp.tab[tmp_offset + 32*inactive + int(gl_SubgroupInvocationID)], 0);\n"
+        "    }\n"
+        "    return s*(min(s*left_val, s*right_val) - kernel(abs(left_val-right_val), k));\n"
+        "}\n"
+        "\n"
+        "float jit_first_level(vec3 p, float R, int tmp_offset) {\n";
+    for (int gpu_idx = 0; gpu_idx < num_nodes; gpu_idx++) {
+        const CSGNode& node = csg_nodes[postfix[gpu_idx]];
+        const char* sign = node.sign ? "" : "-";
+        if (node.type == NODETYPE_PRIMITIVE) {
+            snprintf(buf, sizeof(buf), "    float d%d = %seval_prim(p, JIT_PRIM_%d);\n    jit_state(tmp_offset, %d, 2);\n", gpu_idx, sign, gpu_idx, gpu_idx);
+        } else {
+            int left = cpu_to_gpu[node.left];
+            int right = cpu_to_gpu[node.right];
+            snprintf(buf, sizeof(buf), "    float d%d = %sjit_prune_op(tmp_offset, R, %d, 0x%08xu, %d, d%d, %d, d%d);\n", gpu_idx, sign, gpu_idx, node.binary_op.blend_factor_and_sign, left, left, right, right);
+        }
+        out += buf;
+    }
+    snprintf(buf, sizeof(buf), "    return d%d;\n}\n#endif\n", num_nodes - 1);
+    out += buf;
+    return out;
+}
+
+template <typename T>
+static void hash_value(uint64_t& key, const T& value) {
+    key = fnv1a(&value, sizeof(value), key);
+}
+
+// The fields of the reachable nodes that the generated code depends on, and the build's shaders that it is compiled
+// with. The padding of CSGNode and Primitive, and the nodes the root doesn't reach, don't change the key.
+static uint64_t jit_key(const std::vector<CSGNode>& csg_nodes, int root_idx) {
+    uint64_t key = fnv1a(&JIT_VERSION, sizeof(JIT_VERSION));
+    std::vector<int> postfix = postfix_order(csg_nodes, root_idx);
+    std::vector<int> cpu_to_gpu(csg_nodes.size());
+    for (int gpu_idx = 0; gpu_idx < (int)postfix.size(); gpu_idx++) cpu_to_gpu[postfix[gpu_idx]] = gpu_idx;
+    for (int cpu_idx : postfix) {
+        const CSGNode& node = csg_nodes[cpu_idx];
+        hash_value(key, (int)node.type);
+        hash_value(key, (uint8_t)node.sign);
+        if (node.type == NODETYPE_PRIMITIVE) {
+            const Primitive& prim = node.primitive;
+            uint32_t data[4];
+            memcpy(data, &prim.sphere, sizeof(data));
+            hash_value(key, data);
+            hash_value(key, prim.m_row0);
+            hash_value(key, prim.m_row1);
+            hash_value(key, prim.m_row2);
+            hash_value(key, prim.extrude_rounding);
+            hash_value(key, (int)prim.type);
+            hash_value(key, prim.bevel);
+            hash_value(key, prim.color);
+        } else {
+            hash_value(key, node.binary_op.blend_factor_and_sign);
+            hash_value(key, cpu_to_gpu[node.left]);
+            hash_value(key, cpu_to_gpu[node.right]);
+        }
+    }
+    for (const char* name : { "frag.spv", "culling.comp.spv" }) {
+        std::vector<char> code = readFile(name);
+        key = fnv1a(code.data(), code.size(), key);
+    }
+    return key;
+}
+
+// runs the program with the arguments as they are and waits for it, there is no shell to interpret the paths
+static bool run_process(const std::vector<std::string>& args) {
+#ifdef _WIN32
+    // the CRT joins the arguments with spaces, so each one is quoted and can't hold a quote itself
+    std::vector<std::string> quoted;
+    for (const std::string& arg : args) {
+        if (arg.find('"') != std::string::npos) return false;
+        quoted.push_back("\"" + arg + "\"");
+    }
+    std::vector<const char*> argv;
+    for (const std::string& arg : quoted) argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
+    return _spawnvp(_P_WAIT, args[0].c_str(), argv.data()) == 0;
+#else
+    std::vector<char*> argv;
+    for (const std::string& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) return false;
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+// compiles to a temporary file that is renamed once complete, an interrupted compilation then leaves no cache entry
+static bool run_glslc(const char* stage, const char* src, const std::string& dir, const char* bin) {
+    std::string tmp_path = dir + "/" + bin + ".tmp";
+    if (!run_process({ GLSLC_EXECUTABLE, std::string("-fshader-stage=") + stage, "--target-spv=spv1.4", "-DJIT_SDF",
+            "-I", dir, std::string(SHADER_SOURCE_DIR) + "/" + src, "-o", tmp_path })) {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, dir + "/" + bin, ec);
+    return !ec;
+}
+
+std::string compile_jit_shaders(const RenderData& data, const std::vector<CSGNode>& csg_nodes, int root_idx) {
+    if (data.jit_cache_dir.empty() || csg_nodes.empty() || (int)csg_nodes.size() > JIT_MAX_NODES) return "";
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)jit_key(csg_nodes, root_idx));
+    std::string dir = data.jit_cache_dir + "/" + name;
+    if (std::filesystem::exists(dir + "/frag.spv") && std::filesystem::exists(dir + "/culling.comp.spv")) return dir;
+
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    std::ofstream file(dir + "/jit_sdf.glsl", std::ios::trunc);
+    file << generate_jit_sdf(csg_nodes, root_idx);
+    file.close();
+    if (!file) {
+        fprintf(stderr, "failed to write %s/jit_sdf.glsl\n", dir.c_str());
+        return "";
+    }
+
+    if (!run_glslc("frag", "simple.frag.glsl", dir, "frag.spv") || !run_glslc("comp", "culling.comp.glsl", dir, "culling.comp.spv")) {
+        fprintf(stderr, "failed to compile the scene-specific shaders in %s\n", dir.c_str());
+        return "";
+    }
+    return dir;
+}
@@ -0,0 +1,456 @@
+#include "tree.h"
+#include "context.h"
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+enum NodeState {
+    NODESTATE_GENERAL,
+    NODESTATE_EMPTY, // the node's shape does not reach the clip region
+    NODESTATE_FULL,  // the node's shape covers the whole clip region
+};
+
+static bool bounds_empty(const Bounds& b) {
+    return b.min.x > b.max.x || b.min.y > b.max.y || b.min.z > b.max.z;
+}
+
+static Bounds bounds_intersect(const Bounds& a, const Bounds& b) {
+    return { glm::max(a.min, b.min), glm::min(a.max, b.max) };
+}
+
+static Bounds bounds_merge(const Bounds& a, const Bounds& b) {
+    if (bounds_empty(a)) return b;
+    if (bounds_empty(b)) return a;
+    return { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+}
+
+static Bounds bounds_expand(const Bounds& b, float margin) {
+    return { b.min - margin, b.max + margin };
+}
+
+static glm::mat4 world_to_prim(const Primitive& prim) {
+    return glm::transpose(glm::mat4(prim.m_row0, prim.m_row1, prim.m_row2, glm::vec4(0,0,0,1)));
+}
+
+// bounding box in primitive space, see eval_prim in common.glsl
+static Bounds prim_local_bounds(const Primitive& prim) {
+    glm::vec3 e;
+    switch (prim.type) {
+        case PRIMITIVE_SPHERE:
+            e = glm::vec3(prim.sphere.radius.x);
+            break;
+        case PRIMITIVE_BOX:
+            e = glm::vec3(prim.box.sizes) * 0.5f;
+            break;
+        case PRIMITIVE_CYLINDER:
+            e = glm::vec3(prim.cylinder.radius, prim.cylinder.height * 0.5f, prim.cylinder.radius);
+            break;
+        case PRIMITIVE_CONE:
+            e = glm::vec3(prim.cone.radius, prim.cone.height * 0.5f, prim.cone.radius);
+            break;
+        default:
+            // unknown primitives evaluate to 1e20 on the GPU
+            return { glm::vec3(1), glm::vec3(-1) };
+    }
+    return { -e, e };
+}
+
+static Bounds prim_bounds(const Primitive& prim) {
+    Bounds local = prim_local_bounds(prim);
+    // zero-sized primitives have no interior
+    if (!(local.max.x > 0 && local.max.y > 0 && local.max.z > 0)) {
+        return { glm::vec3(1), glm::vec3(-1) };
+    }
+
+    glm::mat4 prim_to_world = glm::inverse(world_to_prim(prim));
+    Bounds b = { glm::vec3(INFINITY), glm::vec3(-INFINITY) };
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 c = glm::vec3((i & 1) ? local.max.x : local.min.x, (i & 2) ? local.max.y : local.min.y, (i & 4) ? local.max.z : local.min.z);
+        glm::vec3 w = glm::vec3(prim_to_world * glm::vec4(c, 1));
+        b.min = glm::min(b.min, w);
+        b.max = glm::max(b.max, w);
+    }
+    return b;
+}
+
+// conservative point containment in primitive space
+static bool prim_contains(const Primitive& prim, glm::vec3 p) {
+    switch (prim.type) {
+        case PRIMITIVE_SPHERE:
+            return glm::length(p) < prim.sphere.radius.x;
+        case PRIMITIVE_BOX:
+        {
+            glm::vec3 half_sides = glm::vec3(prim.box.sizes) * 0.5f;
+            float scale = std::max(half_sides.x, half_sides.z) * 2;
+            uint32_t corner_data;
+            memcpy(&corner_data, &prim.box.sizes.w, sizeof(uint32_t));
+            uint32_t max_corner = 0;
+            for (int i = 0; i < 4; i++) {
+                max_corner = std::max(max_corner, (corner_data >> (8 * i)) & 0xff);
+            }
+            float corner_rounding = (float)max_corner * scale / 255.f / 2;
+            float er = std::max(prim.extrude_rounding.x, prim.extrude_rounding.y);
+            // inside the rounded profile shrunk by the extrusion rounding, and within the extrusion height
+            return std::abs(p.x) < half_sides.x - corner_rounding - er
+                && std::abs(p.z) < half_sides.z - corner_rounding - er
+                && std::abs(p.y) < half_sides.y;
+        }
+        case PRIMITIVE_CYLINDER:
+            return glm::length(glm::vec2(p.x, p.z)) < prim.cylinder.radius && std::abs(p.y) < prim.cylinder.height * 0.5f;
+        case PRIMITIVE_CONE:
+        {
+            float h = prim.cone.height * 0.5f;
+            if (std::abs(p.y) >= h) return false;
+            return glm::length(glm::vec2(p.x, p.z)) < prim.cone.radius * (h - p.y) / (2 * h);
+        }
+        default:
+            return false;
+    }
+}
+
+// all primitives are convex, so containing the corners of a box means containing the box
+static bool prim_contains_box(const Primitive& prim, const Bounds& b) {
+    glm::mat4 m = world_to_prim(prim);
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 c = glm::vec3((i & 1) ? b.max.x : b.min.x, (i & 2) ? b.max.y : b.min.y, (i & 4) ? b.max.z : b.min.z);
+        if (!prim_contains(prim, glm::vec3(m * glm::vec4(c, 1)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int simplify_tree(std::vector<CSGNode>& nodes, int root_idx, glm::vec3 aabb_min, glm::vec3 aabb_max) {
+    // smooth operators only blend children that are closer than the blend factor,
+    // so everything is decided against the clip region grown by twice the largest one
+    float margin = 0;
+    for (const CSGNode& node : nodes) {
+        if (node.type == NODETYPE_BINARY) {
+            uint32_t k_uint = node.binary_op.blend_factor_and_sign & ~7u;
+            float k;
+            memcpy(&k, &k_uint, sizeof(float));
+            margin = std::max(margin, 2 * k);
+        }
+    }
+    Bounds clip = bounds_expand({ aabb_min, aabb_max }, margin);
+
+    std::vector<int> stack = { root_idx };
+    std::vector<int> preorder;
+    while (!stack.empty()) {
+        int current_idx = stack.back();
+        stack.pop_back();
+
+        preorder.push_back(current_idx);
+        if (nodes[current_idx].type == NODETYPE_BINARY) {
+            stack.push_back(nodes[current_idx].left);
+            stack.push_back(nodes[current_idx].right);
+        }
+    }
+
+    std::vector<Bounds> bounds(nodes.size());
+    std::vector<NodeState> state(nodes.size());
+    // node that takes the place of each node in the simplified tree
+    std::vector<int> replacement(nodes.size());
+
+    for (int i = (int)preorder.size() - 1; i >= 0; i--) {
+        int idx = preorder[i];
+        const CSGNode& node = nodes[idx];
+        replacement[idx] = idx;
+
+        if (node.type == NODETYPE_PRIMITIVE) {
+            bounds[idx] = prim_bounds(node.primitive);
+            if (bounds_empty(bounds_intersect(bounds[idx], clip))) {
+                state[idx] = NODESTATE_EMPTY;
+            } else if (prim_contains_box(node.primitive, clip)) {
+                state[idx] = NODESTATE_FULL;
+            } else {
+                state[idx] = NODESTATE_GENERAL;
+            }
+            continue;
+        }
+
+        int l = node.left;
+        int r = node.right;
+        const Bounds& bl = bounds[l];
+        const Bounds& br = bounds[r];
+        bool disjoint = bounds_empty(bounds_intersect(bounds_expand(bl, margin), br));
+        uint32_t op = (node.binary_op.blend_factor_and_sign >> 1) & 3u;
+
+        // promoting a child keeps the child's state and bounds
+        auto promote = [&](int child) {
+            replacement[idx] = replacement[child];
+            state[idx] = state[child];
+            bounds[idx] = bounds[child];
+        };
+        auto make_empty = [&]() {
+            state[idx] = NODESTATE_EMPTY;
+            bounds[idx] = { glm::vec3(1), glm::vec3(-1) };
+        };
+
+        state[idx] = NODESTATE_GENERAL;
+        if (op == OP_UNION) {
+            if (state[l] == NODESTATE_EMPTY) promote(r);
+            else if (state[r] == NODESTATE_EMPTY) promote(l);
+            else if (state[l] == NODESTATE_FULL) promote(l);
+            else if (state[r] == NODESTATE_FULL) promote(r);
+            else bounds[idx] = bounds_merge(bl, br);
+        } else if (op == OP_INTER) {
+            if (state[l] == NODESTATE_EMPTY || state[r] == NODESTATE_EMPTY || disjoint) make_empty();
+            else if (state[l] == NODESTATE_FULL) promote(r);
+            else if (state[r] == NODESTATE_FULL) promote(l);
+            else bounds[idx] = bounds_intersect(bl, br);
+        } else if (op == OP_SUB) {
+            if (state[l] == NODESTATE_EMPTY || state[r] == NODESTATE_FULL) make_empty();
+            else if (state[r] == NODESTATE_EMPTY || disjoint) promote(l);
+            else bounds[idx] = bl;
+        }
+
+        if (state[idx] == NODESTATE_GENERAL && bounds_empty(bounds_intersect(bounds[idx], clip))) {
+            make_empty();
+        }
+    }
+
+    if (state[root_idx] != NODESTATE_GENERAL) {
+        // an empty or solid scene cannot be expressed with fewer nodes, keep it as authored
+        return root_idx;
+    }
+
+    // Rebuild the reachable part of the tree in preorder, like load_json does.
+    // A promoted node takes the sign of the slot it moves into: only subtrahends are negated.
+    std::vector<CSGNode> out;
+    out.reserve(nodes.size());
+    struct StackEntry {
+        int old_idx;
+        int new_idx;
+        bool sign;
+    };
+    std::vector<StackEntry> rebuild_stack = { { replacement[root_idx], 0, nodes[root_idx].sign } };
+    out.push_back({});
+    while (!rebuild_stack.empty()) {
+        StackEntry e = rebuild_stack.back();
+        rebuild_stack.pop_back();
+
+        const CSGNode& node = nodes[e.old_idx];
+        out[e.new_idx] = node;
+        out[e.new_idx].sign = e.sign;
+        if (node.type == NODETYPE_BINARY) {
+            int left_idx = (int)out.size();
+            out.push_back({});
+            int right_idx = (int)out.size();
+            out.push_back({});
+            out[e.new_idx].left = left_idx;
+            out[e.new_idx].right = right_idx;
+            rebuild_stack.push_back({ replacement[node.left], left_idx, nodes[node.left].sign });
+            rebuild_stack.push_back({ replacement[node.right], right_idx, nodes[node.right].sign });
+        }
+    }
+
+    nodes = std::move(out);
+    return 0;
+}
+
+static bool is_hard_op(const CSGNode& node, uint32_t op) {
+    if (node.type != NODETYPE_BINARY) return false;
+    return ((node.binary_op.blend_factor_and_sign >> 1) & 3u) == op && (node.binary_op.blend_factor_and_sign & ~7u) == 0;
+}
+
+int reorder_tree(std::vector<CSGNode>& nodes, int root_idx) {
+    std::vector<int> stack = { root_idx };
+    std::vector<int> preorder;
+    std::vector<int> parent(nodes.size(), -1);
+    while (!stack.empty()) {
+        int current_idx = stack.back();
+        stack.pop_back();
+
+        preorder.push_back(current_idx);
+        if (nodes[current_idx].type == NODETYPE_BINARY) {
+            parent[nodes[current_idx].left] = current_idx;
+            parent[nodes[current_idx].right] = current_idx;
+            stack.push_back(nodes[current_idx].left);
+            stack.push_back(nodes[current_idx].right);
+        }
+    }
+
+    // number of stack entries needed to evaluate each subtree, the left child is evaluated first
+    std::vector<int> need(nodes.size(), 0);
+    std::vector<int> cluster_nodes;
+    std::vector<int> cluster_leaves;
+    for (int i = (int)preorder.size() - 1; i >= 0; i--) {
+        int idx = preorder[i];
+        CSGNode& node = nodes[idx];
+        if (node.type == NODETYPE_PRIMITIVE) {
+            need[idx] = 1;
+            continue;
+        }
+
+        uint32_t op = (node.binary_op.blend_factor_and_sign >> 1) & 3u;
+        bool hard = op != OP_SUB && (node.binary_op.blend_factor_and_sign & ~7u) == 0;
+        if (hard && parent[idx] >= 0 && is_hard_op(nodes[parent[idx]], op)) {
+            // inner node of a cluster, rebuilt when its top node is reached
+            continue;
+        }
+
+        if (hard) {
+            // min and max are associative, so a cluster of hard unions (or intersections) can be rebuilt
+            // as a left-deep chain with its operands sorted by decreasing need
+            cluster_nodes.clear();
+            cluster_leaves.clear();
+            stack = { idx };
+            while (!stack.empty()) {
+                int current_idx = stack.back();
+                stack.pop_back();
+                if (is_hard_op(nodes[current_idx], op)) {
+                    cluster_nodes.push_back(current_idx);
+                    stack.push_back(nodes[current_idx].left);
+                    stack.push_back(nodes[current_idx].right);
+                } else {
+                    cluster_leaves.push_back(current_idx);
+                }
+            }
+            std::stable_sort(cluster_leaves.begin(), cluster_leaves.end(), [&](int a, int b) { return need[a] > need[b]; });
+
+            // the top node keeps its index so that its parent and sign stay valid
+            int acc = cluster_leaves[0];
+            for (size_t j = 1; j < cluster_leaves.size(); j++) {
+                int node_idx = (j == cluster_leaves.size() - 1) ? idx : cluster_nodes[j];
+                nodes[node_idx].left = acc;
+                nodes[node_idx].right = cluster_leaves[j];
+                need[node_idx] = std::max(need[acc], need[cluster_leaves[j]] + 1);
+                acc = node_idx;
+            }
+            continue;
+        }
+
+        // Sethi-Ullman: evaluate the subtree that needs more stack first, subtraction isn't commutative
+        if (op != OP_SUB && need[node.right] > need[node.left]) {
+            std::swap(node.left, node.right);
+        }
+        need[idx] = std::max(need[node.left], need[node.right] + 1);
+    }
+
+    return need[root_idx];
+}
+
+int tree_stack_depth(const std::vector<CSGNode>& nodes, int root_idx) {
+    std::vector<int> stack = { root_idx };
+    std::vector<int> preorder;
+    while (!stack.empty()) {
+        int current_idx = stack.back();
+        stack.pop_back();
+
+        preorder.push_back(current_idx);
+        if (nodes[current_idx].type == NODETYPE_BINARY) {
+            stack.push_back(nodes[current_idx].left);
+            stack.push_back(nodes[current_idx].right);
+        }
+    }
+
+    std::vector<int> need(nodes.size(), 0);
+    for (int i = (int)preorder.size() - 1; i >= 0; i--) {
+        int idx = preorder[i];
+        const CSGNode& node = nodes[idx];
+        if (node.type == NODETYPE_PRIMITIVE) {
+            need[idx] = 1;
+        } else {
+            need[idx] = std::max(need[node.left], need[node.right] + 1);
+        }
+    }
+    return need[root_idx];
+}
+
+int tree_prim_types(const std::vector<CSGNode>& nodes) {
+    int prim_types = 0;
+    for (const CSGNode& node : nodes) {
+        if (node.type == NODETYPE_PRIMITIVE) prim_types |= 1 << node.primitive.type;
+    }
+    return prim_types;
+}
+
+// get_node(i) returns the primitive or the binary op of node i in postfix order, the other one is null
+template<typename GetNode>
+static void build_skip_records_impl(int num_nodes, GetNode get_node, SkipRecord* records, SkipRecordScratch& scratch) {
+    std::vector<Bounds>& bounds = scratch.bounds;
+    std::vector<float>& lipschitz = scratch.lipschitz;
+    std::vector<float>& slack = scratch.slack;
+    std::vector<int>& size = scratch.size;
+    bounds.resize(num_nodes);
+    lipschitz.resize(num_nodes);
+    slack.resize(num_nodes);
+    size.resize(num_nodes);
+
+    std::fill(records, records + num_nodes, SkipRecord{ .end = -1 });
+
+    // children come before their parent in postfix order, the right child directly precedes it
+    for (int i = 0; i < num_nodes; i++) {
+        auto [prim_ptr, binary_op] = get_node(i);
+        if (prim_ptr) {
+            const Primitive& prim = *prim_ptr;
+            size[i] = 1;
+            bounds[i] = prim_bounds(prim);
+            slack[i] = 0;
+            if (bounds_empty(bounds[i])) {
+                // degenerate primitive, no useful bound
+                bounds[i] = { glm::vec3(0), glm::vec3(0) };
+                lipschitz[i] = 0;
+            } else {
+                // eval_prim measures distances in primitive space, which shrinks world distances
+                // by at most the smallest singular value of the matrix, bounded below by 1/|M^-1|_F
+                glm::mat3 m_inv = glm::inverse(glm::mat3(world_to_prim(prim)));
+                float frobenius = std::sqrt(glm::dot(m_inv[0], m_inv[0]) + glm::dot(m_inv[1], m_inv[1]) + glm::dot(m_inv[2], m_inv[2]));
+                lipschitz[i] = 1.f / frobenius;
+            }
+            continue;
+        }
+
+        int r = i - 1;
+        int l = r - size[r];
+        size[i] = size[l] + size[r] + 1;
+
+        uint32_t k_uint = binary_op->blend_factor_and_sign & ~7u;
+        float k;
+        memcpy(&k, &k_uint, sizeof(float));
+        uint32_t op = (binary_op->blend_factor_and_sign >> 1) & 3u;
+
+        if (op == OP_UNION) {
+            // the smooth union is at most k/4 below the min of its children
+            bounds[i] = bounds_merge(bounds[l], bounds[r]);
+            lipschitz[i] = std::min(lipschitz[l], lipschitz[r]);
+            slack[i] = std::max(slack[l], slack[r]) + k * 0.25f;
+
+            // a record costs about as much to read as a primitive to evaluate, so a single primitive gets none.
+            // After reorder_tree, the right operands of the union chains are mostly primitives: the records then only
+            // cover the smooth unions and the intersections in them, and the first level stays linear in the tree size
+            if (size[r] > 1) {
+                int start = r - size[r] + 1;
+                records[start] = SkipRecord {
+                        .bbox_min = glm::vec4(bounds[r].min, lipschitz[r]),
+                        .bbox_max = glm::vec4(bounds[r].max, slack[r]),
+                        .end = r
+                };
+            }
+        } else {
+            // intersections and subtractions are never below their left child
+            bounds[i] = bounds[l];
+            lipschitz[i] = lipschitz[l];
+            slack[i] = slack[l];
+        }
+    }
+}
+
+void build_skip_records(const std::vector<GPUNode>& gpu_nodes, const std::vector<Primitive>& primitives, const std::vector<BinaryOp>& binary_ops, std::vector<SkipRecord>& records) {
+    SkipRecordScratch scratch;
+    records.resize(gpu_nodes.size());
+    build_skip_records_impl((int)gpu_nodes.size(), [&](int i) {
+        const GPUNode& node = gpu_nodes[i];
+        if (node.type == NODETYPE_PRIMITIVE) return std::pair<const Primitive*, const BinaryOp*>(&primitives[node.idx_in_type], nullptr);
+        return std::pair<const Primitive*, const BinaryOp*>(nullptr, &binary_ops[node.idx_in_type]);
+    }, records.data(), scratch);
+}
+
+void build_skip_records(const std::vector<CSGNode>& csg_nodes, const int* postfix, int num_nodes, SkipRecord* records, SkipRecordScratch& scratch) {
+    build_skip_records_impl(num_nodes, [&](int i) {
+        const CSGNode& node = csg_nodes[postfix[i]];
+        if (node.type == NODETYPE_PRIMITIVE) return std::pair<const Primitive*, const BinaryOp*>(&node.primitive, nullptr);
+        return std::pair<const Primitive*, const BinaryOp*>(nullptr, &node.binary_op);
+    }, records, scratch);
+}
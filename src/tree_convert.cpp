@@ -0,0 +1,150 @@
+#include "tree_convert.h"
+#include "context.h"
+
+struct TreeConvertPushConstants {
+    uint64_t csg_nodes_ref;
+    uint64_t csg_words_ref;
+    uint64_t links_ref;
+    uint64_t next_in_ref;
+    uint64_t next_out_ref;
+    uint64_t rank_in_ref;
+    uint64_t rank_out_ref;
+    uint64_t nodes_ref;
+    uint64_t prims_ref;
+    uint64_t binary_ops_ref;
+    uint64_t parents_ref;
+    uint64_t active_nodes_ref;
+    int num_nodes;
+    int root_idx;
+    int pass;
+};
+
+void create_tree_convert_pipeline(Init& init, RenderData& render_data) {
+    render_data.tree_convert_pipeline = create_compute_pipeline(init, "tree_convert.comp.spv", "tree_convert.comp.glsl", sizeof(TreeConvertPushConstants));
+}
+
+// the scratch buffers only grow, so that streaming edits of a tree don't reallocate them
+static void reserve_tree_convert_buffers(Init& init, RenderData& data, int num_nodes) {
+    if (num_nodes <= data.tree_convert_capacity) return;
+    if (data.tree_convert_capacity > 0) {
+        vmaDestroyBuffer(data.alloc, data.csg_nodes_buffer.buf, data.csg_nodes_buffer.alloc);
+        vmaDestroyBuffer(data.alloc, data.tree_links_buffer.buf, data.tree_links_buffer.alloc);
+        for (int i = 0; i < 2; i++) {
+            vmaDestroyBuffer(data.alloc, data.tour_next_buffer[i].buf, data.tour_next_buffer[i].alloc);
+            vmaDestroyBuffer(data.alloc, data.tour_rank_buffer[i].buf, data.tour_rank_buffer[i].alloc);
+        }
+    }
+    VkBufferUsageFlags buffer_usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    data.csg_nodes_buffer = create_buffer(init, data, num_nodes * sizeof(CSGNode), buffer_usage, "csg_nodes_buffer");
+    data.tree_links_buffer = create_buffer(init, data, num_nodes * sizeof(int), buffer_usage, "tree_links_buffer");
+    for (int i = 0; i < 2; i++) {
+        data.tour_next_buffer[i] = create_buffer(init, data, 2 * num_nodes * sizeof(int), buffer_usage, "tour_next_buffer");
+        data.tour_rank_buffer[i] = create_buffer(init, data, 2 * num_nodes * sizeof(glm::ivec2), buffer_usage, "tour_rank_buffer");
+    }
+    data.tree_convert_capacity = num_nodes;
+}
+
+void convert_tree_gpu(Init& init, RenderData& data, const std::vector<CSGNode>& csg_nodes, int root_idx) {
+    int num_nodes = (int)csg_nodes.size();
+    reserve_tree_convert_buffers(init, data, num_nodes);
+
+    VK_CHECK(vkDeviceWaitIdle(init.device));
+    TransferToBuffer(data.alloc, data.staging_buffer, csg_nodes.data(), num_nodes * sizeof(CSGNode));
+
+    VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+            .pInheritanceInfo = nullptr
+    };
+    VkCommandBuffer cmd_buf = data.command_buffers[0];
+    VK_CHECK(vkBeginCommandBuffer(cmd_buf, &begin_info));
+
+    VkBufferCopy copy = {
+            .srcOffset = 0,
+            .dstOffset = 0,
+            .size = num_nodes * sizeof(CSGNode)
+    };
+    vkCmdCopyBuffer(cmd_buf, data.staging_buffer.buf, data.csg_nodes_buffer.buf, 1, &copy);
+    // -1: the root has no parent link, and no skip record starts anywhere
+    vkCmdFillBuffer(cmd_buf, data.tree_links_buffer.buf, 0, num_nodes * sizeof(int), 0xffffffff);
+    vkCmdFillBuffer(cmd_buf, data.skip_records_buffer.buf, 0, num_nodes * sizeof(SkipRecord), 0xffffffff);
+    pipeline_barrier(cmd_buf, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT);
+
+    TreeConvertPushConstants push_constants = {
+            .csg_nodes_ref = data.csg_nodes_buffer.address,
+            .csg_words_ref = data.csg_nodes_buffer.address,
+            .links_ref = data.tree_links_buffer.address,
+            .next_in_ref = data.tour_next_buffer[1].address,
+            .next_out_ref = data.tour_next_buffer[0].address,
+            .rank_in_ref = data.tour_rank_buffer[1].address,
+            .rank_out_ref = data.tour_rank_buffer[0].address,
+            .nodes_ref = data.nodes_buffer.address,
+            .prims_ref = data.prims_buffer.address,
+            .binary_ops_ref = data.binary_ops_buffer.address,
+            .parents_ref = data.parents_init_buffer.address,
+            .active_nodes_ref = data.active_nodes_init_buffer.address,
+            .num_nodes = num_nodes,
+            .root_idx = root_idx,
+            .pass = TREE_CONVERT_PASS_LINKS
+    };
+    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, data.tree_convert_pipeline.pipe);
+    auto dispatch = [&](int pass, int num_items) {
+        push_constants.pass = pass;
+        vkCmdPushConstants(cmd_buf, data.tree_convert_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(TreeConvertPushConstants), &push_constants);
+        vkCmdDispatch(cmd_buf, (uint32_t)((num_items + 63) / 64), 1, 1);
+        pipeline_barrier(cmd_buf, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT);
+    };
+
+    dispatch(TREE_CONVERT_PASS_LINKS, num_nodes);
+    // the tour is written to set 0, then every pointer jumping pass doubles the length of the ranked sublists
+    dispatch(TREE_CONVERT_PASS_TOUR, 2 * num_nodes);
+    int set = 0;
+    for (int length = 1; length < 2 * num_nodes; length *= 2) {
+        push_constants.next_in_ref = data.tour_next_buffer[set].address;
+        push_constants.rank_in_ref = data.tour_rank_buffer[set].address;
+        push_constants.next_out_ref = data.tour_next_buffer[1 - set].address;
+        push_constants.rank_out_ref = data.tour_rank_buffer[1 - set].address;
+        dispatch(TREE_CONVERT_PASS_RANK, 2 * num_nodes);
+        set = 1 - set;
+    }
+    push_constants.next_in_ref = data.tour_next_buffer[set].address;
+    push_constants.rank_in_ref = data.tour_rank_buffer[set].address;
+    dispatch(TREE_CONVERT_PASS_SCATTER, num_nodes);
+
+    VK_CHECK(vkEndCommandBuffer(cmd_buf));
+
+    VkCommandBufferSubmitInfo cmd_buf_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .pNext = nullptr,
+            .commandBuffer = cmd_buf,
+            .deviceMask = 0
+    };
+    VkSubmitInfo2 submit_info = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+            .pNext = nullptr,
+            .flags = 0,
+            .waitSemaphoreInfoCount = 0,
+            .pWaitSemaphoreInfos = nullptr,
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = &cmd_buf_info,
+            .signalSemaphoreInfoCount = 0,
+            .pSignalSemaphoreInfos = nullptr
+    };
+    VK_CHECK(vkQueueSubmit2(data.graphics_queue, 1, &submit_info, VK_NULL_HANDLE));
+    VK_CHECK(vkDeviceWaitIdle(init.device));
+
+    data.prim_node_indices.clear();
+    // keys the pruning cache: the CSG array describes the tree as well as the converted one
+    uint64_t tree_hash = fnv1a(csg_nodes.data(), csg_nodes.size() * sizeof(CSGNode));
+    data.tree_hash = fnv1a(&root_idx, sizeof(root_idx), tree_hash);
+    data.tree = {
+            .nodes = data.nodes_buffer.address,
+            .binary_ops = data.binary_ops_buffer.address,
+            .prims = data.prims_buffer.address,
+            .parents_init = data.parents_init_buffer.address,
+            .active_nodes_init = data.active_nodes_init_buffer.address,
+            .skip_records = data.skip_records_buffer.address
+    };
+    data.anim_frame = -1;
+}
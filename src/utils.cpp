@@ -1,4 +1,6 @@
 #include "utils.h"
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
 
 std::string spv_dir;
@@ -6,8 +8,8 @@ std::string spv_dir;
 int MAX_ACTIVE_COUNT = 100 * 1000 * 1000;
 int MAX_TMP_COUNT = 400 * 1000 * 1000;
 
-std::vector<char> readFile(const std::string& filename) {
-    std::ifstream file(spv_dir + "/" + filename, std::ios::ate | std::ios::binary);
+std::vector<char> readFile(const std::string& filename, const std::string& dir) {
+    std::ifstream file(dir + "/" + filename, std::ios::ate | std::ios::binary);
 
     if (!file.is_open()) {
         fprintf(stderr, "failed to open file %s\n", filename.c_str());
@@ -48,6 +50,11 @@ VkShaderModule createShaderModule(Init& init, const std::vector<char>& code, con
 }
 
 void TransferToBuffer(const VmaAllocator& alloc, const Buffer& buffer, const void* data, int size) {
+    if (buffer.mapped) {
+        memcpy(buffer.mapped, data, size);
+        VK_CHECK(vmaFlushAllocation(alloc, buffer.alloc, 0, size));
+        return;
+    }
     void* ptr;
     VK_CHECK(vmaMapMemory(alloc, buffer.alloc, (void**)&ptr));
     memcpy(ptr, data, size);
@@ -55,12 +62,36 @@ void TransferToBuffer(const VmaAllocator& alloc, const Buffer& buffer, const voi
 }
 
 void TransferFromBuffer(const VmaAllocator& alloc, const Buffer& buffer, void* data, int size) {
+    if (buffer.mapped) {
+        VK_CHECK(vmaInvalidateAllocation(alloc, buffer.alloc, 0, size));
+        memcpy(data, buffer.mapped, size);
+        return;
+    }
     void* ptr;
     VK_CHECK(vmaMapMemory(alloc, buffer.alloc, (void**)&ptr));
     memcpy(data, ptr, size);
     vmaUnmapMemory(alloc, buffer.alloc);
 }
 
+void UploadToBuffer(const RenderData& render_data, const Init& init, const Buffer& dst, const void* src, size_t size) {
+    for (size_t offset = 0; offset < size; offset += STAGING_BUFFER_SIZE) {
+        int chunk = (int)std::min(size - offset, (size_t)STAGING_BUFFER_SIZE);
+        TransferToBuffer(render_data.alloc, render_data.staging_buffer, (const char*)src + offset, chunk);
+        // the offset can exceed CopyBuffer's int range, e.g. in the animation arena
+        VkBufferCopy copy = { .srcOffset = 0, .dstOffset = offset, .size = (VkDeviceSize)chunk };
+        CopyBufferRegions(render_data, init, render_data.staging_buffer, 1, &dst, &copy);
+    }
+}
+
+void DownloadFromBuffer(const RenderData& render_data, const Init& init, const Buffer& src, void* dst, size_t size) {
+    for (size_t offset = 0; offset < size; offset += STAGING_BUFFER_SIZE) {
+        int chunk = (int)std::min(size - offset, (size_t)STAGING_BUFFER_SIZE);
+        VkBufferCopy copy = { .srcOffset = offset, .dstOffset = 0, .size = (VkDeviceSize)chunk };
+        CopyBufferRegions(render_data, init, src, 1, &render_data.staging_buffer, &copy);
+        TransferFromBuffer(render_data.alloc, render_data.staging_buffer, (char*)dst + offset, chunk);
+    }
+}
+
 void CopyImageToBuffer(const RenderData& render_data, const Init& init, VkImage src, const Buffer& dst, int width, int height) {
     VK_CHECK(vkDeviceWaitIdle(init.device));
     VkCommandBufferBeginInfo begin_info = {
@@ -146,7 +177,16 @@ void CopyImageToBuffer(const RenderData& render_data, const Init& init, VkImage
 
 }
 
-void CopyBuffer(const RenderData& render_data, const Init& init, const Buffer& src, const Buffer& dst, int size) {
+void CopyBuffer(const RenderData& render_data, const Init& init, const Buffer& src, const Buffer& dst, int size, int src_offset, int dst_offset) {
+    VkBufferCopy copy = {
+            .srcOffset = (VkDeviceSize)src_offset,
+            .dstOffset = (VkDeviceSize)dst_offset,
+            .size = (VkDeviceSize)size
+    };
+    CopyBufferRegions(render_data, init, src, 1, &dst, &copy);
+}
+
+void CopyBufferRegions(const RenderData& render_data, const Init& init, const Buffer& src, int num_regions, const Buffer* dsts, const VkBufferCopy* regions) {
     VK_CHECK(vkDeviceWaitIdle(init.device));
     VkCommandBufferBeginInfo begin_info = {
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
@@ -157,12 +197,9 @@ void CopyBuffer(const RenderData& render_data, const Init& init, const Buffer& s
     VkCommandBuffer cmd_buf = render_data.command_buffers[0];
     VK_CHECK(vkBeginCommandBuffer(cmd_buf, &begin_info));
 
-    VkBufferCopy copy = {
-            .srcOffset = 0,
-            .dstOffset = 0,
-            .size = (VkDeviceSize)size
-    };
-    vkCmdCopyBuffer(cmd_buf, src.buf, dst.buf, 1, &copy);
+    for (int i = 0; i < num_regions; i++) {
+        if (regions[i].size > 0) vkCmdCopyBuffer(cmd_buf, src.buf, dsts[i].buf, 1, &regions[i]);
+    }
 
     vkEndCommandBuffer(cmd_buf);
 
@@ -198,7 +235,7 @@ uint64_t GetBufferAddress(const Init& init, const Buffer& buffer) {
     return vkGetBufferDeviceAddress(init.device, &address_info);
 }
 
-Pipeline create_compute_pipeline(Init& init, const char* shader_path, const char* shader_name, unsigned int push_constant_size) {
+Pipeline create_compute_pipeline(Init& init, const char* shader_path, const char* shader_name, unsigned int push_constant_size, int stack_depth, int prim_types, bool compressed_lists, bool half_eval) {
     auto code = readFile(shader_path);
     VkShaderModule module = createShaderModule(init, code, shader_name);
     if (module == VK_NULL_HANDLE) abort();
@@ -221,6 +258,21 @@ Pipeline create_compute_pipeline(Init& init, const char* shader_path, const char
     Pipeline pipeline{};
     VK_CHECK(vkCreatePipelineLayout(init.device, &layout_info, nullptr, &pipeline.layout));
 
+    // STACK_DEPTH, PRIM_TYPES, COMPRESSED_LISTS and HALF_EVAL
+    int spec_constants[4] = { stack_depth, prim_types, compressed_lists, half_eval };
+    VkSpecializationMapEntry map_entries[] = {
+            { .constantID = 1, .offset = 0, .size = sizeof(int) },
+            { .constantID = 2, .offset = sizeof(int), .size = sizeof(int) },
+            { .constantID = 3, .offset = 2 * sizeof(int), .size = sizeof(VkBool32) },
+            { .constantID = 5, .offset = 3 * sizeof(int), .size = sizeof(VkBool32) }
+    };
+    VkSpecializationInfo spec_info = {
+            .mapEntryCount = 4,
+            .pMapEntries = map_entries,
+            .dataSize = sizeof(spec_constants),
+            .pData = spec_constants
+    };
+
     VkComputePipelineCreateInfo pipeline_info =  {
             .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
             .pNext = nullptr,
@@ -232,20 +284,132 @@ Pipeline create_compute_pipeline(Init& init, const char* shader_path, const char
                     .stage = VK_SHADER_STAGE_COMPUTE_BIT,
                     .module = module,
                     .pName = "main",
-                    .pSpecializationInfo = nullptr
+                    .pSpecializationInfo = &spec_info
             },
             .layout = pipeline.layout,
             .basePipelineHandle = VK_NULL_HANDLE,
             .basePipelineIndex = -1
     };
-    VK_CHECK(vkCreateComputePipelines(init.device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline.pipe));
+    VK_CHECK(vkCreateComputePipelines(init.device, init.pipeline_cache, 1, &pipeline_info, nullptr, &pipeline.pipe));
 
     return pipeline;
 }
 
+void destroy_pipeline(Init& init, Pipeline& pipeline) {
+    init.disp.destroyPipeline(pipeline.pipe, nullptr);
+    init.disp.destroyPipelineLayout(pipeline.layout, nullptr);
+    pipeline = {};
+}
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ((const uint8_t*)data)[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// The cache file starts with this header, the driver data is only reused on the same device and with the same shaders.
+struct PipelineCacheHeader {
+    uint32_t magic;
+    uint32_t data_size;
+    uint8_t device_uuid[VK_UUID_SIZE];
+    uint64_t spirv_hash;
+};
+
+static const uint32_t PIPELINE_CACHE_MAGIC = 0x4c505043; // "LPPC"
+
+static std::string pipeline_cache_path() {
+    return spv_dir + "/pipeline_cache.bin";
+}
+
+// FNV-1a over the names and contents of all the SPIR-V files
+static uint64_t hash_spirv_files() {
+    std::vector<std::string> names;
+    for (const auto& entry : std::filesystem::directory_iterator(spv_dir)) {
+        if (entry.path().extension() == ".spv") names.push_back(entry.path().filename().string());
+    }
+    std::sort(names.begin(), names.end());
+
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    for (const std::string& name : names) {
+        std::vector<char> code = readFile(name);
+        hash = fnv1a(name.data(), name.size(), hash);
+        hash = fnv1a(code.data(), code.size(), hash);
+    }
+    return hash;
+}
+
+static PipelineCacheHeader get_pipeline_cache_header(Init& init) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(init.device.physical_device, &props);
+    PipelineCacheHeader header = {};
+    header.magic = PIPELINE_CACHE_MAGIC;
+    memcpy(header.device_uuid, props.pipelineCacheUUID, VK_UUID_SIZE);
+    header.spirv_hash = hash_spirv_files();
+    return header;
+}
+
+void load_pipeline_cache(Init& init) {
+    PipelineCacheHeader expected = get_pipeline_cache_header(init);
+
+    std::vector<char> data;
+    std::ifstream file(pipeline_cache_path(), std::ios::binary);
+    PipelineCacheHeader header = {};
+    if (file.is_open() && file.read((char*)&header, sizeof(header))
+        && header.magic == expected.magic
+        && memcmp(header.device_uuid, expected.device_uuid, VK_UUID_SIZE) == 0
+        && header.spirv_hash == expected.spirv_hash) {
+        data.resize(header.data_size);
+        if (!file.read(data.data(), (std::streamsize)data.size())) data.clear();
+    }
+
+    VkPipelineCacheCreateInfo create_info = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .initialDataSize = data.size(),
+            .pInitialData = data.empty() ? nullptr : data.data()
+    };
+    VK_CHECK(vkCreatePipelineCache(init.device, &create_info, nullptr, &init.pipeline_cache));
+}
+
+void save_pipeline_cache(Init& init) {
+    if (init.pipeline_cache == VK_NULL_HANDLE) return;
+
+    size_t size = 0;
+    VK_CHECK(vkGetPipelineCacheData(init.device, init.pipeline_cache, &size, nullptr));
+    std::vector<char> data(size);
+    VK_CHECK(vkGetPipelineCacheData(init.device, init.pipeline_cache, &size, data.data()));
+
+    PipelineCacheHeader header = get_pipeline_cache_header(init);
+    header.data_size = (uint32_t)size;
+
+    // a failed write only costs a recompilation on the next run
+    std::ofstream file(pipeline_cache_path(), std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        fprintf(stderr, "failed to write %s\n", pipeline_cache_path().c_str());
+        return;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write(data.data(), (std::streamsize)size);
+}
+
 size_t g_memory_usage = 0;
 
-Buffer create_buffer(Init& init, RenderData& data, unsigned int size, VkBufferUsageFlags usage, const char* name) {
+// buffers are shared with the async compute queue, this avoids queue family ownership transfers. queue_families must
+// outlive buffer_info
+static void share_with_compute_queue(const RenderData& data, VkBufferCreateInfo& buffer_info, uint32_t queue_families[2]) {
+    if (data.async_compute_available && data.compute_queue_family != data.graphics_queue_family) {
+        queue_families[0] = data.graphics_queue_family;
+        queue_families[1] = data.compute_queue_family;
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = 2;
+        buffer_info.pQueueFamilyIndices = queue_families;
+    }
+}
+
+Buffer create_buffer(Init& init, RenderData& data, size_t size, VkBufferUsageFlags usage, const char* name) {
     g_memory_usage += size;
 
     VkBufferCreateInfo buffer_info = {
@@ -258,6 +422,8 @@ Buffer create_buffer(Init& init, RenderData& data, unsigned int size, VkBufferUs
             .queueFamilyIndexCount = 0,
             .pQueueFamilyIndices = nullptr
     };
+    uint32_t queue_families[2];
+    share_with_compute_queue(data, buffer_info, queue_families);
     VmaAllocationCreateInfo alloc_info{};
     alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
 
@@ -282,6 +448,48 @@ Buffer create_buffer(Init& init, RenderData& data, unsigned int size, VkBufferUs
     return res;
 }
 
+// host-visible buffer that stays mapped for its whole lifetime, the GPU reads and writes it through its device address
+Buffer create_mapped_buffer(Init& init, RenderData& data, size_t size, VkBufferUsageFlags usage, VmaAllocationCreateFlags host_access, const char* name) {
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .size = size,
+            .usage = usage | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = 0,
+            .pQueueFamilyIndices = nullptr
+    };
+    // the staging ring is read by the transfers of both queues
+    uint32_t queue_families[2];
+    share_with_compute_queue(data, buffer_info, queue_families);
+    VmaAllocationCreateInfo alloc_info{};
+    alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
+    alloc_info.flags = host_access | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+    Buffer res{};
+    VmaAllocationInfo info;
+    VK_CHECK(vmaCreateBuffer(data.alloc, &buffer_info, &alloc_info, &res.buf, &res.alloc, &info));
+    res.mapped = info.pMappedData;
+
+    VkBufferDeviceAddressInfo addr_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+            .pNext = nullptr,
+            .buffer = res.buf
+    };
+    res.address = vkGetBufferDeviceAddress(init.device.device, &addr_info);
+
+    VkDebugUtilsObjectNameInfoEXT name_info = {
+            .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT,
+            .objectType = VK_OBJECT_TYPE_BUFFER,
+            .objectHandle = (uint64_t)res.buf,
+            .pObjectName = name
+    };
+    VK_CHECK(init.disp.setDebugUtilsObjectNameEXT(&name_info));
+
+    return res;
+}
+
 BinaryOp::BinaryOp(float k, bool sign, unsigned int op) {
     uint32_t x = (uint32_t)sign;
     op &= 3u;